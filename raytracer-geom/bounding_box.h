@@ -0,0 +1,110 @@
+#pragma once
+
+#include "vector.h"
+#include "triangle.h"
+#include "sphere.h"
+
+#include <limits>
+#include <optional>
+
+class BoundingBox {
+public:
+    BoundingBox()
+        : min_(std::numeric_limits<Scalar>::infinity(), std::numeric_limits<Scalar>::infinity(),
+               std::numeric_limits<Scalar>::infinity()),
+          max_(-std::numeric_limits<Scalar>::infinity(), -std::numeric_limits<Scalar>::infinity(),
+               -std::numeric_limits<Scalar>::infinity()) {
+    }
+
+    BoundingBox(Vector min, Vector max) : min_(min), max_(max) {
+    }
+
+    const Vector& GetMin() const {
+        return min_;
+    }
+
+    const Vector& GetMax() const {
+        return max_;
+    }
+
+    bool IsEmpty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+
+    Vector GetCenter() const {
+        return (min_ + max_) / 2;
+    }
+
+    void Extend(const Vector& point) {
+        for (size_t i = 0; i != 3; ++i) {
+            min_[i] = std::min(min_[i], point[i]);
+            max_[i] = std::max(max_[i], point[i]);
+        }
+    }
+
+    void Extend(const BoundingBox& other) {
+        for (size_t i = 0; i != 3; ++i) {
+            min_[i] = std::min(min_[i], other.min_[i]);
+            max_[i] = std::max(max_[i], other.max_[i]);
+        }
+    }
+
+    void Pad(double eps) {
+        min_ -= Vector(eps, eps, eps);
+        max_ += Vector(eps, eps, eps);
+    }
+
+    double SurfaceArea() const {
+        if (IsEmpty()) {
+            return 0;
+        }
+        Vector d = max_ - min_;
+        return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
+    // Slab test against a ray given by its origin and the inverse of a normalized direction.
+    // Returns the entry distance if the box is hit within [0, max_distance]. Axes producing NaN
+    // (origin on a slab plane of a zero direction component) are ignored, so the test never
+    // rejects a box it cannot decide about.
+    std::optional<double> Intersect(const Vector& origin, const Vector& inv_direction,
+                                    double max_distance) const {
+        double t_near = 0;
+        double t_far = max_distance;
+        for (size_t i = 0; i != 3; ++i) {
+            double t_0 = (min_[i] - origin[i]) * inv_direction[i];
+            double t_1 = (max_[i] - origin[i]) * inv_direction[i];
+            if (t_0 > t_1) {
+                std::swap(t_0, t_1);
+            }
+            t_near = t_0 > t_near ? t_0 : t_near;
+            t_far = t_1 < t_far ? t_1 : t_far;
+            if (t_near > t_far) {
+                return {};
+            }
+        }
+        return t_near;
+    }
+
+private:
+    Vector min_;
+    Vector max_;
+};
+
+// Boxes are padded so that every point the intersection routines in geometry.h may report
+// (they accept hits slightly outside the primitive) is still inside the box.
+inline BoundingBox GetBoundingBox(const PackedTriangle& triangle) {
+    BoundingBox box;
+    box.Extend(triangle.GetVertex());
+    box.Extend(triangle.GetVertex() + triangle.GetEdge1());
+    box.Extend(triangle.GetVertex() + triangle.GetEdge2());
+    Vector extent = box.GetMax() - box.GetMin();
+    box.Pad(1e-5 + 1e-6 * std::max({extent[0], extent[1], extent[2]}));
+    return box;
+}
+
+inline BoundingBox GetBoundingBox(const Sphere& sphere) {
+    double r = sphere.GetRadius();
+    BoundingBox box(sphere.GetCenter() - Vector(r, r, r), sphere.GetCenter() + Vector(r, r, r));
+    box.Pad(1e-5 + 1e-6 * r);
+    return box;
+}
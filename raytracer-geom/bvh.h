@@ -0,0 +1,446 @@
+#pragma once
+
+#include "bounding_box.h"
+#include "ray.h"
+#include "ray_packet.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Bounding volume hierarchy over an arbitrary set of primitives, built with the binned surface
+// area heuristic. The hierarchy only knows primitive boxes; intersecting the primitives
+// themselves is left to the visitor passed to Traverse.
+class Bvh {
+public:
+    struct Node {
+        BoundingBox box;
+        // Index of the first primitive in GetIndices() for leaves, of the left child otherwise.
+        // The right child always follows the left one.
+        uint32_t first = 0;
+        // Number of primitives in a leaf; zero for inner nodes.
+        uint32_t count = 0;
+    };
+
+    // Nodes and primitive indices of a hierarchy that need not be owned by a Bvh, such as one
+    // stored in a mapped file.
+    struct View {
+        std::span<const Node> nodes;
+        std::span<const uint32_t> indices;
+    };
+
+    static constexpr size_t kMaxDepth = 48;
+    static constexpr size_t kMaxLeafSize = 4;
+    static constexpr size_t kBins = 16;
+    static constexpr double kTraversalCost = 1.0;
+    static constexpr double kIntersectionCost = 1.0;
+
+    Bvh() {
+    }
+
+    explicit Bvh(const std::vector<BoundingBox>& boxes) {
+        if (boxes.empty()) {
+            return;
+        }
+        indices_.resize(boxes.size());
+        std::vector<Vector> centers(boxes.size());
+        for (size_t i = 0; i != boxes.size(); ++i) {
+            indices_[i] = i;
+            centers[i] = boxes[i].GetCenter();
+        }
+        nodes_.reserve(2 * boxes.size());
+        nodes_.emplace_back();
+        Build(0, 0, boxes.size(), 0, boxes, centers);
+        nodes_.shrink_to_fit();
+    }
+
+    const std::vector<Node>& GetNodes() const {
+        return nodes_;
+    }
+
+    // Recomputes the node boxes after primitives moved, keeping the topology. Children always
+    // come after their parent in GetNodes(), so one backward pass is enough.
+    void Refit(const std::vector<BoundingBox>& boxes) {
+        for (size_t i = nodes_.size(); i-- != 0;) {
+            Node& node = nodes_[i];
+            BoundingBox box;
+            if (node.count != 0) {
+                for (uint32_t j = node.first; j != node.first + node.count; ++j) {
+                    box.Extend(boxes[indices_[j]]);
+                }
+            } else {
+                box = nodes_[node.first].box;
+                box.Extend(nodes_[node.first + 1].box);
+            }
+            node.box = box;
+        }
+    }
+
+    // Expected cost of a random ray hitting the root, by the surface area heuristic. Refitting
+    // keeps the topology, so comparing this to its value after the build tells how much the
+    // hierarchy degraded.
+    double GetCost() const {
+        if (nodes_.empty() || !(nodes_[0].box.SurfaceArea() > 0)) {
+            return 0;
+        }
+        double cost = 0;
+        for (const auto& node : nodes_) {
+            cost += node.box.SurfaceArea() *
+                    (node.count != 0 ? kIntersectionCost * node.count : kTraversalCost);
+        }
+        return cost / nodes_[0].box.SurfaceArea();
+    }
+
+    const std::vector<uint32_t>& GetIndices() const {
+        return indices_;
+    }
+
+    View GetView() const {
+        return {nodes_, indices_};
+    }
+
+    // Visits the primitives whose boxes are hit by `ray` no farther than `limit`, nearest nodes
+    // first. `visit(primitive)` may lower `limit` to prune the rest of the traversal and returns
+    // true to stop it altogether. Distances are measured along the normalized ray direction.
+    template <class Visitor>
+    void Traverse(const Ray& ray, double& limit, Visitor&& visit) const {
+        Traverse(GetView(), ray, limit, visit);
+    }
+
+    template <class Visitor>
+    static void Traverse(const View& view, const Ray& ray, double& limit, Visitor&& visit) {
+        if (view.nodes.empty()) {
+            return;
+        }
+        const Vector& origin = ray.GetOrigin();
+        Vector dir = Normalized(ray.GetDirection());
+        Vector inv_dir{1 / dir[0], 1 / dir[1], 1 / dir[2]};
+
+        auto root = view.nodes[0].box.Intersect(origin, inv_dir, limit);
+        if (root.has_value()) {
+            TraverseFrom(view, 0, *root, origin, inv_dir, limit, visit);
+        }
+    }
+
+    // Packet version of Traverse: `limits[k]` is the limit of lane k, and `visit(primitive, mask)`
+    // gets the lanes whose rays hit the leaf box. Child boxes are tested for all lanes at once,
+    // after interval arithmetic on the range of directions in the packet had a chance to reject
+    // them for the whole packet. A subtree that only one lane enters is left to the single ray
+    // traversal.
+    template <class Visitor>
+    void TraversePacket(const RayPacket& packet, std::array<double, RayPacket::kSize>& limits,
+                        Visitor&& visit) const {
+        using Mask = RayPacket::Mask;
+        if (nodes_.empty() || packet.size == 0) {
+            return;
+        }
+        PacketData data;
+        data.origin = packet.origin;
+        data.coherent = true;
+        for (size_t i = 0; i != 3; ++i) {
+            data.inv_lo[i] = std::numeric_limits<double>::infinity();
+            data.inv_hi[i] = -std::numeric_limits<double>::infinity();
+        }
+        for (size_t k = 0; k != RayPacket::kSize; ++k) {
+            Vector dir = Normalized(packet.GetDirection(k));
+            for (size_t i = 0; i != 3; ++i) {
+                data.inv_dir[i][k] = 1 / dir[i];
+                if (k < packet.size) {
+                    data.inv_lo[i] = std::min(data.inv_lo[i], data.inv_dir[i][k]);
+                    data.inv_hi[i] = std::max(data.inv_hi[i], data.inv_dir[i][k]);
+                }
+            }
+        }
+        for (size_t i = 0; i != 3; ++i) {
+            data.coherent = data.coherent && std::isfinite(data.inv_lo[i]) &&
+                            std::isfinite(data.inv_hi[i]) &&
+                            (data.inv_lo[i] > 0 || data.inv_hi[i] < 0);
+        }
+
+        struct Entry {
+            uint32_t index;
+            Mask mask;
+            double distance;
+        };
+        std::array<Entry, kMaxDepth + 2> stack;
+        size_t size = 0;
+        double root_distance;
+        Mask root = IntersectPacket(nodes_[0].box, data, limits, packet.GetMask(), root_distance);
+        if (root != 0) {
+            stack[size++] = {0, root, root_distance};
+        }
+
+        while (size != 0) {
+            Entry entry = stack[--size];
+            if (entry.distance > GetMaxLimit(limits, entry.mask)) {
+                continue;
+            }
+            if ((entry.mask & (entry.mask - 1)) == 0) {
+                // A single lane is left: the packet no longer pays off.
+                size_t lane = std::countr_zero(entry.mask);
+                Vector inv_dir(data.inv_dir[0][lane], data.inv_dir[1][lane],
+                               data.inv_dir[2][lane]);
+                TraverseFrom(GetView(), entry.index, entry.distance, data.origin, inv_dir,
+                             limits[lane],
+                             [&](uint32_t primitive) {
+                                 visit(primitive, entry.mask);
+                                 return false;
+                             });
+                continue;
+            }
+            const Node& node = nodes_[entry.index];
+            if (node.count != 0) {
+                for (uint32_t i = node.first; i != node.first + node.count; ++i) {
+                    visit(indices_[i], entry.mask);
+                }
+                continue;
+            }
+            double left_distance, right_distance;
+            Mask left = IntersectPacket(nodes_[node.first].box, data, limits, entry.mask,
+                                        left_distance);
+            Mask right = IntersectPacket(nodes_[node.first + 1].box, data, limits, entry.mask,
+                                         right_distance);
+            Entry near{node.first, left, left_distance};
+            Entry far{node.first + 1, right, right_distance};
+            if (right != 0 && (left == 0 || right_distance < left_distance)) {
+                std::swap(near, far);
+            }
+            if (far.mask != 0) {
+                stack[size++] = far;
+            }
+            if (near.mask != 0) {
+                stack[size++] = near;
+            }
+        }
+    }
+
+    // Passes every member to `visit`, which is how the scene cache stores and restores the
+    // hierarchy.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.nodes_);
+        visit(self.indices_);
+    }
+
+private:
+    // Single ray traversal of the subtree below `start`, whose box the ray enters at `distance`.
+    // Returns true if the visitor stopped it.
+    template <class Visitor>
+    static bool TraverseFrom(const View& view, uint32_t start, double distance,
+                             const Vector& origin, const Vector& inv_dir, double& limit,
+                             Visitor&& visit) {
+        const Node* nodes = view.nodes.data();
+        const uint32_t* indices = view.indices.data();
+        std::array<std::pair<uint32_t, double>, kMaxDepth + 2> stack;
+        size_t size = 0;
+        stack[size++] = {start, distance};
+
+        while (size != 0) {
+            auto [index, entry] = stack[--size];
+            if (entry > limit) {
+                continue;
+            }
+            const Node& node = nodes[index];
+            if (node.count != 0) {
+                for (uint32_t i = node.first; i != node.first + node.count; ++i) {
+                    if (visit(indices[i])) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+            auto left = nodes[node.first].box.Intersect(origin, inv_dir, limit);
+            auto right = nodes[node.first + 1].box.Intersect(origin, inv_dir, limit);
+            if (left.has_value() && right.has_value()) {
+                if (*left <= *right) {
+                    stack[size++] = {node.first + 1, *right};
+                    stack[size++] = {node.first, *left};
+                } else {
+                    stack[size++] = {node.first, *left};
+                    stack[size++] = {node.first + 1, *right};
+                }
+            } else if (left.has_value()) {
+                stack[size++] = {node.first, *left};
+            } else if (right.has_value()) {
+                stack[size++] = {node.first + 1, *right};
+            }
+        }
+        return false;
+    }
+
+    struct PacketData {
+        Vector origin;
+        alignas(32) std::array<std::array<double, RayPacket::kSize>, 3> inv_dir;
+        std::array<double, 3> inv_lo;
+        std::array<double, 3> inv_hi;
+        // Every direction component keeps its sign across the packet, so the interval test
+        // applies.
+        bool coherent;
+    };
+
+    static double GetMaxLimit(const std::array<double, RayPacket::kSize>& limits,
+                              RayPacket::Mask mask) {
+        double max_limit = -std::numeric_limits<double>::infinity();
+        for (; mask != 0; mask &= mask - 1) {
+            max_limit = std::max(max_limit, limits[std::countr_zero(mask)]);
+        }
+        return max_limit;
+    }
+
+    // Lanes of `mask` whose rays hit `box` within their limits, by the same slab test as
+    // BoundingBox::Intersect. `distance` receives the smallest entry distance among them.
+    static RayPacket::Mask IntersectPacket(const BoundingBox& box, const PacketData& data,
+                                           const std::array<double, RayPacket::kSize>& limits,
+                                           RayPacket::Mask mask, double& distance) {
+        constexpr size_t kSize = RayPacket::kSize;
+        if (data.coherent) {
+            // The entry distance of every ray is at least `lower`, the exit at most `upper`.
+            double lower = 0;
+            double upper = GetMaxLimit(limits, mask);
+            for (size_t i = 0; i != 3; ++i) {
+                double b_0 = box.GetMin()[i] - data.origin[i];
+                double b_1 = box.GetMax()[i] - data.origin[i];
+                if (data.inv_lo[i] < 0) {
+                    std::swap(b_0, b_1);
+                }
+                lower = std::max(lower, std::min(b_0 * data.inv_lo[i], b_0 * data.inv_hi[i]));
+                upper = std::min(upper, std::max(b_1 * data.inv_lo[i], b_1 * data.inv_hi[i]));
+            }
+            if (lower > upper) {
+                return 0;
+            }
+        }
+
+        alignas(32) std::array<double, kSize> t_near;
+        alignas(32) std::array<double, kSize> t_far;
+        for (size_t k = 0; k != kSize; ++k) {
+            t_near[k] = 0;
+            t_far[k] = limits[k];
+        }
+        for (size_t i = 0; i != 3; ++i) {
+            double b_0 = box.GetMin()[i] - data.origin[i];
+            double b_1 = box.GetMax()[i] - data.origin[i];
+            for (size_t k = 0; k != kSize; ++k) {
+                double t_0 = b_0 * data.inv_dir[i][k];
+                double t_1 = b_1 * data.inv_dir[i][k];
+                double lo = t_0 > t_1 ? t_1 : t_0;
+                double hi = t_0 > t_1 ? t_0 : t_1;
+                t_near[k] = lo > t_near[k] ? lo : t_near[k];
+                t_far[k] = hi < t_far[k] ? hi : t_far[k];
+            }
+        }
+        RayPacket::Mask hit = 0;
+        for (size_t k = 0; k != kSize; ++k) {
+            hit |= static_cast<RayPacket::Mask>(t_near[k] <= t_far[k]) << k;
+        }
+        hit &= mask;
+        distance = std::numeric_limits<double>::infinity();
+        for (RayPacket::Mask rest = hit; rest != 0; rest &= rest - 1) {
+            distance = std::min(distance, t_near[std::countr_zero(rest)]);
+        }
+        return hit;
+    }
+
+    struct Bin {
+        BoundingBox box;
+        size_t count = 0;
+    };
+
+    void Build(uint32_t node_index, uint32_t begin, uint32_t end, size_t depth,
+               const std::vector<BoundingBox>& boxes, const std::vector<Vector>& centers) {
+        BoundingBox box, center_box;
+        for (uint32_t i = begin; i != end; ++i) {
+            box.Extend(boxes[indices_[i]]);
+            center_box.Extend(centers[indices_[i]]);
+        }
+        nodes_[node_index].box = box;
+        nodes_[node_index].first = begin;
+        nodes_[node_index].count = end - begin;
+
+        size_t count = end - begin;
+        if (count == 1 || depth + 1 >= kMaxDepth) {
+            return;
+        }
+
+        double leaf_cost = kIntersectionCost * count;
+        double best_cost = std::numeric_limits<double>::infinity();
+        size_t best_axis = 0;
+        size_t best_split = 0;
+        for (size_t axis = 0; axis != 3; ++axis) {
+            double lo = center_box.GetMin()[axis];
+            double extent = center_box.GetMax()[axis] - lo;
+            if (!(extent > 0)) {
+                continue;
+            }
+            std::array<Bin, kBins> bins;
+            for (uint32_t i = begin; i != end; ++i) {
+                size_t b = BinIndex(centers[indices_[i]][axis], lo, extent);
+                bins[b].box.Extend(boxes[indices_[i]]);
+                ++bins[b].count;
+            }
+            // Sweep from the right to collect suffix areas, then from the left to evaluate.
+            std::array<double, kBins> right_area;
+            std::array<size_t, kBins> right_count;
+            BoundingBox acc;
+            size_t acc_count = 0;
+            for (size_t b = kBins - 1; b != 0; --b) {
+                acc.Extend(bins[b].box);
+                acc_count += bins[b].count;
+                right_area[b] = acc.SurfaceArea();
+                right_count[b] = acc_count;
+            }
+            acc = BoundingBox();
+            acc_count = 0;
+            for (size_t b = 1; b != kBins; ++b) {
+                acc.Extend(bins[b - 1].box);
+                acc_count += bins[b - 1].count;
+                if (acc_count == 0 || right_count[b] == 0) {
+                    continue;
+                }
+                double cost = kTraversalCost + kIntersectionCost *
+                                                   (acc.SurfaceArea() * acc_count +
+                                                    right_area[b] * right_count[b]) /
+                                                   box.SurfaceArea();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        if (best_split == 0 || (count <= kMaxLeafSize && best_cost >= leaf_cost)) {
+            return;
+        }
+
+        double lo = center_box.GetMin()[best_axis];
+        double extent = center_box.GetMax()[best_axis] - lo;
+        auto middle = std::partition(
+            indices_.begin() + begin, indices_.begin() + end, [&](uint32_t primitive) {
+                return BinIndex(centers[primitive][best_axis], lo, extent) < best_split;
+            });
+        uint32_t split = middle - indices_.begin();
+
+        uint32_t left = nodes_.size();
+        nodes_.emplace_back();
+        nodes_.emplace_back();
+        nodes_[node_index].first = left;
+        nodes_[node_index].count = 0;
+        Build(left, begin, split, depth + 1, boxes, centers);
+        Build(left + 1, split, end, depth + 1, boxes, centers);
+    }
+
+    static size_t BinIndex(double value, double lo, double extent) {
+        auto b = static_cast<size_t>((value - lo) / extent * kBins);
+        return std::min(b, kBins - 1);
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> indices_;
+};
@@ -1,48 +1,61 @@
+#pragma once
+
 #include "ray.h"
 #include "vector.h"
 #include "sphere.h"
 #include "intersection.h"
 #include "triangle.h"
+#include "ray_packet.h"
 
 #include <optional>
+#include <type_traits>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+template <class T>
+std::optional<BasicHitPoint<T>> GetHitPoint(const BasicRay<T>& ray, const BasicSphere<T>& sphere) {
     auto dir = Normalized(ray.GetDirection());
-    Vector center_relative = sphere.GetCenter() - ray.GetOrigin();
-    Vector center_ray_closest = dir * DotProduct(dir, center_relative) / DotProduct(dir, dir);
+    BasicVector<T> center_relative = sphere.GetCenter() - ray.GetOrigin();
+    BasicVector<T> center_ray_closest =
+        dir * DotProduct(dir, center_relative) / DotProduct(dir, dir);
     if (Length(center_ray_closest - center_relative) > sphere.GetRadius() + 1e-6) {
         return {};
     }
-    double dist =
-        std::sqrt(std::max<double>(0, sphere.GetRadius() * sphere.GetRadius() -
+    T dist = std::sqrt(std::max<T>(0, sphere.GetRadius() * sphere.GetRadius() -
                                           Length(center_ray_closest - center_relative) *
                                               Length(center_ray_closest - center_relative)));
     auto l = center_ray_closest - dist * dir;
-    auto r = center_ray_closest + dist * dir;
-    bool inside_of_sphere = Length(center_relative) < sphere.GetRadius();
     if (DotProduct(l, dir) > 1e-4) {
-        Vector norm = Normalized(l - center_relative) * (inside_of_sphere ? -1 : 1);
-        return Intersection(l + ray.GetOrigin() + norm * 1e-5, norm, Length(l));
+        return BasicHitPoint<T>{Length(l)};
     }
+    auto r = center_ray_closest + dist * dir;
     if (DotProduct(r, dir) > 1e-4) {
-        Vector norm = Normalized(r - center_relative) * (inside_of_sphere ? -1 : 1);
-        return Intersection(r + ray.GetOrigin() + norm * 1e-5, norm, Length(r));
+        return BasicHitPoint<T>{Length(r)};
     }
     return {};
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
-    Vector edge_1, edge_2, h, s, q;
-    float a, f, u, v;
-    edge_1 = triangle.GetVertex(1) - triangle.GetVertex(0);
-    edge_2 = triangle.GetVertex(2) - triangle.GetVertex(0);
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+                                     const BasicHitPoint<T>& hit) {
+    BasicVector<T> point = ray.GetOrigin() + Normalized(ray.GetDirection()) * hit.distance;
+    bool inside_of_sphere = Length(sphere.GetCenter() - ray.GetOrigin()) < sphere.GetRadius();
+    BasicVector<T> norm = Normalized(point - sphere.GetCenter()) * (inside_of_sphere ? -1 : 1);
+    return BasicIntersection<T>(point + norm * 1e-5, norm, hit.distance);
+}
+
+template <class T>
+std::optional<BasicHitPoint<T>> GetHitPoint(const BasicRay<T>& ray,
+                                            const BasicPackedTriangle<T>& triangle) {
+    BasicVector<T> h, s, q;
+    T a, f, u, v;
+    const BasicVector<T>& edge_1 = triangle.GetEdge1();
+    const BasicVector<T>& edge_2 = triangle.GetEdge2();
     h = CrossProduct(ray.GetDirection(), edge_2);
     a = DotProduct(edge_1, h);
     if (a > -1e-6 && a < 1e-6) {
         return {};
     }
     f = 1.0 / a;
-    s = ray.GetOrigin() - triangle.GetVertex(0);
+    s = ray.GetOrigin() - triangle.GetVertex();
     u = f * DotProduct(s, h);
     if (u < 0.0 || u > 1.0) {
         return {};
@@ -52,47 +65,127 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
     if (v < 0.0 || u + v > 1.0) {
         return {};
     }
-    float t = f * DotProduct(edge_2, q);
-    if (t > 1e-6) {
-        Vector dir = Normalized(ray.GetDirection());
-        Vector perp = Normalized(CrossProduct(edge_1, edge_2));
-        double a_0 = DotProduct(perp, s);
-        double a_1 = DotProduct(perp, s + dir);
-        double len = -a_0 / (a_1 - a_0);
-        Vector intersection = ray.GetOrigin() + len * dir;
-        Vector normal = DotProduct(perp, ray.GetDirection()) < 0 ? perp : -perp;
-        double distance = Length(ray.GetOrigin() - intersection);
-        return Intersection(intersection + normal * 1e-5, normal, distance);
+    T t = f * DotProduct(edge_2, q);
+    if (!(t > 1e-6)) {
+        return {};
     }
-    return {};
+    const BasicVector<T>& perp = triangle.GetNormal();
+    T len = -DotProduct(perp, s) / DotProduct(perp, Normalized(ray.GetDirection()));
+    return BasicHitPoint<T>{std::abs(len), u, v};
+}
+
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray,
+                                     const BasicPackedTriangle<T>& triangle,
+                                     const BasicHitPoint<T>& hit) {
+    BasicVector<T> point =
+        triangle.GetVertex() + triangle.GetEdge1() * hit.u + triangle.GetEdge2() * hit.v;
+    const BasicVector<T>& perp = triangle.GetNormal();
+    BasicVector<T> normal = DotProduct(perp, ray.GetDirection()) < 0 ? perp : -perp;
+    return BasicIntersection<T>(point + normal * 1e-5, normal, hit.distance);
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicSphere<T>& sphere) {
+    auto hit = GetHitPoint(ray, sphere);
+    if (!hit.has_value()) {
+        return {};
+    }
+    return GetIntersection(ray, sphere, *hit);
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicPackedTriangle<T>& triangle) {
+    auto hit = GetHitPoint(ray, triangle);
+    if (!hit.has_value()) {
+        return {};
+    }
+    return GetIntersection(ray, triangle, *hit);
+}
+
+// Lanes of `mask` whose rays pass the edge and distance tests of GetHitPoint for this triangle,
+// evaluated for all lanes at once. The rays share their origin, so `s` and `q` are shared as
+// well. The expressions are those of GetHitPoint, so no lane it would accept is dropped;
+// GetHitPoint on the remaining lanes yields the actual hits.
+inline RayPacket::Mask FilterIntersections(const RayPacket& packet, const PackedTriangle& triangle,
+                                           RayPacket::Mask mask) {
+    constexpr size_t kSize = RayPacket::kSize;
+    const Vector& edge_1 = triangle.GetEdge1();
+    const Vector& edge_2 = triangle.GetEdge2();
+    Vector s = packet.origin - triangle.GetVertex();
+    Vector q = CrossProduct(s, edge_1);
+    Scalar t_dot = DotProduct(edge_2, q);
+    const auto& d = packet.directions;
+    alignas(32) std::array<bool, kSize> pass;
+    for (size_t k = 0; k != kSize; ++k) {
+        Vector h{d[1][k] * edge_2[2] - d[2][k] * edge_2[1],
+                 d[2][k] * edge_2[0] - d[0][k] * edge_2[2],
+                 d[0][k] * edge_2[1] - d[1][k] * edge_2[0]};
+        Scalar a = DotProduct(edge_1, h);
+        Scalar f = 1.0 / a;
+        Scalar u = f * DotProduct(s, h);
+        Scalar v = f * (d[0][k] * q[0] + d[1][k] * q[1] + d[2][k] * q[2]);
+        Scalar t = f * t_dot;
+        pass[k] = !(a > -1e-6 && a < 1e-6) && !(u < 0.0 || u > 1.0) && !(v < 0.0 || u + v > 1.0) &&
+                  t > 1e-6;
+    }
+    RayPacket::Mask result = 0;
+    for (size_t k = 0; k != kSize; ++k) {
+        result |= static_cast<RayPacket::Mask>(pass[k]) << k;
+    }
+    return result & mask;
+}
+
+// Any-hit tests used for shadow rays: whether the primitive is hit no farther than max_distance.
+template <class T>
+bool HasIntersection(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+                     std::type_identity_t<T> max_distance) {
+    auto hit = GetHitPoint(ray, sphere);
+    return hit.has_value() && !(hit->distance > max_distance);
+}
+
+template <class T>
+bool HasIntersection(const BasicRay<T>& ray, const BasicPackedTriangle<T>& triangle,
+                     std::type_identity_t<T> max_distance) {
+    auto hit = GetHitPoint(ray, triangle);
+    return hit.has_value() && !(hit->distance > max_distance);
 }
 
-std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
+template <class T>
+std::optional<BasicVector<T>> Refract(const BasicVector<T>& ray, const BasicVector<T>& normal,
+                                      std::type_identity_t<T> eta) {
     // std::cout << "refract " << ray << " " << normal << "\n";
-    double cos = -DotProduct(ray, normal) / Length(ray) / Length(normal);
-    double sin = std::sqrt(1 - cos * cos);
+    T cos = -DotProduct(ray, normal) / Length(ray) / Length(normal);
+    T sin = std::sqrt(1 - cos * cos);
     if (sin * eta - 1 > -1e-6) {
         return {};
     }
-    Vector projection = normal * DotProduct(normal, ray) / DotProduct(normal, normal);
-    Vector delta = ray - projection;
-    double coefficient = eta * cos / std::sqrt(1 - sin * sin * eta * eta);
+    BasicVector<T> projection = normal * DotProduct(normal, ray) / DotProduct(normal, normal);
+    BasicVector<T> delta = ray - projection;
+    T coefficient = eta * cos / std::sqrt(1 - sin * sin * eta * eta);
     // std::cout << "ret " << Normalized(projection + coefficient * delta) << "\n";
     return Normalized(projection + coefficient * delta);
 }
 
-Vector Reflect(const Vector& ray, const Vector& normal) {
-    Vector projection = normal * DotProduct(normal, ray) / DotProduct(normal, normal);
+template <class T>
+BasicVector<T> Reflect(const BasicVector<T>& ray, const BasicVector<T>& normal) {
+    BasicVector<T> projection = normal * DotProduct(normal, ray) / DotProduct(normal, normal);
     return ray - 2 * projection;
 }
 
-Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
-    const Vector& a = triangle.GetVertex(0);
-    const Vector& b = triangle.GetVertex(1);
-    const Vector& c = triangle.GetVertex(2);
-    Vector a_proj = DotProduct(a - b, c - b) / DotProduct(c - b, c - b) * (c - b) + b;
-    float a_coord = 1 - DotProduct(a_proj - a, point - a) / DotProduct(a_proj - a, a_proj - a);
-    Vector b_proj = DotProduct(b - c, a - c) / DotProduct(a - c, a - c) * (a - c) + c;
-    float b_coord = 1 - DotProduct(b_proj - b, point - b) / DotProduct(b_proj - b, b_proj - b);
+template <class T>
+BasicVector<T> GetBarycentricCoords(const BasicPackedTriangle<T>& triangle,
+                                    const BasicVector<T>& point) {
+    const BasicVector<T>& edge_1 = triangle.GetEdge1();
+    const BasicVector<T>& edge_2 = triangle.GetEdge2();
+    BasicVector<T> point_rel = point - triangle.GetVertex();
+    BasicVector<T> c_b = edge_2 - edge_1;
+    BasicVector<T> a_height = DotProduct(-edge_1, c_b) / DotProduct(c_b, c_b) * c_b + edge_1;
+    T a_coord = 1 - DotProduct(a_height, point_rel) / DotProduct(a_height, a_height);
+    BasicVector<T> b_height =
+        DotProduct(-c_b, -edge_2) / DotProduct(edge_2, edge_2) * -edge_2 + c_b;
+    T b_coord = 1 - DotProduct(b_height, point_rel - edge_1) / DotProduct(b_height, b_height);
     return {a_coord, b_coord, 1 - a_coord - b_coord};
 }
@@ -2,26 +2,41 @@
 
 #include "vector.h"
 
-class Intersection {
+template <class T>
+class BasicIntersection {
 public:
-    Intersection(Vector pos, Vector norm, double dist)
+    constexpr BasicIntersection(BasicVector<T> pos, BasicVector<T> norm, T dist)
         : position_(pos), normal_(norm), distance_(dist) {
     }
 
-    const Vector& GetPosition() const {
+    constexpr const BasicVector<T>& GetPosition() const {
         return position_;
     }
 
-    const Vector& GetNormal() const {
+    constexpr const BasicVector<T>& GetNormal() const {
         return normal_;
     }
 
-    double GetDistance() const {
+    constexpr T GetDistance() const {
         return distance_;
     }
 
 private:
-    Vector position_;
-    Vector normal_;
-    double distance_;
+    BasicVector<T> position_;
+    BasicVector<T> normal_;
+    T distance_;
 };
+
+using Intersection = BasicIntersection<Scalar>;
+
+// What the closest-hit search keeps per candidate: the distance along the ray and, for triangles,
+// the barycentric coordinates of the hit with respect to the second and third vertex. Position
+// and normal are only computed for the hit that wins, see GetIntersection in geometry.h.
+template <class T>
+struct BasicHitPoint {
+    T distance;
+    T u = 0;
+    T v = 0;
+};
+
+using HitPoint = BasicHitPoint<Scalar>;
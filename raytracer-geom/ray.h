@@ -2,20 +2,24 @@
 
 #include "vector.h"
 
-class Ray {
+template <class T>
+class BasicRay {
 public:
-    Ray(Vector origin, Vector direction) : origin_(origin), direction_(direction) {
+    constexpr BasicRay(BasicVector<T> origin, BasicVector<T> direction)
+        : origin_(origin), direction_(direction) {
     }
 
-    const Vector& GetOrigin() const {
+    constexpr const BasicVector<T>& GetOrigin() const {
         return origin_;
     }
 
-    const Vector& GetDirection() const {
+    constexpr const BasicVector<T>& GetDirection() const {
         return direction_;
     }
 
 private:
-    Vector origin_;
-    Vector direction_;
+    BasicVector<T> origin_;
+    BasicVector<T> direction_;
 };
+
+using Ray = BasicRay<Scalar>;
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "ray.h"
+
+#include <array>
+#include <cstdint>
+
+// Up to kSize rays with a common origin, such as the primary rays of a block of pixels. Directions
+// are stored per axis, so a loop over the lanes of the packet maps onto SIMD registers.
+struct RayPacket {
+    static constexpr size_t kSize = 16;
+    // Bit k stands for lane k.
+    using Mask = uint32_t;
+    static_assert(kSize <= 32);
+
+    explicit RayPacket(const Vector& origin) : origin(origin) {
+    }
+
+    void Add(const Vector& direction) {
+        for (size_t i = 0; i != 3; ++i) {
+            directions[i][size] = direction[i];
+        }
+        ++size;
+    }
+
+    Vector GetDirection(size_t lane) const {
+        return {directions[0][lane], directions[1][lane], directions[2][lane]};
+    }
+
+    Ray GetRay(size_t lane) const {
+        return Ray(origin, GetDirection(lane));
+    }
+
+    Mask GetMask() const {
+        return static_cast<Mask>((uint64_t{1} << size) - 1);
+    }
+
+    Vector origin;
+    alignas(32) std::array<std::array<Scalar, kSize>, 3> directions{};
+    size_t size = 0;
+};
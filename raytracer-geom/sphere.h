@@ -2,20 +2,23 @@
 
 #include "vector.h"
 
-class Sphere {
+template <class T>
+class BasicSphere {
 public:
-    Sphere(Vector center, double radius) : center_(center), radius_(radius) {
+    constexpr BasicSphere(BasicVector<T> center, T radius) : center_(center), radius_(radius) {
     }
 
-    const Vector& GetCenter() const {
+    constexpr const BasicVector<T>& GetCenter() const {
         return center_;
     }
 
-    double GetRadius() const {
+    constexpr T GetRadius() const {
         return radius_;
     }
 
 private:
-    Vector center_;
-    double radius_;
+    BasicVector<T> center_;
+    T radius_;
 };
+
+using Sphere = BasicSphere<Scalar>;
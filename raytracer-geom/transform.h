@@ -0,0 +1,71 @@
+#pragma once
+
+#include "vector.h"
+#include "ray.h"
+
+#include <array>
+#include <stdexcept>
+
+// Affine transform: a linear part given by its rows followed by a translation.
+class Transform {
+public:
+    Transform() : rows_{Vector{1, 0, 0}, Vector{0, 1, 0}, Vector{0, 0, 1}} {
+    }
+
+    // Row-major 3x4 matrix: m[4 * i + j] for j < 3 is the linear part, m[4 * i + 3] the offset.
+    explicit Transform(const std::array<double, 12>& m)
+        : rows_{Vector(m[0], m[1], m[2]), Vector(m[4], m[5], m[6]), Vector(m[8], m[9], m[10])},
+          translation_(m[3], m[7], m[11]) {
+    }
+
+    Transform(std::array<Vector, 3> rows, Vector translation)
+        : rows_(rows), translation_(translation) {
+    }
+
+    Vector ApplyToPoint(const Vector& p) const {
+        return ApplyToVector(p) + translation_;
+    }
+
+    Vector ApplyToVector(const Vector& v) const {
+        return {DotProduct(rows_[0], v), DotProduct(rows_[1], v), DotProduct(rows_[2], v)};
+    }
+
+    // Multiplies by the transposed linear part. Normals are carried to the other space by the
+    // transposed inverse, so `inverse.ApplyTransposed(n)` maps a normal through this transform.
+    Vector ApplyTransposed(const Vector& v) const {
+        return rows_[0] * v[0] + rows_[1] * v[1] + rows_[2] * v[2];
+    }
+
+    Ray ApplyToRay(const Ray& ray) const {
+        return Ray(ApplyToPoint(ray.GetOrigin()), ApplyToVector(ray.GetDirection()));
+    }
+
+    Transform Inverse() const {
+        // Rows of the inverse are the columns of the adjugate divided by the determinant.
+        Vector c_0 = CrossProduct(rows_[1], rows_[2]);
+        Vector c_1 = CrossProduct(rows_[2], rows_[0]);
+        Vector c_2 = CrossProduct(rows_[0], rows_[1]);
+        double det = DotProduct(rows_[0], c_0);
+        if (det == 0) {
+            throw std::runtime_error("Transform is not invertible");
+        }
+        std::array<Vector, 3> rows{Vector{c_0[0], c_1[0], c_2[0]} / det,
+                                   Vector{c_0[1], c_1[1], c_2[1]} / det,
+                                   Vector{c_0[2], c_1[2], c_2[2]} / det};
+        Transform inverse(rows, Vector{0, 0, 0});
+        inverse.translation_ = -inverse.ApplyToVector(translation_);
+        return inverse;
+    }
+
+    const std::array<Vector, 3>& GetRows() const {
+        return rows_;
+    }
+
+    const Vector& GetTranslation() const {
+        return translation_;
+    }
+
+private:
+    std::array<Vector, 3> rows_;
+    Vector translation_;
+};
@@ -4,27 +4,67 @@
 
 #include <array>
 
-class Triangle {
+template <class T>
+class BasicTriangle {
 public:
-    Triangle(std::initializer_list<Vector> list) {
-        auto it = list.begin();
-        vertices_[0] = *it;
-        vertices_[1] = *++it;
-        vertices_[2] = *++it;
-    }
-
-    double Area() const {
-        double a = Length((vertices_[0] - vertices_[1]));
-        double b = Length((vertices_[1] - vertices_[2]));
-        double c = Length((vertices_[2] - vertices_[0]));
-        double half_p = (a + b + c) / 2;
+    constexpr BasicTriangle(const BasicVector<T>& a, const BasicVector<T>& b,
+                            const BasicVector<T>& c)
+        : vertices_{a, b, c} {
+    }
+
+    T Area() const {
+        T a = Length((vertices_[0] - vertices_[1]));
+        T b = Length((vertices_[1] - vertices_[2]));
+        T c = Length((vertices_[2] - vertices_[0]));
+        T half_p = (a + b + c) / 2;
         return std::sqrt(half_p * (half_p - a) * (half_p - b) * (half_p - c));
     }
 
-    const Vector& GetVertex(size_t ind) const {
+    constexpr const BasicVector<T>& GetVertex(size_t ind) const {
         return vertices_[ind];
     }
 
 private:
-    std::array<Vector, 3> vertices_;
+    std::array<BasicVector<T>, 3> vertices_;
 };
+
+// Triangle in the form the intersection routines consume: the first vertex, the two edges leaving
+// it and the unit normal, computed once instead of on every test.
+template <class T>
+class BasicPackedTriangle {
+public:
+    constexpr BasicPackedTriangle() {
+    }
+
+    explicit BasicPackedTriangle(const BasicTriangle<T>& triangle)
+        : vertex_(triangle.GetVertex(0)),
+          edge_1_(triangle.GetVertex(1) - triangle.GetVertex(0)),
+          edge_2_(triangle.GetVertex(2) - triangle.GetVertex(0)),
+          normal_(Normalized(CrossProduct(edge_1_, edge_2_))) {
+    }
+
+    constexpr const BasicVector<T>& GetVertex() const {
+        return vertex_;
+    }
+
+    constexpr const BasicVector<T>& GetEdge1() const {
+        return edge_1_;
+    }
+
+    constexpr const BasicVector<T>& GetEdge2() const {
+        return edge_2_;
+    }
+
+    constexpr const BasicVector<T>& GetNormal() const {
+        return normal_;
+    }
+
+private:
+    BasicVector<T> vertex_;
+    BasicVector<T> edge_1_;
+    BasicVector<T> edge_2_;
+    BasicVector<T> normal_;
+};
+
+using Triangle = BasicTriangle<Scalar>;
+using PackedTriangle = BasicPackedTriangle<Scalar>;
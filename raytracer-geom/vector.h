@@ -3,34 +3,43 @@
 #include <array>
 #include <cmath>
 #include <iostream>
-#include <initializer_list>
 #include <algorithm>
+#include <type_traits>
 
-class Vector {
+template <class T>
+class BasicVector {
 public:
-    Vector() : data_{0, 0, 0} {
+    using Scalar = T;
+
+    constexpr BasicVector() : data_{0, 0, 0} {
+    }
+
+    constexpr BasicVector(T x, T y, T z) : data_{x, y, z} {
     }
 
-    Vector(std::initializer_list<double> list) {
-        auto it = list.begin();
-        data_[0] = *it;
-        data_[1] = *++it;
-        data_[2] = *++it;
+    constexpr BasicVector(std::array<T, 3> data) : data_(data) {
     }
 
-    Vector(std::array<double, 3> data) : data_(data) {
+    template <class U>
+    constexpr explicit BasicVector(const std::array<U, 3>& data)
+        : data_{static_cast<T>(data[0]), static_cast<T>(data[1]), static_cast<T>(data[2])} {
     }
 
-    double& operator[](size_t ind) {
+    template <class U>
+    constexpr explicit BasicVector(const BasicVector<U>& other)
+        : data_{static_cast<T>(other[0]), static_cast<T>(other[1]), static_cast<T>(other[2])} {
+    }
+
+    constexpr T& operator[](size_t ind) {
         return data_[ind];
     }
 
-    double operator[](size_t ind) const {
+    constexpr T operator[](size_t ind) const {
         return data_[ind];
     }
 
     void Normalize() {
-        double hypot = std::__hypot3(data_[0], data_[1], data_[2]);
+        T hypot = std::hypot(data_[0], data_[1], data_[2]);
         if (hypot != 0) {
             data_[0] /= hypot;
             data_[1] /= hypot;
@@ -39,69 +48,93 @@ public:
     }
 
 private:
-    std::array<double, 3> data_;
+    std::array<T, 3> data_;
 };
 
-inline double DotProduct(const Vector& lhs, const Vector& rhs) {
+// Scalar type of the renderer; the float build defines RAYTRACER_FLOAT.
+#ifdef RAYTRACER_FLOAT
+using Scalar = float;
+#else
+using Scalar = double;
+#endif
+
+using Vector = BasicVector<Scalar>;
+
+template <class T>
+constexpr T DotProduct(const BasicVector<T>& lhs, const BasicVector<T>& rhs) {
     return lhs[0] * rhs[0] + lhs[1] * rhs[1] + lhs[2] * rhs[2];
 }
 
-inline Vector CrossProduct(const Vector& a, const Vector& b) {
+template <class T>
+constexpr BasicVector<T> CrossProduct(const BasicVector<T>& a, const BasicVector<T>& b) {
     return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
 }
 
-inline double Length(const Vector& vec) {
-    return std::__hypot3(vec[0], vec[1], vec[2]);
+template <class T>
+T Length(const BasicVector<T>& vec) {
+    return std::hypot(vec[0], vec[1], vec[2]);
 }
 
-inline Vector operator-(const Vector& l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator-(const BasicVector<T>& l, const BasicVector<T>& r) {
     return {l[0] - r[0], l[1] - r[1], l[2] - r[2]};
 }
 
-inline Vector operator-(const Vector& l) {
+template <class T>
+constexpr BasicVector<T> operator-(const BasicVector<T>& l) {
     return {-l[0], -l[1], -l[2]};
 }
 
-inline Vector operator+(const Vector& l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator+(const BasicVector<T>& l, const BasicVector<T>& r) {
     return {l[0] + r[0], l[1] + r[1], l[2] + r[2]};
 }
 
-inline Vector operator-=(Vector& l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator-=(BasicVector<T>& l, const BasicVector<T>& r) {
     l[0] -= r[0];
     l[1] -= r[1];
     l[2] -= r[2];
     return l;
 }
 
-inline Vector operator+=(Vector& l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator+=(BasicVector<T>& l, const BasicVector<T>& r) {
     l[0] += r[0];
     l[1] += r[1];
     l[2] += r[2];
     return l;
 }
 
-inline Vector operator*(const Vector& l, double r) {
+// Scalars are not deduced, so `v * 2` and `v * 0.5` work for every T.
+template <class T>
+constexpr BasicVector<T> operator*(const BasicVector<T>& l, std::type_identity_t<T> r) {
     return {l[0] * r, l[1] * r, l[2] * r};
 }
 
-inline Vector operator*(double l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator*(std::type_identity_t<T> l, const BasicVector<T>& r) {
     return r * l;
 }
 
-Vector operator*(const Vector& l, const Vector& r) {
+template <class T>
+constexpr BasicVector<T> operator*(const BasicVector<T>& l, const BasicVector<T>& r) {
     return {l[0] * r[0], l[1] * r[1], l[2] * r[2]};
 }
 
-inline Vector operator/(const Vector& l, double r) {
+template <class T>
+constexpr BasicVector<T> operator/(const BasicVector<T>& l, std::type_identity_t<T> r) {
     return {l[0] / r, l[1] / r, l[2] / r};
 }
 
-inline Vector Normalized(Vector v) {
+template <class T>
+BasicVector<T> Normalized(BasicVector<T> v) {
     v.Normalize();
     return v;
 }
 
-inline std::pair<Vector, Vector> Orthogonal(const Vector& v) {
+template <class T>
+std::pair<BasicVector<T>, BasicVector<T>> Orthogonal(const BasicVector<T>& v) {
     if (Length(v) == 0) {
         return {};
     }
@@ -116,14 +149,17 @@ inline std::pair<Vector, Vector> Orthogonal(const Vector& v) {
     }
 }
 
-std::ostream& operator<<(std::ostream& o, Vector v) {
+template <class T>
+std::ostream& operator<<(std::ostream& o, BasicVector<T> v) {
     return o << "{ " << v[0] << " " << v[1] << " " << v[2] << " }";
 }
 
-bool operator==(const Vector& l, const Vector& r) {
+template <class T>
+constexpr bool operator==(const BasicVector<T>& l, const BasicVector<T>& r) {
     return l[0] == r[0] && l[1] == r[1] && l[2] == r[2];
 }
 
-bool operator!=(const Vector& l, const Vector& r) {
+template <class T>
+constexpr bool operator!=(const BasicVector<T>& l, const BasicVector<T>& r) {
     return !(l == r);
 }
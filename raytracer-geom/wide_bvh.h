@@ -0,0 +1,307 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define RAYTRACER_WIDE_BVH_SSE
+#endif
+
+namespace wide_bvh_detail {
+
+inline float RoundDown(double x) {
+    float f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float RoundUp(double x) {
+    float f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Slack for the rounding of the float slab test: a few float epsilons of relative error in
+// every slab distance.
+inline constexpr float kSlack = 1 + 1e-6f;
+
+}  // namespace wide_bvh_detail
+
+// Bounding volume hierarchy with N children per node, obtained by collapsing the binary SAH
+// hierarchy. The child boxes of a node are stored as structure-of-arrays floats, so a ray is
+// tested against all of them with a few SIMD instructions.
+//
+// Float boxes are rounded outwards and the ray origin is rounded towards the far side of every
+// slab plane, so the test never rejects a box that the double precision test in Bvh accepts.
+template <size_t N>
+class WideBvh {
+    static_assert(N == 4 || N == 8, "WideBvh supports 4 and 8 children per node");
+
+public:
+    struct alignas(32) Node {
+        // min x, min y, min z, max x, max y, max z of every child.
+        std::array<std::array<float, N>, 6> bounds;
+        // Node index for inner children, first primitive in GetIndices() for leaf children.
+        std::array<uint32_t, N> child;
+        // Number of primitives for leaf children, zero for inner and empty ones.
+        std::array<uint32_t, N> count;
+    };
+
+    static constexpr uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t kStackSize = Bvh::kMaxDepth * N + 1;
+
+    WideBvh() {
+    }
+
+    explicit WideBvh(const Bvh& bvh) : indices_(bvh.GetIndices()) {
+        if (bvh.GetNodes().empty()) {
+            return;
+        }
+        Collapse(bvh, 0);
+        nodes_.shrink_to_fit();
+    }
+
+    const std::vector<Node>& GetNodes() const {
+        return nodes_;
+    }
+
+    const std::vector<uint32_t>& GetIndices() const {
+        return indices_;
+    }
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.nodes_);
+        visit(self.indices_);
+    }
+
+    // Same contract as Bvh::Traverse.
+    template <class Visitor>
+    void Traverse(const Ray& ray, double& limit, Visitor&& visit) const {
+        using wide_bvh_detail::kSlack;
+        using wide_bvh_detail::RoundDown;
+        using wide_bvh_detail::RoundUp;
+
+        if (nodes_.empty()) {
+            return;
+        }
+        RayData r;
+        Vector dir = Normalized(ray.GetDirection());
+        for (size_t i = 0; i != 3; ++i) {
+            // Keeps the inverse finite, so the slab test never computes 0 * inf.
+            double d = std::abs(dir[i]) < 1e-20 ? std::copysign(1e-20, dir[i]) : dir[i];
+            r.origin_hi[i] = RoundUp(ray.GetOrigin()[i]);
+            r.origin_lo[i] = RoundDown(ray.GetOrigin()[i]);
+            r.inv_dir[i] = static_cast<float>(1 / d);
+        }
+
+        struct Entry {
+            float distance;
+            uint32_t child;
+            uint32_t count;
+        };
+        std::array<Entry, kStackSize> stack;
+        size_t size = 0;
+        stack[size++] = {0, 0, 0};
+
+        double rounded_limit = limit;
+        float limit_f = RoundUp(limit);
+        while (size != 0) {
+            Entry entry = stack[--size];
+            if (limit != rounded_limit) {
+                rounded_limit = limit;
+                limit_f = RoundUp(limit);
+            }
+            if (entry.distance > limit_f * kSlack) {
+                continue;
+            }
+            if (entry.count != 0) {
+                for (uint32_t i = entry.child; i != entry.child + entry.count; ++i) {
+                    if (visit(indices_[i])) {
+                        return;
+                    }
+                }
+                continue;
+            }
+
+            const Node& node = nodes_[entry.child];
+            alignas(32) std::array<float, N> distances;
+            unsigned mask = IntersectChildren(node, r, limit_f, distances.data());
+
+            // Push hit children farthest first, so the nearest one is popped next. At most N
+            // entries are inserted, so an insertion sort on top of the stack is enough.
+            size_t base = size;
+            for (; mask != 0; mask &= mask - 1) {
+                size_t i = __builtin_ctz(mask);
+                // Empty slots sit at infinity and only pass the test while `limit` is infinite.
+                if (node.child[i] == kEmpty) {
+                    continue;
+                }
+                Entry hit{distances[i], node.child[i], node.count[i]};
+                size_t pos = size++;
+                while (pos != base && stack[pos - 1].distance < hit.distance) {
+                    stack[pos] = stack[pos - 1];
+                    --pos;
+                }
+                stack[pos] = hit;
+            }
+        }
+    }
+
+private:
+    struct RayData {
+        std::array<float, 3> origin_hi;
+        std::array<float, 3> origin_lo;
+        std::array<float, 3> inv_dir;
+    };
+
+    // Returns the mask of children hit no farther than `limit` and stores their entry distances.
+    static unsigned IntersectChildren(const Node& node, const RayData& r, float limit,
+                                      float* distances) {
+#ifdef RAYTRACER_WIDE_BVH_SSE
+#ifdef __AVX__
+        if constexpr (N == 8) {
+            return IntersectChildrenAvx(node, r, limit, distances);
+        }
+#endif
+        unsigned mask = 0;
+        for (size_t offset = 0; offset != N; offset += 4) {
+            mask |= IntersectChildrenSse(node, r, limit, offset, distances + offset) << offset;
+        }
+        return mask;
+#else
+        return IntersectChildrenScalar(node, r, limit, distances);
+#endif
+    }
+
+#ifdef RAYTRACER_WIDE_BVH_SSE
+    static unsigned IntersectChildrenSse(const Node& node, const RayData& r, float limit,
+                                         size_t offset, float* distances) {
+        __m128 t_near = _mm_setzero_ps();
+        __m128 t_far = _mm_set1_ps(limit);
+        for (size_t axis = 0; axis != 3; ++axis) {
+            __m128 inv = _mm_set1_ps(r.inv_dir[axis]);
+            __m128 t_0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[axis].data() + offset),
+                                               _mm_set1_ps(r.origin_hi[axis])),
+                                    inv);
+            __m128 t_1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[axis + 3].data() + offset),
+                                               _mm_set1_ps(r.origin_lo[axis])),
+                                    inv);
+            t_near = _mm_max_ps(t_near, _mm_min_ps(t_0, t_1));
+            t_far = _mm_min_ps(t_far, _mm_max_ps(t_0, t_1));
+        }
+        _mm_store_ps(distances, t_near);
+        __m128 hit = _mm_cmple_ps(t_near, _mm_mul_ps(t_far, _mm_set1_ps(wide_bvh_detail::kSlack)));
+        return _mm_movemask_ps(hit);
+    }
+#endif
+
+#ifdef __AVX__
+    static unsigned IntersectChildrenAvx(const Node& node, const RayData& r, float limit,
+                                         float* distances) {
+        __m256 t_near = _mm256_setzero_ps();
+        __m256 t_far = _mm256_set1_ps(limit);
+        for (size_t axis = 0; axis != 3; ++axis) {
+            __m256 inv = _mm256_set1_ps(r.inv_dir[axis]);
+            __m256 t_0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[axis].data()),
+                                                     _mm256_set1_ps(r.origin_hi[axis])),
+                                       inv);
+            __m256 t_1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[axis + 3].data()),
+                                                     _mm256_set1_ps(r.origin_lo[axis])),
+                                       inv);
+            t_near = _mm256_max_ps(t_near, _mm256_min_ps(t_0, t_1));
+            t_far = _mm256_min_ps(t_far, _mm256_max_ps(t_0, t_1));
+        }
+        _mm256_store_ps(distances, t_near);
+        __m256 hit = _mm256_cmp_ps(
+            t_near, _mm256_mul_ps(t_far, _mm256_set1_ps(wide_bvh_detail::kSlack)), _CMP_LE_OQ);
+        return _mm256_movemask_ps(hit);
+    }
+#endif
+
+    static unsigned IntersectChildrenScalar(const Node& node, const RayData& r, float limit,
+                                            float* distances) {
+        unsigned mask = 0;
+        for (size_t i = 0; i != N; ++i) {
+            float t_near = 0;
+            float t_far = limit;
+            for (size_t axis = 0; axis != 3; ++axis) {
+                float t_0 = (node.bounds[axis][i] - r.origin_hi[axis]) * r.inv_dir[axis];
+                float t_1 = (node.bounds[axis + 3][i] - r.origin_lo[axis]) * r.inv_dir[axis];
+                t_near = std::max(t_near, std::min(t_0, t_1));
+                t_far = std::min(t_far, std::max(t_0, t_1));
+            }
+            distances[i] = t_near;
+            if (t_near <= t_far * wide_bvh_detail::kSlack) {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+
+    uint32_t Collapse(const Bvh& bvh, uint32_t binary_index) {
+        const auto& binary = bvh.GetNodes();
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+
+        // Open the largest inner child until the node is full.
+        std::vector<uint32_t> children;
+        if (binary[binary_index].count != 0) {
+            children.push_back(binary_index);
+        } else {
+            children = {binary[binary_index].first, binary[binary_index].first + 1};
+        }
+        while (children.size() < N) {
+            auto widest = children.end();
+            for (auto it = children.begin(); it != children.end(); ++it) {
+                if (binary[*it].count == 0 &&
+                    (widest == children.end() ||
+                     binary[*it].box.SurfaceArea() > binary[*widest].box.SurfaceArea())) {
+                    widest = it;
+                }
+            }
+            if (widest == children.end()) {
+                break;
+            }
+            uint32_t opened = *widest;
+            *widest = binary[opened].first;
+            children.push_back(binary[opened].first + 1);
+        }
+
+        for (size_t i = 0; i != N; ++i) {
+            if (i >= children.size()) {
+                for (auto& bound : nodes_[index].bounds) {
+                    bound[i] = std::numeric_limits<float>::infinity();
+                }
+                nodes_[index].child[i] = kEmpty;
+                nodes_[index].count[i] = 0;
+                continue;
+            }
+            const auto& child = binary[children[i]];
+            for (size_t axis = 0; axis != 3; ++axis) {
+                nodes_[index].bounds[axis][i] =
+                    wide_bvh_detail::RoundDown(child.box.GetMin()[axis]);
+                nodes_[index].bounds[axis + 3][i] =
+                    wide_bvh_detail::RoundUp(child.box.GetMax()[axis]);
+            }
+            if (child.count != 0) {
+                nodes_[index].child[i] = child.first;
+                nodes_[index].count[i] = child.count;
+            } else {
+                uint32_t sub = Collapse(bvh, children[i]);
+                nodes_[index].child[i] = sub;
+                nodes_[index].count[i] = 0;
+            }
+        }
+        return index;
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> indices_;
+};
@@ -2,77 +2,126 @@
 
 #include "../raytracer/render_options.h"
 #include "../raytracer/camera_options.h"
+#include "../raytracer/frame_options.h"
 #include "../raytracer-geom/vector.h"
+#include "tokenizer.h"
 
 #include <utility>
 #include <string>
-#include <fstream>
+#include <string_view>
 #include <vector>
 
-inline std::pair<RenderOptions, CameraOptions> ReadConfig(std::string filename) {
-    std::ifstream f;
-    f.open(filename);
-    
-    RenderOptions ro;
+// `frame N ...` lines describe an animation: `frame N camera fov|from|to ...` and
+// `frame N instance K <row-major 3x4 transform>`. They are collected into `frames` when it is
+// given, one entry per frame up to the largest N.
+inline std::pair<RenderOptions, CameraOptions> ParseConfig(
+    std::string_view text, std::vector<FrameOptions>* frames = nullptr) {
+    RenderOptions ro{1};
     CameraOptions co{640, 480};
 
-    for (std::string line; std::getline(f, line);) {
-        std::vector<std::string> tokens;
-        {
-            std::string token;
-            for (auto c : line) {
-                if (!isspace(c)) {
-                    token.push_back(c);
-                } else if (!token.empty()) {
-                    size_t i = 0;
-                    while (token.size() > i && std::isspace(token[i])) {
-                        ++i;
-                    }
-                    token = std::string(token.begin() + i, token.end());
+    std::vector<std::string_view> tokens;
+    for (std::string_view line; NextLine(text, line);) {
+        SplitTokens(line, tokens);
+        if (tokens.empty()) {
+            continue;
+        }
 
-                    if (token[0] == '#') {
-                        token = "";
-                        break;
-                    }
-                    tokens.push_back(token);
-                    token = "";
-                }
+        if (tokens[0] == "frame") {
+            if (!frames) {
+                continue;
             }
-            if (!token.empty()) {
-                size_t i = 0;
-                while (token.size() > i && std::isspace(token[i])) {
-                    ++i;
-                }
-                token = std::string(token.begin() + i, token.end());
-                tokens.push_back(token);
-                token = "";
+            size_t index = ParseNumber<size_t>(tokens[1]);
+            if (frames->size() <= index) {
+                frames->resize(index + 1);
             }
-            if (tokens.empty()) {
-                continue;
+            auto& frame = (*frames)[index];
+            if (tokens[2] == "camera") {
+                if (tokens[3] == "fov") {
+                    frame.fov = ParseNumber<double>(tokens[4]);
+                } else if (tokens[3] == "from") {
+                    frame.look_from = {ParseNumber<double>(tokens[4]),
+                                       ParseNumber<double>(tokens[5]),
+                                       ParseNumber<double>(tokens[6])};
+                } else if (tokens[3] == "to") {
+                    frame.look_to = {ParseNumber<double>(tokens[4]),
+                                     ParseNumber<double>(tokens[5]),
+                                     ParseNumber<double>(tokens[6])};
+                }
+            } else if (tokens[2] == "instance") {
+                std::array<double, 12> m;
+                for (size_t i = 0; i != 12; ++i) {
+                    m[i] = ParseNumber<double>(tokens.at(i + 4));
+                }
+                frame.transforms.emplace_back(ParseNumber<size_t>(tokens[3]), Transform(m));
             }
-        }
-        
-        if (tokens[0] == "camera") {
+        } else if (tokens[0] == "camera") {
             if (tokens[1] == "w") {
-                co.screen_width = std::stoi(tokens[2]);
+                co.screen_width = ParseNumber<int>(tokens[2]);
             } else if (tokens[1] == "h") {
-                co.screen_height = std::stoi(tokens[2]);
+                co.screen_height = ParseNumber<int>(tokens[2]);
             } else if (tokens[1] == "fov") {
-                co.fov = std::stod(tokens[2]);
+                co.fov = ParseNumber<double>(tokens[2]);
             } else if (tokens[1] == "from") {
-                co.look_from = {std::stod(tokens[2]), std::stod(tokens[3]), std::stod(tokens[4])};
+                co.look_from = {ParseNumber<double>(tokens[2]), ParseNumber<double>(tokens[3]),
+                                ParseNumber<double>(tokens[4])};
             } else if (tokens[1] == "to") {
-                co.look_to = {std::stod(tokens[2]), std::stod(tokens[3]), std::stod(tokens[4])};
+                co.look_to = {ParseNumber<double>(tokens[2]), ParseNumber<double>(tokens[3]),
+                              ParseNumber<double>(tokens[4])};
+            }
+        } else if (tokens[0] == "output") {
+            if (tokens[1] == "png_level") {
+                ro.output.png_level = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "png_filter") {
+                ro.output.png_filter = tokens[2] == "none"    ? PngFilter::kNone
+                                       : tokens[2] == "sub"     ? PngFilter::kSub
+                                       : tokens[2] == "up"      ? PngFilter::kUp
+                                       : tokens[2] == "average" ? PngFilter::kAverage
+                                       : tokens[2] == "paeth"   ? PngFilter::kPaeth
+                                                                : PngFilter::kAdaptive;
+            } else if (tokens[1] == "sample_map") {
+                ro.output.sample_map = tokens[2] != "off";
             }
         } else if (tokens[0] == "render") {
             if (tokens[1] == "mode") {
                 ro.mode = (tokens[2] == "depth") ?  RenderMode::kDepth :
                           (tokens[2] == "normal") ? RenderMode::kNormal :
                                                     RenderMode::kFull;
+            } else if (tokens[1] == "integrator") {
+                ro.integrator = tokens[2] == "wavefront" ? Integrator::kWavefront
+                                                         : Integrator::kRecursive;
             } else if (tokens[1] == "depth") {
-                ro.depth = std::stoi(tokens[2]);
+                ro.depth = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "min_throughput") {
+                ro.pruning.min_throughput = ParseNumber<double>(tokens[2]);
+            } else if (tokens[1] == "russian_roulette") {
+                ro.pruning.russian_roulette = tokens[2] != "off";
+            } else if (tokens[1] == "max_spp") {
+                ro.max_spp = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "aa_threshold") {
+                ro.aa_threshold = ParseNumber<double>(tokens[2]);
+            } else if (tokens[1] == "white_point") {
+                ro.white_point = ParseNumber<double>(tokens[2]);
+            } else if (tokens[1] == "bvh") {
+                ro.bvh_width = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "threads") {
+                ro.threads = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "deadline_ms") {
+                ro.deadline_ms = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "snapshot_ms") {
+                ro.snapshot_ms = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "workers") {
+                ro.workers = ParseNumber<int>(tokens[2]);
+            } else if (tokens[1] == "scene_cache") {
+                ro.scene_cache = tokens[2] != "off";
+            } else if (tokens[1] == "geometry_budget_mb") {
+                ro.geometry_budget_mb = ParseNumber<int>(tokens[2]);
             }
         }
     }
     return {ro, co};
-}
\ No newline at end of file
+}
+inline std::pair<RenderOptions, CameraOptions> ReadConfig(
+    std::string filename, std::vector<FrameOptions>* frames = nullptr) {
+    MappedFile file(filename);
+    return ParseConfig(file.GetText(), frames);
+}
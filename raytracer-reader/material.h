@@ -2,6 +2,9 @@
 
 #include "../raytracer-geom/vector.h"
 
+#include <array>
+#include <cstdint>
+#include <limits>
 #include <string>
 
 struct Material {
@@ -13,4 +16,21 @@ struct Material {
     double specular_exponent;
     double refraction_index;
     std::array<double, 3> albedo;
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.name);
+        visit(self.ambient_color);
+        visit(self.diffuse_color);
+        visit(self.specular_color);
+        visit(self.intensity);
+        visit(self.specular_exponent);
+        visit(self.refraction_index);
+        visit(self.albedo);
+    }
 };
+
+// Index into the material table of a scene.
+using MaterialId = uint32_t;
+inline constexpr MaterialId kNoMaterial = std::numeric_limits<MaterialId>::max();
@@ -1,20 +1,36 @@
 #pragma once
 
-#include "../raytracer-geom/triangle.h"
 #include "material.h"
+#include "triangle_store.h"
 #include "../raytracer-geom/sphere.h"
+#include "../raytracer-geom/transform.h"
 
-struct Object {
-    const Material* material = nullptr;
-    Triangle polygon;
-    std::array<Vector, 3> normals;
+#include <string>
+#include <vector>
 
-    const Vector* GetNormal(size_t index) const {
-        return &normals[index];
+struct SphereObject {
+    MaterialId material = kNoMaterial;
+    Sphere sphere;
+};
+
+// Triangle mesh that is parsed once and placed in the scene through instances. Its triangles
+// are in the mesh's local space.
+struct Mesh {
+    std::string path;
+    TriangleStore triangles;
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.path);
+        visit(self.triangles);
     }
 };
 
-struct SphereObject {
-    const Material* material = nullptr;
-    Sphere sphere;
+struct Instance {
+    size_t mesh;
+    Transform to_world;
+    Transform to_local;
+    // Replaces the materials of the mesh when set.
+    MaterialId material = kNoMaterial;
 };
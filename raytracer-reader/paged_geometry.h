@@ -0,0 +1,215 @@
+#pragma once
+
+#include "material.h"
+#include "tokenizer.h"
+#include "../raytracer-geom/bvh.h"
+#include "../raytracer-geom/triangle.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Triangles kept out of core in a mapped file, split into spatially clustered pages that each
+// have their own hierarchy. A page is read when traversal first reaches it. Once the resident
+// pages exceed the budget, the least recently used ones, as a clock approximates them, are
+// dropped from memory; the file mapping stays, so a dropped page that is still being read is
+// simply read back from the file.
+class PagedGeometry {
+public:
+    static constexpr uint32_t kNoNormals = std::numeric_limits<uint32_t>::max();
+    // Pages start on this boundary of the file and are padded up to the next one.
+    static constexpr size_t kAlignment = 4096;
+
+    // Where a page is in the file and what it holds.
+    struct PageInfo {
+        BoundingBox bounds;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint32_t node_count = 0;
+        uint32_t triangle_count = 0;
+        uint32_t normal_count = 0;
+        uint32_t reserved = 0;
+    };
+
+    // Byte offsets of the arrays of a page, which starts with the nodes of its hierarchy, and
+    // the size of the page.
+    struct Layout {
+        size_t triangles;
+        size_t normals;
+        size_t indices;
+        size_t normal_ids;
+        size_t materials;
+        size_t size;
+    };
+
+    // A page as traversal reads it. Triangle i of the page has normal_ids[i] and materials[i].
+    struct Page {
+        Bvh::View bvh;
+        const PackedTriangle* triangles;
+        const std::array<Vector, 3>* normals;
+        const uint32_t* normal_ids;
+        const MaterialId* materials;
+
+        // Nullptr for faces without vertex normals.
+        const std::array<Vector, 3>* GetNormals(uint32_t index) const {
+            uint32_t id = normal_ids[index];
+            return id == kNoNormals ? nullptr : &normals[id];
+        }
+    };
+
+    struct Stats {
+        uint64_t page_ins = 0;
+        uint64_t evictions = 0;
+        uint64_t resident_bytes = 0;
+        uint64_t peak_resident_bytes = 0;
+    };
+
+    static Layout GetLayout(uint32_t node_count, uint32_t triangle_count, uint32_t normal_count) {
+        Layout layout;
+        layout.triangles = node_count * sizeof(Bvh::Node);
+        layout.normals = layout.triangles + triangle_count * sizeof(PackedTriangle);
+        layout.indices = layout.normals + normal_count * sizeof(std::array<Vector, 3>);
+        layout.normal_ids = layout.indices + triangle_count * sizeof(uint32_t);
+        layout.materials = layout.normal_ids + triangle_count * sizeof(uint32_t);
+        layout.size = layout.materials + triangle_count * sizeof(MaterialId);
+        return layout;
+    }
+
+    // At most `budget` bytes of pages stay resident, but always the last page read.
+    PagedGeometry(MappedFile file, std::vector<PageInfo> pages, size_t budget)
+        : file_(std::move(file)),
+          pages_(std::move(pages)),
+          states_(std::make_unique<State[]>(pages_.size())),
+          budget_(budget) {
+        std::string_view text = file_.GetText();
+        for (const auto& page : pages_) {
+            if (page.offset % kAlignment != 0 || page.offset > text.size() ||
+                (page.size + kAlignment - 1) / kAlignment * kAlignment >
+                    text.size() - page.offset ||
+                GetLayout(page.node_count, page.triangle_count, page.normal_count).size !=
+                    page.size) {
+                throw std::runtime_error("Corrupt page file");
+            }
+            triangle_count_ += page.triangle_count;
+        }
+        // Pages are read whole when they are needed, not ahead of that.
+        if (!text.empty()) {
+            madvise(const_cast<char*>(text.data()), text.size(), MADV_RANDOM);
+        }
+    }
+
+    PagedGeometry(const PagedGeometry&) = delete;
+    PagedGeometry& operator=(const PagedGeometry&) = delete;
+
+    size_t GetPageCount() const {
+        return pages_.size();
+    }
+
+    const PageInfo& GetPageInfo(size_t index) const {
+        return pages_[index];
+    }
+
+    size_t GetTriangleCount() const {
+        return triangle_count_;
+    }
+
+    size_t GetBudget() const {
+        return budget_;
+    }
+
+    // Marks the page as used, reading it in first when it is not resident. Safe to call from
+    // any thread.
+    Page GetPage(size_t index) const {
+        State& state = states_[index];
+        if (!state.referenced.load(std::memory_order_relaxed)) {
+            state.referenced.store(true, std::memory_order_relaxed);
+        }
+        if (!state.resident.load(std::memory_order_acquire)) {
+            PageIn(index);
+        }
+        const PageInfo& info = pages_[index];
+        const char* data = file_.GetText().data() + info.offset;
+        Layout layout = GetLayout(info.node_count, info.triangle_count, info.normal_count);
+        return {{{reinterpret_cast<const Bvh::Node*>(data), info.node_count},
+                 {reinterpret_cast<const uint32_t*>(data + layout.indices), info.triangle_count}},
+                reinterpret_cast<const PackedTriangle*>(data + layout.triangles),
+                reinterpret_cast<const std::array<Vector, 3>*>(data + layout.normals),
+                reinterpret_cast<const uint32_t*>(data + layout.normal_ids),
+                reinterpret_cast<const MaterialId*>(data + layout.materials)};
+    }
+
+    Stats GetStats() const {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct State {
+        std::atomic<bool> resident = false;
+        std::atomic<bool> referenced = false;
+    };
+
+    void PageIn(size_t index) const {
+        std::lock_guard lock(mutex_);
+        State& state = states_[index];
+        if (state.resident.load(std::memory_order_relaxed)) {
+            return;
+        }
+        Advise(pages_[index], MADV_WILLNEED);
+        state.resident.store(true, std::memory_order_release);
+        ++stats_.page_ins;
+        stats_.resident_bytes += pages_[index].size;
+        clock_.push_back(index);
+        // Pages used since the hand last passed them get another round.
+        while (stats_.resident_bytes > budget_ && clock_.size() > 1) {
+            size_t victim = clock_.front();
+            clock_.pop_front();
+            if (victim == index ||
+                states_[victim].referenced.exchange(false, std::memory_order_relaxed)) {
+                clock_.push_back(victim);
+                continue;
+            }
+            Advise(pages_[victim], MADV_DONTNEED);
+            states_[victim].resident.store(false, std::memory_order_release);
+            ++stats_.evictions;
+            stats_.resident_bytes -= pages_[victim].size;
+        }
+        stats_.peak_resident_bytes = std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+    }
+
+    // madvise on the whole system pages inside the page and its padding, which is all of it
+    // unless system pages are larger than kAlignment.
+    void Advise(const PageInfo& info, int advice) const {
+        static const uintptr_t kSystemPage = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = reinterpret_cast<uintptr_t>(file_.GetText().data()) + info.offset;
+        uintptr_t end = begin + (info.size + kAlignment - 1) / kAlignment * kAlignment;
+        end = end / kSystemPage * kSystemPage;
+        begin = (begin + kSystemPage - 1) / kSystemPage * kSystemPage;
+        if (begin < end) {
+            madvise(reinterpret_cast<void*>(begin), end - begin, advice);
+        }
+    }
+
+    MappedFile file_;
+    std::vector<PageInfo> pages_;
+    std::unique_ptr<State[]> states_;
+    size_t budget_;
+    size_t triangle_count_ = 0;
+
+    mutable std::mutex mutex_;
+    // Resident pages in the order the clock hand visits them.
+    mutable std::deque<size_t> clock_;
+    mutable Stats stats_;
+};
@@ -4,12 +4,22 @@
 #include "../raytracer-geom/vector.h"
 #include "object.h"
 #include "light.h"
+#include "paged_geometry.h"
+#include "tokenizer.h"
 
+#include "../raytracer/thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <limits>
 #include <vector>
 #include <map>
+#include <memory>
+#include <span>
 #include <string>
-
-#include <fstream>
+#include <string_view>
+#include <stdexcept>
 
 enum StrType {
     kVertex,
@@ -19,12 +29,13 @@ enum StrType {
     kMaterial,
     kSphere,
     kLight,
+    kInstance,
 };
 
 class Scene {
 public:
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    const TriangleStore& GetTriangles() const {
+        return triangles_;
     }
 
     const std::vector<SphereObject>& GetSphereObjects() const {
@@ -35,90 +46,153 @@ public:
         return lights_;
     }
 
-    const std::map<std::string, Material>& GetMaterials() const {
+    // Material table; triangles and spheres refer to its entries by MaterialId.
+    const std::vector<Material>& GetMaterials() const {
         return materials_;
     }
 
+    const Material& GetMaterial(MaterialId id) const {
+        return materials_[id];
+    }
+
+    const std::vector<Mesh>& GetMeshes() const {
+        return meshes_;
+    }
+
+    const std::vector<Instance>& GetInstances() const {
+        return instances_;
+    }
+
+    void SetInstanceTransform(size_t index, const Transform& to_world) {
+        auto& instance = instances_.at(index);
+        instance.to_world = to_world;
+        instance.to_local = to_world.Inverse();
+    }
+
+    // Triangles of the OBJ file itself when they are kept out of core, in which case
+    // GetTriangles() is empty. Null otherwise.
+    const PagedGeometry* GetPagedGeometry() const {
+        return paged_.get();
+    }
+
+    void SetPagedGeometry(std::shared_ptr<const PagedGeometry> paged) {
+        paged_ = std::move(paged);
+    }
+
+    // Files the scene was read from: the OBJ file itself, its material libraries and the meshes
+    // of its instances with their libraries.
+    const std::vector<std::string>& GetSources() const {
+        return sources_;
+    }
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.triangles_);
+        visit(self.spheres_);
+        visit(self.lights_);
+        visit(self.materials_);
+        visit(self.material_ids_);
+        visit(self.meshes_);
+        visit(self.instances_);
+        visit(self.sources_);
+    }
+
     friend inline Scene ReadScene(const std::string& filename);
+    friend inline Scene ReadScene(const std::string& filename, size_t max_chunk_size,
+                                  const std::function<void(TriangleStore&&)>& sink);
+    friend inline void ParseInstanceDeclaration(const std::vector<std::string_view>& tokens,
+                                                const std::string& dir_name, Scene& scene,
+                                                std::map<std::string, size_t>& mesh_ids);
+
+private:
+    MaterialId AddMaterial(const Material& material) {
+        materials_.push_back(material);
+        material_ids_[material.name] = materials_.size() - 1;
+        return materials_.size() - 1;
+    }
 
-    ~Scene() {
-        for (auto& obj : objects_) {
-            delete obj.material;
+    MaterialId FindMaterial(std::string_view name) const {
+        auto it = material_ids_.find(name);
+        if (it == material_ids_.end()) {
+            throw std::runtime_error("Unknown material '" + std::string(name) + "'");
         }
+        return it->second;
+    }
 
-        for (auto& s : spheres_) {
-            delete s.material;
+    MaterialId FindOrAddMaterial(std::string_view name) {
+        auto it = material_ids_.find(name);
+        if (it != material_ids_.end()) {
+            return it->second;
         }
+        Material material{};
+        material.name = name;
+        return AddMaterial(material);
     }
 
-private:
-    std::vector<Object> objects_;
+    TriangleStore triangles_;
     std::vector<SphereObject> spheres_;
     std::vector<Light> lights_;
-    std::map<std::string, Material> materials_;
+    std::vector<Material> materials_;
+    std::map<std::string, MaterialId, std::less<>> material_ids_;
+    std::vector<Mesh> meshes_;
+    std::vector<Instance> instances_;
+    std::vector<std::string> sources_;
+    std::shared_ptr<const PagedGeometry> paged_;
 };
 
-inline std::array<int, 3> GetTokenInfo(const std::string& token) {
+// Vertex, texture and normal index of a face corner written as v, v/t, v//n or v/t/n; missing
+// indices are 0.
+inline std::array<int, 3> GetTokenInfo(std::string_view token) {
     std::array<int, 3> result = {0, 0, 0};
-    int slashes = 0;
-    std::string curr;
-    for (char c : token) {
-        if (c == '/') {
-            result[slashes] = curr.empty() ? 0 : std::stoi(curr);
-            curr = "";
-            ++slashes;
-        } else {
-            curr.push_back(c);
+    for (int slashes = 0;; ++slashes) {
+        if (slashes == 3) {
+            throw std::runtime_error("Invalid face corner '" + std::string(token) + "'");
+        }
+        size_t end = 0;
+        while (end != token.size() && token[end] != '/') {
+            ++end;
         }
+        if (end == token.size()) {
+            result[slashes] = ParseNumber<int>(token);
+            return result;
+        }
+        result[slashes] = end == 0 ? 0 : ParseNumber<int>(token.substr(0, end));
+        token.remove_prefix(end + 1);
     }
-    result[slashes] = std::stoi(curr);
-    curr = "";
-    return result;
 }
 
-inline void ParseFaceDeclaration(const std::vector<std::string>& tokens,
-                                 std::vector<Object>& objects, std::string mat_name,
-                                 const std::vector<Vector>& vertices,
-                                 const std::vector<Vector>& normals,
-                                 const std::map<std::string, Material>& materials) {
-    if (tokens.size() < 3) {
-        return;
-    }
+// Turns the indices of a face corner as GetTokenInfo returns them into 0-based ones. Negative
+// indices count back from the number of vertices and normals read so far; a corner without a
+// normal gets -1.
+inline std::array<int, 3> ResolveCorner(std::array<int, 3> info, size_t vertex_count,
+                                        size_t normal_count) {
+    info[0] = info[0] < 0 ? vertex_count + info[0] : info[0] - 1;
+    info[2] = info[2] < 0 ? normal_count + info[2] : info[2] - 1;
+    return info;
+}
 
-    auto first_elem_info = GetTokenInfo(tokens[0]);
-    first_elem_info[0] =
-        first_elem_info[0] < 0 ? vertices.size() + first_elem_info[0] : first_elem_info[0] - 1;
-    first_elem_info[2] =
-        first_elem_info[2] < 0 ? normals.size() + first_elem_info[2] : first_elem_info[2] - 1;
-    std::array<int, 3> old_info = GetTokenInfo(tokens[1]), new_info = GetTokenInfo(tokens[2]);
-    old_info[0] = old_info[0] < 0 ? vertices.size() + old_info[0] : old_info[0] - 1;
-    old_info[2] = old_info[2] < 0 ? normals.size() + old_info[2] : old_info[2] - 1;
-    new_info[0] = new_info[0] < 0 ? vertices.size() + new_info[0] : new_info[0] - 1;
-    new_info[2] = new_info[2] < 0 ? normals.size() + new_info[2] : new_info[2] - 1;
-
-    Material* material = new Material(materials.at(mat_name));
-    auto triangle =
-        Triangle({vertices[first_elem_info[0]], vertices[old_info[0]], vertices[new_info[0]]});
-    auto normal = std::array<Vector, 3>(
-        {first_elem_info[2] == -1 ? Vector{0, 0, 0} : normals[first_elem_info[2]],
-         old_info[2] == -1 ? Vector{0, 0, 0} : normals[old_info[2]],
-         new_info[2] == -1 ? Vector{0, 0, 0} : normals[new_info[2]]});
-    objects.push_back(Object{material, triangle, normal});
-
-    for (size_t i = 3; i < tokens.size(); ++i) {
-        old_info = new_info;
-        new_info = GetTokenInfo(tokens[i]);
-        new_info[0] = new_info[0] < 0 ? vertices.size() + new_info[0] : new_info[0] - 1;
-        new_info[2] = new_info[2] < 0 ? normals.size() + new_info[2] : new_info[2] - 1;
-
-        Material* material = new Material(materials.at(mat_name));
-        auto triangle =
-            Triangle({vertices[first_elem_info[0]], vertices[old_info[0]], vertices[new_info[0]]});
-        auto normal = std::array<Vector, 3>(
-            {first_elem_info[2] == -1 ? Vector{0, 0, 0} : normals[first_elem_info[2]],
-             old_info[2] == -1 ? Vector{0, 0, 0} : normals[old_info[2]],
-             new_info[2] == -1 ? Vector{0, 0, 0} : normals[new_info[2]]});
-        objects.push_back(Object{material, triangle, normal});
+// Adds a polygon given by its resolved corners as a fan of triangles.
+inline void AddFace(const std::array<int, 3>* corners, size_t count, TriangleStore& triangles,
+                    MaterialId material, const std::vector<Vector>& vertices,
+                    const std::vector<Vector>& normals) {
+    auto get_normal = [&normals](int index) {
+        return index == -1 ? Vector{0, 0, 0} : normals[index];
+    };
+    for (size_t i = 0; i < count; ++i) {
+        if (static_cast<size_t>(corners[i][0]) >= vertices.size() ||
+            (corners[i][2] != -1 && static_cast<size_t>(corners[i][2]) >= normals.size())) {
+            throw std::runtime_error("Face refers to a vertex or normal not defined before it");
+        }
+    }
+    for (size_t i = 2; i < count; ++i) {
+        const auto& first = corners[0];
+        const auto& old = corners[i - 1];
+        const auto& last = corners[i];
+        triangles.Add(Triangle(vertices[first[0]], vertices[old[0]], vertices[last[0]]),
+                      std::array<Vector, 3>{get_normal(first[2]), get_normal(old[2]),
+                                            get_normal(last[2])},
+                      material);
     }
 }
 
@@ -126,70 +200,42 @@ inline std::map<std::string, Material> ReadMaterials(std::string filename) {
 
     std::map<std::string, Material> res;
 
-    std::ifstream f;
-    f.open(filename);
+    MappedFile file(filename);
+    std::string_view text = file.GetText();
 
-    std::vector<Vector> vertices;
-    std::vector<Vector> normals;
+    auto get_vector = [](std::span<const std::string_view> tokens) {
+        return Vector(ParseNumber<double>(tokens[1]), ParseNumber<double>(tokens[2]),
+                      ParseNumber<double>(tokens[3]));
+    };
 
     std::string current;
+    std::vector<std::string_view> tokens;
 
-    for (std::string line; std::getline(f, line);) {
-        std::vector<std::string> tokens;
-        std::string token;
-        for (auto c : line) {
-            if (!isspace(c)) {
-                token.push_back(c);
-            } else if (!token.empty()) {
-                size_t i = 0;
-                while (token.size() > i && std::isspace(token[i])) {
-                    ++i;
-                }
-                token = std::string(token.begin() + i, token.end());
-
-                if (token[0] == '#') {
-                    break;
-                }
-                tokens.push_back(token);
-                token = "";
-            }
-        }
-        if (!token.empty()) {
-            size_t i = 0;
-            while (token.size() > i && std::isspace(token[i])) {
-                ++i;
-            }
-            token = std::string(token.begin() + i, token.end());
-            tokens.push_back(token);
-            token = "";
-        }
+    for (std::string_view line; NextLine(text, line);) {
+        SplitTokens(line, tokens);
         if (tokens.empty()) {
             continue;
         }
         if (tokens[0] == "newmtl") {
-            res[tokens[1]] = Material();
-            res[tokens[1]].name = tokens[1];
-            res[tokens[1]].albedo = {1, 0, 0};
             current = tokens[1];
+            res[current] = Material();
+            res[current].name = current;
+            res[current].albedo = {1, 0, 0};
         } else if (tokens[0] == "Ka") {
-            res[current].ambient_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                          std::stod(tokens[3])};
+            res[current].ambient_color = get_vector(tokens);
         } else if (tokens[0] == "Kd") {
-            res[current].diffuse_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                          std::stod(tokens[3])};
+            res[current].diffuse_color = get_vector(tokens);
         } else if (tokens[0] == "Ks") {
-            res[current].specular_color = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                           std::stod(tokens[3])};
+            res[current].specular_color = get_vector(tokens);
         } else if (tokens[0] == "Ke") {
-            res[current].intensity = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                      std::stod(tokens[3])};
+            res[current].intensity = get_vector(tokens);
         } else if (tokens[0] == "Ns") {
-            res[current].specular_exponent = std::stod(tokens[1]);
+            res[current].specular_exponent = ParseNumber<double>(tokens[1]);
         } else if (tokens[0] == "Ni") {
-            res[current].refraction_index = std::stod(tokens[1]);
+            res[current].refraction_index = ParseNumber<double>(tokens[1]);
         } else if (tokens[0] == "al") {
-            res[current].albedo = {std::stod(tokens[1]), std::stod(tokens[2]),
-                                   std::stod(tokens[3])};
+            res[current].albedo = {ParseNumber<double>(tokens[1]), ParseNumber<double>(tokens[2]),
+                                   ParseNumber<double>(tokens[3])};
         } else {
             continue;
         }
@@ -198,128 +244,288 @@ inline std::map<std::string, Material> ReadMaterials(std::string filename) {
     return res;
 }
 
-inline Scene ReadScene(const std::string& filename) {
+inline Scene ReadScene(const std::string& filename);
+
+// I <mesh.obj> <row-major 3x4 transform> [material]
+// Places the triangles of another OBJ file into the scene. Every file is parsed once per scene and
+// shared by all of its instances; its spheres and lights are ignored. The optional material,
+// taken from this file's libraries, replaces the materials of the mesh.
+inline void ParseInstanceDeclaration(const std::vector<std::string_view>& tokens,
+                                     const std::string& dir_name, Scene& scene,
+                                     std::map<std::string, size_t>& mesh_ids) {
+    if (tokens.size() != 13 && tokens.size() != 14) {
+        throw std::runtime_error("Instance declaration needs a mesh and 12 transform values");
+    }
+    std::string path = dir_name + std::string(tokens[0]);
+    auto [it, inserted] = mesh_ids.emplace(path, scene.meshes_.size());
+    if (inserted) {
+        Scene mesh_scene = ReadScene(path);
+        if (!mesh_scene.instances_.empty()) {
+            throw std::runtime_error("Nested instances are not supported: " + path);
+        }
+        scene.sources_.insert(scene.sources_.end(), mesh_scene.sources_.begin(),
+                              mesh_scene.sources_.end());
+        MaterialId offset = scene.materials_.size();
+        scene.materials_.insert(scene.materials_.end(), mesh_scene.materials_.begin(),
+                                mesh_scene.materials_.end());
+        mesh_scene.triangles_.OffsetMaterials(offset);
+        scene.meshes_.push_back({path, std::move(mesh_scene.triangles_)});
+    }
+
+    std::array<double, 12> m;
+    for (size_t i = 0; i != 12; ++i) {
+        m[i] = ParseNumber<double>(tokens[i + 1]);
+    }
+    Transform to_world(m);
+    MaterialId material = tokens.size() == 14 ? scene.FindMaterial(tokens[13]) : kNoMaterial;
+    scene.instances_.push_back({it->second, to_world, to_world.Inverse(), material});
+}
+
+// Type of an OBJ statement given its first token. Returns false for unsupported statements.
+inline bool GetStrType(std::string_view token, StrType& str_type) {
+    if (token == "v") {
+        str_type = kVertex;
+    } else if (token == "vn") {
+        str_type = kNormal;
+    } else if (token == "f") {
+        str_type = kFace;
+    } else if (token == "mtllib") {
+        str_type = kLib;
+    } else if (token == "usemtl") {
+        str_type = kMaterial;
+    } else if (token == "S") {
+        str_type = kSphere;
+    } else if (token == "P") {
+        str_type = kLight;
+    } else if (token == "I") {
+        str_type = kInstance;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Part of an OBJ file parsed on its own. Vertices and normals are kept in the order they come.
+// Faces keep their corners as written, with the number of vertices and normals the chunk had
+// read before them for relative indices. All other statements depend on or change the material
+// state and are kept to be replayed in file order; their tokens point into the file.
+struct ObjChunk {
+    struct Face {
+        size_t first_corner;
+        size_t corner_count;
+        size_t vertex_count;
+        size_t normal_count;
+    };
+
+    struct Statement {
+        StrType type;
+        std::vector<std::string_view> tokens;
+        // Faces of the chunk that come before the statement.
+        size_t face_count;
+    };
+
+    std::vector<Vector> vertices;
+    std::vector<Vector> normals;
+    std::vector<std::array<int, 3>> corners;
+    std::vector<Face> faces;
+    std::vector<Statement> statements;
+};
+
+inline ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    StrType str_type;
+    std::vector<std::string_view> tokens;
+    for (std::string_view line; NextLine(text, line);) {
+        SplitTokens(line, tokens);
+        if (tokens.empty() || !GetStrType(tokens[0], str_type)) {
+            continue;
+        }
+        std::span<const std::string_view> tokenized = std::span(tokens).subspan(1);
+        switch (str_type) {
+            case kVertex:
+                chunk.vertices.emplace_back(ParseNumber<double>(tokenized[0]),
+                                            ParseNumber<double>(tokenized[1]),
+                                            ParseNumber<double>(tokenized[2]));
+                break;
+            case kNormal:
+                chunk.normals.emplace_back(ParseNumber<double>(tokenized[0]),
+                                           ParseNumber<double>(tokenized[1]),
+                                           ParseNumber<double>(tokenized[2]));
+                break;
+            case kFace: {
+                // Faces with fewer than three corners add nothing.
+                ObjChunk::Face face{chunk.corners.size(), 0, chunk.vertices.size(),
+                                    chunk.normals.size()};
+                if (tokenized.size() >= 3) {
+                    for (const auto& token : tokenized) {
+                        chunk.corners.push_back(GetTokenInfo(token));
+                    }
+                    face.corner_count = tokenized.size();
+                }
+                chunk.faces.push_back(face);
+                break;
+            }
+            default:
+                chunk.statements.push_back(
+                    {str_type, {tokenized.begin(), tokenized.end()}, chunk.faces.size()});
+                break;
+        }
+    }
+    return chunk;
+}
+
+// Chunks of an OBJ file are at least this large, so small files are parsed in one piece.
+constexpr size_t kMinObjChunkSize = 1 << 20;
+
+// Reads the scene like ReadScene(filename), but passes the triangles of the OBJ file itself to
+// `sink` part by part, in file order, instead of keeping them. The file is split at line
+// boundaries into chunks of at most `max_chunk_size` bytes, which are parsed in parallel a group
+// at a time: the statements that depend on the material state are replayed in file order, and
+// the faces of every chunk are turned into triangles in parallel, once the global offsets of its
+// vertices and normals are known. Only the faces of one group are held at a time; vertices and
+// normals are kept for the whole file.
+inline Scene ReadScene(const std::string& filename, size_t max_chunk_size,
+                       const std::function<void(TriangleStore&&)>& sink) {
     Scene res;
+    res.sources_.push_back(filename);
 
     std::string dir_name = filename;
     while (!dir_name.empty() && dir_name.back() != '/') {
         dir_name.pop_back();
     }
 
-    std::ifstream f;
-    f.open(filename);
+    MappedFile file(filename);
+    std::string_view text = file.GetText();
+
+    // More chunks than threads let the threads even out chunks that take longer to parse.
+    const int threads = text.size() >= 2 * kMinObjChunkSize ? GetDefaultThreadCount() : 1;
+    const size_t group_size = threads > 1 ? static_cast<size_t>(threads) * 4 : 1;
+    size_t chunk_count = std::clamp<size_t>(text.size() / kMinObjChunkSize, 1, group_size);
+    if (text.size() > max_chunk_size) {
+        chunk_count = std::max(chunk_count, text.size() / max_chunk_size + 1);
+    }
+    std::vector<std::string_view> pieces;
+    for (size_t begin = 0, k = 1; begin < text.size(); ++k) {
+        size_t end = text.find('\n', std::max(begin, text.size() * k / chunk_count));
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        pieces.emplace_back(text.data() + begin, end - begin);
+        begin = end;
+    }
 
     std::vector<Vector> vertices;
     std::vector<Vector> normals;
     std::string mat_name;
+    MaterialId mat_id = kNoMaterial;
+    std::map<std::string, size_t> mesh_ids;
+    for (size_t group = 0; group < pieces.size(); group += group_size) {
+        std::vector<ObjChunk> chunks(std::min(group_size, pieces.size() - group));
+        ParallelFor(chunks.size(), threads,
+                    [&](size_t k) { chunks[k] = ParseObjChunk(pieces[group + k]); });
+
+        std::vector<size_t> vertex_offsets;
+        std::vector<size_t> normal_offsets;
+        for (auto& chunk : chunks) {
+            vertex_offsets.push_back(vertices.size());
+            normal_offsets.push_back(normals.size());
+            if (vertices.empty()) {
+                vertices = std::move(chunk.vertices);
+            } else {
+                vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+            }
+            if (normals.empty()) {
+                normals = std::move(chunk.normals);
+            } else {
+                normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            }
+            chunk.vertices = {};
+            chunk.normals = {};
+        }
 
-    for (std::string line; std::getline(f, line);) {
-        size_t counter = 0;
-        StrType str_type;
-        std::vector<std::string> tokenized;
-
-        std::vector<std::string> tokens;
-        std::string token;
-        for (auto c : line) {
-            if (!isspace(c)) {
-                token.push_back(c);
-            } else if (!token.empty()) {
-                if (token[0] == '#') {
-                    token = "";
-                    break;
-                }
-                if (counter == 0) {
-                    if (token == "v") {
-                        str_type = kVertex;
-                    } else if (token == "vn") {
-                        str_type = kNormal;
-                    } else if (token == "f") {
-                        str_type = kFace;
-                    } else if (token == "mtllib") {
-                        str_type = kLib;
-                    } else if (token == "usemtl") {
-                        str_type = kMaterial;
-                    } else if (token == "S") {
-                        str_type = kSphere;
-                    } else if (token == "P") {
-                        str_type = kLight;
-                    } else {
-                        break;
+        std::vector<std::vector<MaterialId>> face_materials(chunks.size());
+        for (size_t k = 0; k != chunks.size(); ++k) {
+            auto& materials = face_materials[k];
+            // Faces with fewer than three corners make no triangles and look up no material.
+            auto add_faces = [&](size_t count) {
+                while (materials.size() != count) {
+                    if (chunks[k].faces[materials.size()].corner_count == 0) {
+                        materials.push_back(kNoMaterial);
+                        continue;
+                    }
+                    if (mat_id == kNoMaterial) {
+                        mat_id = res.FindMaterial(mat_name);
                     }
-                    ++counter;
-                } else {
-                    tokenized.push_back(token);
+                    materials.push_back(mat_id);
                 }
-                if (counter == 0) {
-                    break;
+            };
+            for (const auto& statement : chunks[k].statements) {
+                add_faces(statement.face_count);
+                const auto& tokenized = statement.tokens;
+                switch (statement.type) {
+                    case kLib:
+                        res.sources_.push_back(dir_name + std::string(tokenized[0]));
+                        for (const auto& [name, material] : ReadMaterials(res.sources_.back())) {
+                            res.AddMaterial(material);
+                        }
+                        mat_id = kNoMaterial;
+                        break;
+                    case kMaterial:
+                        mat_name = tokenized[0];
+                        mat_id = kNoMaterial;
+                        break;
+                    case kSphere:
+                        res.spheres_.push_back(
+                            {res.FindOrAddMaterial(mat_name),
+                             Sphere(Vector(ParseNumber<double>(tokenized[0]),
+                                           ParseNumber<double>(tokenized[1]),
+                                           ParseNumber<double>(tokenized[2])),
+                                    ParseNumber<double>(tokenized[3]))});
+                        break;
+                    case kLight:
+                        res.lights_.push_back({Vector(ParseNumber<double>(tokenized[0]),
+                                                      ParseNumber<double>(tokenized[1]),
+                                                      ParseNumber<double>(tokenized[2])),
+                                               Vector(ParseNumber<double>(tokenized[3]),
+                                                      ParseNumber<double>(tokenized[4]),
+                                                      ParseNumber<double>(tokenized[5]))});
+                        break;
+                    case kInstance:
+                        ParseInstanceDeclaration(tokenized, dir_name, res, mesh_ids);
+                        break;
+                    default:
+                        break;
                 }
-                token = "";
             }
+            add_faces(chunks[k].faces.size());
         }
-        if (!token.empty()) {
-            if (counter == 0) {
-                if (token == "v") {
-                    str_type = kVertex;
-                } else if (token == "vn") {
-                    str_type = kNormal;
-                } else if (token == "f") {
-                    str_type = kFace;
-                } else if (token == "mtllib") {
-                    str_type = kLib;
-                } else if (token == "usemtl") {
-                    str_type = kMaterial;
-                } else if (token == "S") {
-                    str_type = kSphere;
-                } else if (token == "P") {
-                    str_type = kLight;
-                } else {
-                    continue;
+
+        std::vector<TriangleStore> stores(chunks.size());
+        ParallelFor(chunks.size(), threads, [&](size_t k) {
+            const auto& chunk = chunks[k];
+            std::vector<std::array<int, 3>> corners;
+            for (size_t i = 0; i != chunk.faces.size(); ++i) {
+                const auto& face = chunk.faces[i];
+                corners.clear();
+                for (size_t c = 0; c != face.corner_count; ++c) {
+                    corners.push_back(ResolveCorner(chunk.corners[face.first_corner + c],
+                                                    vertex_offsets[k] + face.vertex_count,
+                                                    normal_offsets[k] + face.normal_count));
                 }
-                ++counter;
-            } else {
-                tokenized.push_back(token);
+                AddFace(corners.data(), corners.size(), stores[k], face_materials[k][i],
+                        vertices, normals);
             }
-            token = "";
-        }
-
-        if (counter == 0) {
-            continue;
-        }
-        switch (str_type) {
-            case kVertex:
-                vertices.push_back(
-                    {std::stod(tokenized[0]), std::stod(tokenized[1]), std::stod(tokenized[2])});
-                break;
-            case kNormal:
-                normals.push_back(
-                    {std::stod(tokenized[0]), std::stod(tokenized[1]), std::stod(tokenized[2])});
-                break;
-            case kFace:
-                ParseFaceDeclaration(tokenized, res.objects_, mat_name, vertices, normals,
-                                     res.materials_);
-                break;
-            case kLib:
-                res.materials_ = ReadMaterials(dir_name + tokenized[0]);
-                break;
-            case kMaterial:
-                mat_name = tokenized[0];
-                break;
-            case kSphere:
-                res.spheres_.push_back(
-                    {new Material(res.materials_[mat_name]),
-                     Sphere(Vector({std::stod(tokenized[0]), std::stod(tokenized[1]),
-                                    std::stod(tokenized[2])}),
-                            std::stod(tokenized[3]))});
-                break;
-            case kLight:
-                res.lights_.push_back({Vector({std::stod(tokenized[0]), std::stod(tokenized[1]),
-                                               std::stod(tokenized[2])}),
-                                       Vector({std::stod(tokenized[3]), std::stod(tokenized[4]),
-                                               std::stod(tokenized[5])})});
-                break;
-            default:
-                break;
+        });
+        for (auto& store : stores) {
+            sink(std::move(store));
         }
     }
     return res;
 }
+
+// The scene is the one parsing line by line would give.
+inline Scene ReadScene(const std::string& filename) {
+    std::vector<TriangleStore> parts;
+    Scene res = ReadScene(filename, std::numeric_limits<size_t>::max(),
+                          [&parts](TriangleStore&& part) { parts.push_back(std::move(part)); });
+    res.triangles_ = TriangleStore::Join(std::move(parts));
+    return res;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A file mapped into memory read-only. A file that can't be opened reads as empty, like an
+// std::ifstream that failed to open.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, info.st_size, MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(data);
+                size_ = info.st_size;
+            }
+        }
+        close(fd);
+        if (!data_ && info.st_size > 0) {
+            throw std::runtime_error("Can't map file " + filename);
+        }
+    }
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    std::string_view GetText() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Takes the next line, without its line break, off the front of `text`. Returns false once the
+// text is used up.
+inline bool NextLine(std::string_view& text, std::string_view& line) {
+    if (text.empty()) {
+        return false;
+    }
+    size_t end = text.find('\n');
+    if (end == std::string_view::npos) {
+        line = text;
+        text = {};
+    } else {
+        line = text.substr(0, end);
+        text.remove_prefix(end + 1);
+    }
+    return true;
+}
+
+// Same as std::isspace in the "C" locale: ' ' and '\t', '\n', '\v', '\f', '\r'.
+inline bool IsSpace(char c) {
+    return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+}
+
+// Splits a line into its whitespace-separated tokens up to the first one starting with '#'. The
+// tokens point into the line; `tokens` is reused, so reading a file does not allocate per line.
+inline void SplitTokens(std::string_view line, std::vector<std::string_view>& tokens) {
+    tokens.clear();
+    const char* it = line.data();
+    const char* end = it + line.size();
+    while (true) {
+        while (it != end && IsSpace(*it)) {
+            ++it;
+        }
+        if (it == end || *it == '#') {
+            return;
+        }
+        const char* begin = it;
+        while (it != end && !IsSpace(*it)) {
+            ++it;
+        }
+        tokens.emplace_back(begin, it - begin);
+    }
+}
+
+// Plain decimals like 0.25 or -12.5e3 whose digits fit into 53 bits and whose power of ten is
+// exact in a double are a single correctly rounded multiplication or division, which is what
+// std::from_chars would return. Returns false for everything else.
+inline bool ParseSimpleDecimal(const char* it, const char* end, double& value) {
+    static constexpr double kPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                         1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                         1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const bool negative = it != end && *it == '-';
+    it += negative;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; it != end && *it >= '0' && *it <= '9'; ++it, ++digits) {
+        mantissa = mantissa * 10 + (*it - '0');
+    }
+    if (it != end && *it == '.') {
+        for (++it; it != end && *it >= '0' && *it <= '9'; ++it, ++digits, --exponent) {
+            mantissa = mantissa * 10 + (*it - '0');
+        }
+    }
+    if (digits == 0 || digits > 19 || mantissa > (uint64_t{1} << 53)) {
+        return false;
+    }
+    if (it != end && (*it == 'e' || *it == 'E')) {
+        ++it;
+        const bool negative_power = it != end && *it == '-';
+        it += it != end && (*it == '-' || *it == '+');
+        int power = 0;
+        const char* power_begin = it;
+        for (; it != end && *it >= '0' && *it <= '9' && power < 1000; ++it) {
+            power = power * 10 + (*it - '0');
+        }
+        if (it == power_begin) {
+            return false;
+        }
+        exponent += negative_power ? -power : power;
+    }
+    if (it != end || exponent < -22 || exponent > 22) {
+        return false;
+    }
+    value = exponent < 0 ? mantissa / kPowers[-exponent] : mantissa * kPowers[exponent];
+    value = negative ? -value : value;
+    return true;
+}
+
+// Number at the start of a token, which may be followed by other characters as with std::stod.
+// Unlike std::stod it does not depend on the locale.
+template <class T>
+T ParseNumber(std::string_view token) {
+    const char* begin = token.data();
+    const char* end = begin + token.size();
+    if (begin != end && *begin == '+') {
+        ++begin;
+    }
+    T value;
+    if constexpr (std::is_same_v<T, double>) {
+        if (ParseSimpleDecimal(begin, end, value)) {
+            return value;
+        }
+    }
+    auto [ptr, error] = std::from_chars(begin, end, value);
+    if (error != std::errc()) {
+        throw std::runtime_error("Invalid number '" + std::string(token) + "'");
+    }
+    return value;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "material.h"
+#include "../raytracer-geom/triangle.h"
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Triangles of a scene split by how often they are read. Traversal and intersection only touch
+// the packed triangles; vertex normals and materials are looked up for the closest hit alone.
+class TriangleStore {
+public:
+    // Vertex normals are kept only for faces that have them.
+    void Add(const Triangle& polygon, const std::array<Vector, 3>& normals, MaterialId material) {
+        triangles_.emplace_back(polygon);
+        if (normals[0] == Vector{0, 0, 0}) {
+            normal_ids_.push_back(kNoNormals);
+        } else {
+            normal_ids_.push_back(normals_.size());
+            normals_.push_back(normals);
+        }
+        materials_.push_back(material);
+    }
+
+    size_t GetSize() const {
+        return triangles_.size();
+    }
+
+    const std::vector<PackedTriangle>& GetTriangles() const {
+        return triangles_;
+    }
+
+    const PackedTriangle& GetTriangle(size_t index) const {
+        return triangles_[index];
+    }
+
+    // Nullptr for faces without vertex normals.
+    const std::array<Vector, 3>* GetNormals(size_t index) const {
+        uint32_t id = normal_ids_[index];
+        return id == kNoNormals ? nullptr : &normals_[id];
+    }
+
+    MaterialId GetMaterial(size_t index) const {
+        return materials_[index];
+    }
+
+    // The triangles of all parts, in order.
+    static TriangleStore Join(std::vector<TriangleStore>&& parts) {
+        if (parts.size() == 1) {
+            return std::move(parts[0]);
+        }
+        TriangleStore result;
+        size_t triangles = 0;
+        size_t normals = 0;
+        for (const auto& part : parts) {
+            triangles += part.GetSize();
+            normals += part.normals_.size();
+        }
+        result.triangles_.reserve(triangles);
+        result.normal_ids_.reserve(triangles);
+        result.normals_.reserve(normals);
+        result.materials_.reserve(triangles);
+        for (auto& part : parts) {
+            const auto& ids = part.normal_ids_;
+            const uint32_t offset = result.normals_.size();
+            result.triangles_.insert(result.triangles_.end(), part.triangles_.begin(),
+                                     part.triangles_.end());
+            for (uint32_t id : ids) {
+                result.normal_ids_.push_back(id == kNoNormals ? kNoNormals : id + offset);
+            }
+            result.normals_.insert(result.normals_.end(), part.normals_.begin(),
+                                   part.normals_.end());
+            result.materials_.insert(result.materials_.end(), part.materials_.begin(),
+                                     part.materials_.end());
+            part = TriangleStore();
+        }
+        return result;
+    }
+
+    // Shifts all material ids, for triangles moved into a scene with a larger material table.
+    void OffsetMaterials(MaterialId offset) {
+        for (auto& material : materials_) {
+            material += offset;
+        }
+    }
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.triangles_);
+        visit(self.normal_ids_);
+        visit(self.normals_);
+        visit(self.materials_);
+    }
+
+private:
+    static constexpr uint32_t kNoNormals = std::numeric_limits<uint32_t>::max();
+
+    std::vector<PackedTriangle> triangles_;
+    std::vector<uint32_t> normal_ids_;
+    std::vector<std::array<Vector, 3>> normals_;
+    std::vector<MaterialId> materials_;
+};
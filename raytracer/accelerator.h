@@ -0,0 +1,470 @@
+#pragma once
+
+#include "../raytracer-reader/scene.h"
+#include "../raytracer-geom/bvh.h"
+#include "../raytracer-geom/wide_bvh.h"
+#include "../raytracer-geom/geometry.h"
+#include "../raytracer-geom/ray_packet.h"
+
+#include <array>
+#include <bit>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Hit {
+    Intersection intersection;
+    // Store of the hit triangle, null for spheres and paged triangles.
+    const TriangleStore* triangles = nullptr;
+    uint32_t triangle = 0;
+    const SphereObject* sphere = nullptr;
+    // Set when the triangle belongs to an instanced mesh and is therefore in the mesh's local
+    // space. `intersection` is always in world space.
+    const Instance* instance = nullptr;
+    const Material* material = nullptr;
+    // Barycentric coordinates of a triangle hit with respect to its second and third vertex.
+    Scalar u = 0;
+    Scalar v = 0;
+    // Vertex normals of the hit triangle, null when it has none.
+    const std::array<Vector, 3>* normals = nullptr;
+
+    const Material& GetMaterial() const {
+        return *material;
+    }
+
+    // Interpolated vertex normal for triangles that have them, the geometric normal otherwise.
+    // Not normalized.
+    Vector GetShadingNormal() const {
+        if (!normals) {
+            return intersection.GetNormal();
+        }
+        Vector normal = (*normals)[0] * (1 - u - v) + (*normals)[1] * u + (*normals)[2] * v;
+        return instance ? instance->to_local.ApplyTransposed(normal) : normal;
+    }
+};
+
+// BVH over a set of boxes with 2, 4 or 8 children per node.
+class Hierarchy {
+public:
+    // A refit hierarchy whose SAH cost grew beyond this factor of the built one is rebuilt.
+    static constexpr double kMaxCostGrowth = 1.5;
+
+    Hierarchy() {
+    }
+
+    Hierarchy(const std::vector<BoundingBox>& boxes, int width)
+        : bvh_(boxes), width_(width), build_cost_(bvh_.GetCost()) {
+        if (width_ != 2 && width_ != 4 && width_ != 8) {
+            throw std::runtime_error("Unsupported BVH width " + std::to_string(width_));
+        }
+        Collapse();
+    }
+
+    // Updates the hierarchy for moved primitives. Returns true if it had to be rebuilt.
+    bool Refit(const std::vector<BoundingBox>& boxes) {
+        bvh_.Refit(boxes);
+        if (bvh_.GetCost() > build_cost_ * kMaxCostGrowth) {
+            *this = Hierarchy(boxes, width_);
+            return true;
+        }
+        Collapse();
+        return false;
+    }
+
+    template <class Visitor>
+    void Traverse(const Ray& ray, double& limit, Visitor&& visit) const {
+        if (width_ == 4) {
+            bvh4_.Traverse(ray, limit, visit);
+        } else if (width_ == 8) {
+            bvh8_.Traverse(ray, limit, visit);
+        } else {
+            bvh_.Traverse(ray, limit, visit);
+        }
+    }
+
+    // Packets always walk the binary hierarchy, whose nodes test two children for all lanes.
+    template <class Visitor>
+    void TraversePacket(const RayPacket& packet, std::array<double, RayPacket::kSize>& limits,
+                        Visitor&& visit) const {
+        bvh_.TraversePacket(packet, limits, visit);
+    }
+
+    BoundingBox GetBounds() const {
+        return bvh_.GetNodes().empty() ? BoundingBox() : bvh_.GetNodes()[0].box;
+    }
+
+    const Bvh& GetBvh() const {
+        return bvh_;
+    }
+
+    int GetWidth() const {
+        return width_;
+    }
+
+    // Passes every member to `visit`, for the scene cache.
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.bvh_);
+        visit(self.bvh4_);
+        visit(self.bvh8_);
+        visit(self.width_);
+        visit(self.build_cost_);
+    }
+
+private:
+    void Collapse() {
+        if (width_ == 4) {
+            bvh4_ = WideBvh<4>(bvh_);
+        } else if (width_ == 8) {
+            bvh8_ = WideBvh<8>(bvh_);
+        }
+    }
+
+    Bvh bvh_;
+    WideBvh<4> bvh4_;
+    WideBvh<8> bvh8_;
+    int width_ = 2;
+    double build_cost_ = 0;
+};
+
+// Ray queries against all primitives of a scene, organized in two levels. The top level holds the
+// scene's own triangles and spheres together with one box per instance and one per page of paged
+// geometry: ids below GetTriangles().GetSize() are triangles, then come the spheres, the
+// instances and the pages. Every mesh has a bottom level hierarchy in its local space that all of
+// its instances share; every page has its own in the page.
+class Accelerator {
+public:
+    explicit Accelerator(const Scene& scene, int bvh_width = 4)
+        : scene_(scene),
+          meshes_(BuildMeshes(scene, bvh_width)),
+          top_(CollectBoxes(scene, meshes_), bvh_width) {
+    }
+
+    // Takes hierarchies built for the same scene before, as GetMeshHierarchies and
+    // GetTopHierarchy return them.
+    Accelerator(const Scene& scene, std::vector<Hierarchy> meshes, Hierarchy top)
+        : scene_(scene), meshes_(std::move(meshes)), top_(std::move(top)) {
+        if (meshes_.size() != scene.GetMeshes().size()) {
+            throw std::runtime_error("Hierarchies do not match the scene");
+        }
+    }
+
+    // Closest hit along the ray. Ties are resolved towards the smaller primitive id, which is
+    // the order a linear scan over triangles, spheres and then instances would pick.
+    std::optional<Hit> Intersect(const Ray& ray) const {
+        std::optional<HitRecord> closest;
+        double limit = std::numeric_limits<double>::infinity();
+        top_.Traverse(ray, limit, [&](uint32_t id) {
+            IntersectPrimitive(ray, id, closest, limit);
+            return false;
+        });
+        if (!closest.has_value()) {
+            return {};
+        }
+        return MakeHit(ray, *closest);
+    }
+
+    // Closest hits of all rays in a packet, the same as Intersect gives for each of them.
+    std::array<std::optional<Hit>, RayPacket::kSize> Intersect(const RayPacket& packet) const {
+        constexpr size_t kSize = RayPacket::kSize;
+        const auto& triangles = scene_.GetTriangles().GetTriangles();
+        std::array<std::optional<HitRecord>, kSize> closest;
+        std::array<double, kSize> limits;
+        limits.fill(std::numeric_limits<double>::infinity());
+
+        top_.TraversePacket(packet, limits, [&](uint32_t id, RayPacket::Mask mask) {
+            if (id < triangles.size() && std::popcount(mask) >= kMinFilterLanes) {
+                mask = FilterIntersections(packet, triangles[id], mask);
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                size_t lane = std::countr_zero(mask);
+                IntersectPrimitive(packet.GetRay(lane), id, closest[lane], limits[lane]);
+            }
+        });
+
+        std::array<std::optional<Hit>, kSize> hits;
+        for (size_t lane = 0; lane != packet.size; ++lane) {
+            if (closest[lane].has_value()) {
+                hits[lane] = MakeHit(packet.GetRay(lane), *closest[lane]);
+            }
+        }
+        return hits;
+    }
+
+    // Whether anything blocks the ray no farther than max_distance. Stops at the first blocker.
+    bool IsOccluded(const Ray& ray, double max_distance) const {
+        const auto& triangles = scene_.GetTriangles().GetTriangles();
+        const auto& spheres = scene_.GetSphereObjects();
+        const size_t primitives = triangles.size() + spheres.size();
+        const size_t first_page = primitives + scene_.GetInstances().size();
+        bool occluded = false;
+        top_.Traverse(ray, max_distance, [&](uint32_t id) {
+            if (id < triangles.size()) {
+                occluded = HasIntersection(ray, triangles[id], max_distance);
+            } else if (id < primitives) {
+                occluded =
+                    HasIntersection(ray, spheres[id - triangles.size()].sphere, max_distance);
+            } else if (id < first_page) {
+                occluded = IsInstanceOccluded(ray, id - primitives, max_distance);
+            } else {
+                occluded = IsPageOccluded(ray, id - first_page, max_distance);
+            }
+            return occluded;
+        });
+        return occluded;
+    }
+
+    // Picks up new instance transforms of the scene by refitting the top level. Returns true if
+    // the top level had to be rebuilt instead.
+    bool Refit() {
+        return top_.Refit(CollectBoxes(scene_, meshes_));
+    }
+
+    const Bvh& GetBvh() const {
+        return top_.GetBvh();
+    }
+
+    int GetBvhWidth() const {
+        return top_.GetWidth();
+    }
+
+    const std::vector<Hierarchy>& GetMeshHierarchies() const {
+        return meshes_;
+    }
+
+    const Hierarchy& GetTopHierarchy() const {
+        return top_;
+    }
+
+private:
+    // Local rays are not normalized again, so local distances are world distances times the
+    // length of the transformed unit direction. Limits are carried over with a little slack and
+    // every candidate is compared by its world space distance.
+    static constexpr double kLimitSlack = 1 + 1e-7;
+
+    // Fewer lanes than this test a triangle one by one rather than all lanes of the packet at
+    // once.
+    static constexpr int kMinFilterLanes = 4;
+
+    static double GetLocalScale(const Ray& ray, const Ray& local) {
+        return Length(local.GetDirection()) / Length(ray.GetDirection());
+    }
+
+    // Closest hit found so far by a query. The id range tells the kind of primitive, as in the
+    // top level: triangle, sphere or instance, whose triangle is then `sub_id`. Position,
+    // normal and material are only looked up for the final one by MakeHit.
+    struct HitRecord {
+        HitPoint point;
+        uint32_t id = 0;
+        uint32_t sub_id = 0;
+    };
+
+    static void Consider(const HitPoint& point, uint32_t id, uint32_t sub_id,
+                         std::optional<HitRecord>& closest, double& limit) {
+        if (!closest.has_value() || point.distance < closest->point.distance ||
+            (point.distance == closest->point.distance &&
+             std::make_pair(id, sub_id) < std::make_pair(closest->id, closest->sub_id))) {
+            closest = HitRecord{point, id, sub_id};
+            limit = point.distance;
+        }
+    }
+
+    void IntersectPrimitive(const Ray& ray, uint32_t id, std::optional<HitRecord>& closest,
+                            double& limit) const {
+        const auto& triangles = scene_.GetTriangles().GetTriangles();
+        const auto& spheres = scene_.GetSphereObjects();
+        const size_t primitives = triangles.size() + spheres.size();
+        const size_t first_page = primitives + scene_.GetInstances().size();
+        if (id >= first_page) {
+            const PagedGeometry::Page page = scene_.GetPagedGeometry()->GetPage(id - first_page);
+            Bvh::Traverse(page.bvh, ray, limit, [&](uint32_t sub_id) {
+                auto point = GetHitPoint(ray, page.triangles[sub_id]);
+                if (point.has_value()) {
+                    Consider(*point, id, sub_id, closest, limit);
+                }
+                return false;
+            });
+            return;
+        }
+        if (id >= primitives) {
+            IntersectInstance(ray, id - primitives, limit,
+                              [&](const HitPoint& point, uint32_t sub_id) {
+                                  Consider(point, id, sub_id, closest, limit);
+                              });
+            return;
+        }
+        auto point = id < triangles.size()
+                         ? GetHitPoint(ray, triangles[id])
+                         : GetHitPoint(ray, spheres[id - triangles.size()].sphere);
+        if (point.has_value()) {
+            Consider(*point, id, 0, closest, limit);
+        }
+    }
+
+    Hit MakeHit(const Ray& ray, const HitRecord& record) const {
+        const TriangleStore& triangles = scene_.GetTriangles();
+        const auto& spheres = scene_.GetSphereObjects();
+        const HitPoint& point = record.point;
+        if (record.id < triangles.GetSize()) {
+            return Hit{GetIntersection(ray, triangles.GetTriangle(record.id), point),
+                       &triangles,
+                       record.id,
+                       nullptr,
+                       nullptr,
+                       &scene_.GetMaterial(triangles.GetMaterial(record.id)),
+                       point.u,
+                       point.v,
+                       triangles.GetNormals(record.id)};
+        }
+        if (record.id < triangles.GetSize() + spheres.size()) {
+            const SphereObject& sphere = spheres[record.id - triangles.GetSize()];
+            return Hit{GetIntersection(ray, sphere.sphere, point), nullptr, 0, &sphere, nullptr,
+                       &scene_.GetMaterial(sphere.material)};
+        }
+        const size_t first_page =
+            triangles.GetSize() + spheres.size() + scene_.GetInstances().size();
+        if (record.id >= first_page) {
+            const PagedGeometry::Page page =
+                scene_.GetPagedGeometry()->GetPage(record.id - first_page);
+            return Hit{GetIntersection(ray, page.triangles[record.sub_id], point),
+                       nullptr,
+                       record.sub_id,
+                       nullptr,
+                       nullptr,
+                       &scene_.GetMaterial(page.materials[record.sub_id]),
+                       point.u,
+                       point.v,
+                       page.GetNormals(record.sub_id)};
+        }
+        const Instance& instance =
+            scene_.GetInstances()[record.id - triangles.GetSize() - spheres.size()];
+        const TriangleStore& store = scene_.GetMeshes()[instance.mesh].triangles;
+        MaterialId material =
+            instance.material != kNoMaterial ? instance.material : store.GetMaterial(record.sub_id);
+        Intersection local = GetIntersection(instance.to_local.ApplyToRay(ray),
+                                             store.GetTriangle(record.sub_id), point);
+        return Hit{ToWorld(instance, local, point.distance),
+                   &store,
+                   record.sub_id,
+                   nullptr,
+                   &instance,
+                   &scene_.GetMaterial(material),
+                   point.u,
+                   point.v,
+                   store.GetNormals(record.sub_id)};
+    }
+
+    // `distance` is the world space distance the hit was found at.
+    static Intersection ToWorld(const Instance& instance, const Intersection& local,
+                                Scalar distance) {
+        Vector normal = Normalized(instance.to_local.ApplyTransposed(local.GetNormal()));
+        Vector point =
+            instance.to_world.ApplyToPoint(local.GetPosition() - local.GetNormal() * 1e-5);
+        return Intersection(point + normal * 1e-5, normal, distance);
+    }
+
+    // Reports hits with their distance converted to world space.
+    template <class Callback>
+    void IntersectInstance(const Ray& ray, size_t index, const double& limit,
+                           Callback&& callback) const {
+        const Instance& instance = scene_.GetInstances()[index];
+        const auto& triangles = scene_.GetMeshes()[instance.mesh].triangles.GetTriangles();
+        Ray local = instance.to_local.ApplyToRay(ray);
+        double unit_scale = GetLocalScale(ray, local);
+        double scale = unit_scale * kLimitSlack;
+        double local_limit = limit * scale;
+        meshes_[instance.mesh].Traverse(local, local_limit, [&](uint32_t id) {
+            auto point = GetHitPoint(local, triangles[id]);
+            if (point.has_value()) {
+                point->distance /= unit_scale;
+                callback(*point, id);
+                local_limit = limit * scale;
+            }
+            return false;
+        });
+    }
+
+    bool IsInstanceOccluded(const Ray& ray, size_t index, double max_distance) const {
+        const Instance& instance = scene_.GetInstances()[index];
+        const auto& triangles = scene_.GetMeshes()[instance.mesh].triangles.GetTriangles();
+        Ray local = instance.to_local.ApplyToRay(ray);
+        double unit_scale = GetLocalScale(ray, local);
+        double local_limit = max_distance * unit_scale * kLimitSlack;
+        bool occluded = false;
+        meshes_[instance.mesh].Traverse(local, local_limit, [&](uint32_t id) {
+            auto point = GetHitPoint(local, triangles[id]);
+            occluded = point.has_value() && !(point->distance / unit_scale > max_distance);
+            return occluded;
+        });
+        return occluded;
+    }
+
+    bool IsPageOccluded(const Ray& ray, size_t index, double max_distance) const {
+        const PagedGeometry::Page page = scene_.GetPagedGeometry()->GetPage(index);
+        bool occluded = false;
+        Bvh::Traverse(page.bvh, ray, max_distance, [&](uint32_t id) {
+            occluded = HasIntersection(ray, page.triangles[id], max_distance);
+            return occluded;
+        });
+        return occluded;
+    }
+
+    static std::vector<Hierarchy> BuildMeshes(const Scene& scene, int bvh_width) {
+        std::vector<Hierarchy> meshes;
+        meshes.reserve(scene.GetMeshes().size());
+        for (const auto& mesh : scene.GetMeshes()) {
+            std::vector<BoundingBox> boxes;
+            boxes.reserve(mesh.triangles.GetSize());
+            for (const auto& triangle : mesh.triangles.GetTriangles()) {
+                boxes.push_back(GetBoundingBox(triangle));
+            }
+            meshes.emplace_back(boxes, bvh_width);
+        }
+        return meshes;
+    }
+
+    static BoundingBox GetInstanceBox(const Instance& instance, const BoundingBox& local) {
+        BoundingBox box;
+        if (local.IsEmpty()) {
+            return box;
+        }
+        for (int corner = 0; corner != 8; ++corner) {
+            box.Extend(instance.to_world.ApplyToPoint(
+                {(corner & 1) ? local.GetMax()[0] : local.GetMin()[0],
+                 (corner & 2) ? local.GetMax()[1] : local.GetMin()[1],
+                 (corner & 4) ? local.GetMax()[2] : local.GetMin()[2]}));
+        }
+        Vector extent = box.GetMax() - box.GetMin();
+        box.Pad(1e-9 * std::max({extent[0], extent[1], extent[2]}));
+        return box;
+    }
+
+    static std::vector<BoundingBox> CollectBoxes(const Scene& scene,
+                                                 const std::vector<Hierarchy>& meshes) {
+        std::vector<BoundingBox> boxes;
+        boxes.reserve(scene.GetTriangles().GetSize() + scene.GetSphereObjects().size() +
+                      scene.GetInstances().size());
+        for (const auto& triangle : scene.GetTriangles().GetTriangles()) {
+            boxes.push_back(GetBoundingBox(triangle));
+        }
+        for (const auto& obj : scene.GetSphereObjects()) {
+            boxes.push_back(GetBoundingBox(obj.sphere));
+        }
+        for (const auto& instance : scene.GetInstances()) {
+            boxes.push_back(GetInstanceBox(instance, meshes[instance.mesh].GetBounds()));
+        }
+        if (const PagedGeometry* paged = scene.GetPagedGeometry()) {
+            for (size_t page = 0; page != paged->GetPageCount(); ++page) {
+                boxes.push_back(paged->GetPageInfo(page).bounds);
+            }
+        }
+        return boxes;
+    }
+
+    const Scene& scene_;
+    std::vector<Hierarchy> meshes_;
+    Hierarchy top_;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "raytracer.h"
+#include "../raytracer-reader/config_reader.h"
+#include "../raytracer-reader/tokenizer.h"
+
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One image of a batch: the config with its camera and render options, and where the image goes.
+struct BatchView {
+    std::string config;
+    std::string output;
+};
+
+// A manifest has one `<config> <output>` line per view, with paths relative to the manifest.
+// Empty lines and comments starting with '#' are skipped.
+inline std::vector<BatchView> ReadManifest(const std::string& filename) {
+    if (!std::filesystem::is_regular_file(filename)) {
+        throw std::runtime_error("Can't open manifest " + filename);
+    }
+    const std::filesystem::path dir = std::filesystem::path(filename).parent_path();
+    MappedFile file(filename);
+    std::string_view text = file.GetText();
+    std::vector<std::string_view> tokens;
+    std::vector<BatchView> views;
+    for (std::string_view line; NextLine(text, line);) {
+        SplitTokens(line, tokens);
+        if (tokens.empty()) {
+            continue;
+        }
+        if (tokens.size() != 2) {
+            throw std::runtime_error("Manifest lines are '<config> <output>': " +
+                                     std::string(line));
+        }
+        views.push_back({(dir / tokens[0]).lexically_normal().string(),
+                         (dir / tokens[1]).lexically_normal().string()});
+        if (!std::filesystem::is_regular_file(views.back().config)) {
+            throw std::runtime_error("Can't open config " + views.back().config);
+        }
+    }
+    return views;
+}
+
+// Renders every view of a batch from one copy of the scene. Views are rendered several at a time
+// when there are more CPUs than views need: each view gets an equal share of the CPUs unless its
+// config sets `render threads`, and no more views run at once than the largest such count leaves
+// room for. Acceleration structures are built once per BVH width. The scene is loaded once, so
+// views must agree on `render scene_cache` and `geometry_budget_mb`. Frames, workers and
+// snapshots of the configs are ignored. A view that fails is reported and the others are still
+// rendered; returns the number of failed views.
+inline size_t RenderBatch(const std::string& filename, const std::vector<BatchView>& views) {
+    std::vector<std::pair<RenderOptions, CameraOptions>> options;
+    for (const auto& view : views) {
+        options.push_back(ReadConfig(view.config));
+    }
+    if (views.empty()) {
+        return 0;
+    }
+    for (size_t k = 1; k != views.size(); ++k) {
+        if (options[k].first.scene_cache != options[0].first.scene_cache ||
+            options[k].first.geometry_budget_mb != options[0].first.geometry_budget_mb) {
+            throw std::runtime_error("Views of a batch must agree on render scene_cache and "
+                                     "geometry_budget_mb: " +
+                                     views[k].config + " differs from " + views[0].config);
+        }
+    }
+
+    LoadedScene loaded(filename, options[0].first);
+    const Scene& scene = loaded.GetScene();
+    std::map<int, Accelerator> accelerators;
+    for (const auto& [render_options, camera_options] : options) {
+        if (render_options.bvh_width != loaded.GetAccelerator().GetBvhWidth()) {
+            accelerators.try_emplace(render_options.bvh_width, scene, render_options.bvh_width);
+        }
+    }
+
+    const int cpus = GetDefaultThreadCount();
+    int max_threads = 1;
+    for (const auto& [render_options, camera_options] : options) {
+        max_threads = std::max(max_threads, render_options.threads);
+    }
+    const int jobs = std::clamp<int>(cpus / max_threads, 1, views.size());
+    std::vector<std::string> errors(views.size());
+    ParallelFor(views.size(), jobs, [&](size_t k) {
+        auto [render_options, camera_options] = options[k];
+        if (render_options.threads <= 0) {
+            render_options.threads = std::max(1, cpus / jobs);
+        }
+        const Accelerator& accelerator =
+            render_options.bvh_width == loaded.GetAccelerator().GetBvhWidth()
+                ? loaded.GetAccelerator()
+                : accelerators.at(render_options.bvh_width);
+        try {
+            RenderToFile(scene, accelerator, camera_options, render_options, views[k].output);
+        } catch (const std::exception& e) {
+            errors[k] = e.what();
+        }
+    });
+
+    size_t failed = 0;
+    for (size_t k = 0; k != views.size(); ++k) {
+        if (!errors[k].empty()) {
+            std::cerr << views[k].output << ": " << errors[k] << "\n";
+            ++failed;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,171 @@
+// Compares the binary BVH with its 4- and 8-wide SIMD collapse on closest-hit and occlusion
+// queries, and single camera rays with packets of them. Usage: bench-accelerator [obj files...]
+// (defaults to the deer and classic box tests).
+
+#include "../accelerator.h"
+#include "../matrix.h"
+#include "../../tools/util/bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Camera looking at the scene from outside its bounding box.
+RayTransformer MakeCamera(const BoundingBox& box, int size) {
+    Vector center = box.GetCenter();
+    Vector extent = box.GetMax() - box.GetMin();
+    double radius = Length(extent) / 2;
+    Vector from = center + Vector{0.6, 0.4, 1.0} * (radius * 1.5);
+    return RayTransformer(CameraOptions(size, size, 1.0, {from[0], from[1], from[2]},
+                                        {center[0], center[1], center[2]}));
+}
+
+std::vector<Ray> MakeCameraRays(const BoundingBox& box, int size) {
+    RayTransformer rt = MakeCamera(box, size);
+    std::vector<Ray> rays;
+    rays.reserve(size * size);
+    for (int i = 0; i != size; ++i) {
+        for (int j = 0; j != size; ++j) {
+            rays.push_back(rt(j, i));
+        }
+    }
+    return rays;
+}
+
+template <class Query>
+double Measure(const std::vector<Ray>& rays, int repeats, Query&& query) {
+    auto start = Clock::now();
+    for (int r = 0; r != repeats; ++r) {
+        for (const auto& ray : rays) {
+            query(ray);
+        }
+    }
+    return rays.size() * repeats / Seconds(start) / 1e6;
+}
+
+void Run(const std::string& path) {
+    auto load_start = Clock::now();
+    Scene scene = ReadScene(path);
+    double load_time = Seconds(load_start);
+    std::printf("%s: %zu triangles, %zu spheres, loaded in %.3f s\n", path.c_str(),
+                scene.GetTriangles().GetSize(), scene.GetSphereObjects().size(), load_time);
+
+    std::vector<Accelerator> accelerators;
+    accelerators.reserve(3);
+    for (int width : {2, 4, 8}) {
+        auto start = Clock::now();
+        accelerators.emplace_back(scene, width);
+        std::printf("  build bvh%d: %.3f s\n", width, Seconds(start));
+    }
+
+    const auto& root = accelerators[0].GetBvh().GetNodes().at(0).box;
+    auto rays = MakeCameraRays(root, 256);
+
+    // Shadow rays from every camera hit towards a point above the scene.
+    Vector light = root.GetCenter() + Vector{0, 1, 0} * Length(root.GetMax() - root.GetMin());
+    std::vector<Ray> shadow_rays;
+    std::vector<double> shadow_limits;
+    for (const auto& ray : rays) {
+        if (auto hit = accelerators[0].Intersect(ray)) {
+            shadow_rays.emplace_back(light, hit->intersection.GetPosition() - light);
+            shadow_limits.push_back(Length(hit->intersection.GetPosition() - light) - 1e-3);
+        }
+    }
+
+    // All widths must agree on every query.
+    size_t mismatches = 0;
+    for (const auto& ray : rays) {
+        auto expected = accelerators[0].Intersect(ray);
+        for (size_t a = 1; a != accelerators.size(); ++a) {
+            auto hit = accelerators[a].Intersect(ray);
+            if (hit.has_value() != expected.has_value() ||
+                (hit.has_value() && (hit->triangles != expected->triangles ||
+                                     hit->triangle != expected->triangle ||
+                                     hit->sphere != expected->sphere ||
+                                     hit->intersection.GetDistance() !=
+                                         expected->intersection.GetDistance()))) {
+                ++mismatches;
+            }
+        }
+    }
+    for (size_t i = 0; i != shadow_rays.size(); ++i) {
+        bool expected = accelerators[0].IsOccluded(shadow_rays[i], shadow_limits[i]);
+        for (size_t a = 1; a != accelerators.size(); ++a) {
+            mismatches += accelerators[a].IsOccluded(shadow_rays[i], shadow_limits[i]) != expected;
+        }
+    }
+    // Packets of camera rays, in the pixel order of `rays`.
+    const int size = 256;
+    const int side = RayTransformer::kPacketSide;
+    RayTransformer camera = MakeCamera(root, size);
+    std::vector<RayPacket> packets;
+    for (int i = 0; i < size; i += side) {
+        for (int j = 0; j < size; j += side) {
+            packets.push_back(camera.GetPacket(j, i, std::min(side, size - j),
+                                               std::min(side, size - i)));
+        }
+    }
+    for (const auto& accelerator : accelerators) {
+        for (const auto& packet : packets) {
+            auto hits = accelerator.Intersect(packet);
+            for (size_t lane = 0; lane != packet.size; ++lane) {
+                auto expected = accelerator.Intersect(packet.GetRay(lane));
+                mismatches += hits[lane].has_value() != expected.has_value() ||
+                              (expected.has_value() &&
+                               (hits[lane]->triangles != expected->triangles ||
+                                hits[lane]->triangle != expected->triangle ||
+                                hits[lane]->sphere != expected->sphere ||
+                                hits[lane]->intersection.GetDistance() !=
+                                    expected->intersection.GetDistance()));
+            }
+        }
+    }
+    std::printf("  %zu camera rays, %zu shadow rays, %zu mismatches\n", rays.size(),
+                shadow_rays.size(), mismatches);
+
+    const int repeats = 5;
+    for (const auto& accelerator : accelerators) {
+        size_t hits = 0;
+        double closest = Measure(rays, repeats, [&](const Ray& ray) {
+            hits += accelerator.Intersect(ray).has_value();
+        });
+        size_t index = 0;
+        size_t occluded = 0;
+        double any = Measure(shadow_rays, repeats, [&](const Ray& ray) {
+            occluded += accelerator.IsOccluded(ray, shadow_limits[index]);
+            index = (index + 1) % shadow_rays.size();
+        });
+        std::printf("  bvh%d: closest-hit %.2f Mrays/s, occlusion %.2f Mrays/s\n",
+                    accelerator.GetBvhWidth(), closest, any);
+    }
+    auto start = Clock::now();
+    size_t packet_hits = 0;
+    for (int r = 0; r != repeats; ++r) {
+        for (const auto& packet : packets) {
+            for (const auto& hit : accelerators[0].Intersect(packet)) {
+                packet_hits += hit.has_value();
+            }
+        }
+    }
+    std::printf("  packets of %d: closest-hit %.2f Mrays/s\n", side * side,
+                size * size * repeats / Seconds(start) / 1e6);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        paths.emplace_back(argv[i]);
+    }
+    if (paths.empty()) {
+        std::string tests = std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/";
+        paths = {tests + "deer/CERF_Free.obj", tests + "classic_box/CornellBox-Original.obj"};
+    }
+    for (const auto& path : paths) {
+        Run(path);
+    }
+}
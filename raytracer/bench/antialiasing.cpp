@@ -0,0 +1,96 @@
+// Compares adaptive anti-aliasing against one ray per pixel and against uniform supersampling:
+// the time, the mean number of camera rays per pixel and the RMS error of the 8-bit image
+// against a reference of 64 uniform rays per pixel. Usage: bench-antialiasing [max spp]
+// (defaults to 16; renders the mirrors and deer tests).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Case {
+    std::string path;
+    CameraOptions camera;
+    RenderOptions render_options;
+};
+
+double GetMeanSamples(const Frame& frame) {
+    double sum = 0;
+    for (uint16_t samples : frame.samples) {
+        sum += samples;
+    }
+    return sum / frame.samples.size();
+}
+
+void Run(const Case& test, int max_spp) {
+    Scene scene = ReadScene(test.path);
+    Accelerator accelerator(scene);
+    std::printf("%s: %dx%d\n", test.path.c_str(), test.camera.screen_width,
+                test.camera.screen_height);
+
+    RenderOptions reference_options = test.render_options;
+    reference_options.max_spp = 64;
+    reference_options.aa_threshold = 0;
+    Frame reference_frame = RenderFrame(scene, accelerator, test.camera, reference_options);
+    // Every image gets the white point of the reference, so that they are comparable.
+    const float* values = reference_frame.pixels.GetPixel(0, 0);
+    const double white_point =
+        test.render_options.mode == RenderMode::kNormal
+            ? 0
+            : *std::max_element(values, values + reference_frame.pixels.GetSize());
+    const int threads = GetThreadCount(test.render_options);
+    Image reference = MakeImage(reference_frame, threads, white_point);
+
+    struct Variant {
+        std::string name;
+        int max_spp;
+        double aa_threshold;
+    };
+    std::vector<Variant> variants = {
+        {"1 ray per pixel", 1, 0},
+        {"uniform, 4 rays", 4, 0},
+        {"uniform, " + std::to_string(max_spp) + " rays", max_spp, 0},
+    };
+    for (double threshold : {0.02, 0.01, 0.005}) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "adaptive, threshold %g", threshold);
+        variants.push_back({name, max_spp, threshold});
+    }
+    for (const auto& variant : variants) {
+        RenderOptions render_options = test.render_options;
+        render_options.max_spp = variant.max_spp;
+        render_options.aa_threshold = variant.aa_threshold;
+        auto start = Clock::now();
+        Frame frame = RenderFrame(scene, accelerator, test.camera, render_options);
+        double time = Seconds(start);
+        std::printf("  %-26s %7.3f s, %6.2f rays per pixel, RMS error %.2f\n",
+                    variant.name.c_str(), time, GetMeanSamples(frame),
+                    GetError(MakeImage(frame, threads, white_point), reference));
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const int max_spp = argc > 1 ? std::stoi(argv[1]) : 16;
+    std::string tests = std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/";
+    RenderOptions full{4};
+    RenderOptions normal{1};
+    normal.mode = RenderMode::kNormal;
+    CameraOptions deer(500, 500, 1.0471975512, {100, 200, 150}, {0, 100, 0});
+    std::vector<Case> cases = {
+        {tests + "mirrors/scene.obj", CameraOptions(640, 480, M_PI / 2, {2, 1.5, -0.2}, {1, 1, -2}),
+         full},
+        {tests + "deer/CERF_Free.obj", deer, full},
+        {tests + "deer/CERF_Free.obj", deer, normal},
+    };
+    for (const auto& test : cases) {
+        Run(test, max_spp);
+    }
+}
@@ -0,0 +1,84 @@
+// Renders views from cameras on a circle around a scene, once as separate invocations of the
+// raytracer, which parse the scene or load its cache each time, and once as a single --batch run.
+// Usage: bench-batch [obj file] [views] [image side] (defaults to 100 views of the deer test,
+// 160 pixels wide).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace {
+
+void Run(const std::string& command) {
+    if (std::system(command.c_str()) != 0) {
+        std::fprintf(stderr, "failed: %s\n", command.c_str());
+        std::exit(1);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const std::string obj =
+        argc > 1 ? std::filesystem::absolute(argv[1]).string()
+                 : std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/deer/CERF_Free.obj";
+    const int views = argc > 2 ? std::stoi(argv[2]) : 100;
+    const int side = argc > 3 ? std::stoi(argv[3]) : 160;
+
+    Scene scene = ReadScene(obj);
+    Accelerator accelerator(scene);
+    BoundingBox bounds = accelerator.GetTopHierarchy().GetBounds();
+    Vector center = bounds.GetCenter();
+    double radius = Length(bounds.GetMax() - bounds.GetMin());
+
+    auto dir = std::filesystem::temp_directory_path() / "bench-batch";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "out");
+    std::ofstream manifest(dir / "manifest");
+    for (int k = 0; k != views; ++k) {
+        double angle = 2 * M_PI * k / views;
+        std::string view = (dir / ("view" + std::to_string(k))).string();
+        std::ofstream config(view + ".cfg");
+        config << "camera w " << side << "\ncamera h " << side << "\ncamera from "
+               << center[0] + radius * std::cos(angle) << " " << center[1] + radius / 2 << " "
+               << center[2] + radius * std::sin(angle) << "\ncamera to " << center[0] << " "
+               << center[1] << " " << center[2] << "\nrender depth 3\n";
+        config.close();
+        std::filesystem::copy_file(view + ".cfg", view + ".nocache.cfg");
+        std::ofstream(view + ".nocache.cfg", std::ios::app) << "render scene_cache off\n";
+        manifest << "view" << k << ".nocache.cfg out/view" << k << ".png\n";
+    }
+    manifest.close();
+    std::printf("%s: %zu triangles, %d views of %dx%d\n", obj.c_str(),
+                scene.GetTriangles().GetSize(), views, side, side);
+
+    const std::string binary = std::string("'") + RAYTRACER_BINARY + "'";
+    const std::string cache = GetSceneCachePath(obj);
+    for (bool use_cache : {false, true}) {
+        std::filesystem::remove(cache);
+        if (use_cache) {
+            Run(binary + " --build-cache '" + obj + "' > /dev/null");
+        }
+        auto start = Clock::now();
+        for (int k = 0; k != views; ++k) {
+            std::string view = (dir / ("view" + std::to_string(k))).string();
+            std::string config = view + (use_cache ? ".cfg" : ".nocache.cfg");
+            Run(binary + " '" + obj + "' '" + (dir / "out" / "single.png").string() + "' '" +
+                config + "'");
+        }
+        std::printf("  separate invocations, %s: %.2f s\n",
+                    use_cache ? "scene cache" : "parsing", Seconds(start));
+    }
+    std::filesystem::remove(cache);
+
+    auto start = Clock::now();
+    Run(binary + " --batch '" + obj + "' '" + (dir / "manifest").string() + "'");
+    std::printf("  one batch, parsing: %.2f s\n", Seconds(start));
+}
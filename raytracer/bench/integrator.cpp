@@ -0,0 +1,79 @@
+// Renders full mode images with the recursive and the wavefront integrator on one thread, checks
+// that they agree pixel for pixel and compares their speed. Usage: bench-integrator (renders the
+// mirrors and classic box tests).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Case {
+    std::string path;
+    CameraOptions camera;
+    int depth;
+};
+
+std::vector<RGB> GetPixels(const Image& image) {
+    std::vector<RGB> pixels;
+    for (int y = 0; y != image.Height(); ++y) {
+        for (int x = 0; x != image.Width(); ++x) {
+            pixels.push_back(image.GetPixel(y, x));
+        }
+    }
+    return pixels;
+}
+
+void Run(const Case& test) {
+    Scene scene = ReadScene(test.path);
+    Accelerator accelerator(scene, 4);
+    std::printf("%s: %dx%d, depth %d\n", test.path.c_str(), test.camera.screen_width,
+                test.camera.screen_height, test.depth);
+
+    std::vector<std::vector<RGB>> images;
+    for (Integrator integrator : {Integrator::kRecursive, Integrator::kWavefront}) {
+        RenderOptions render_options{test.depth};
+        render_options.integrator = integrator;
+        render_options.threads = 1;
+        const int repeats = 5;
+        double best = 0;
+        for (int r = 0; r != repeats; ++r) {
+            auto start = Clock::now();
+            Image image = Render(scene, accelerator, test.camera, render_options);
+            double time = Seconds(start);
+            best = r == 0 ? time : std::min(best, time);
+            if (r == 0) {
+                images.push_back(GetPixels(image));
+            }
+        }
+        double pixels = static_cast<double>(test.camera.screen_width) * test.camera.screen_height;
+        std::printf("  %s: %.3f s, %.2f Mpixels/s\n",
+                    integrator == Integrator::kRecursive ? "recursive" : "wavefront", best,
+                    pixels / best / 1e6);
+    }
+
+    size_t mismatches = 0;
+    for (size_t k = 0; k != images[0].size(); ++k) {
+        mismatches += !(images[0][k] == images[1][k]);
+    }
+    std::printf("  %zu mismatching pixels\n", mismatches);
+}
+
+}  // namespace
+
+int main() {
+    std::string tests = std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/";
+    std::vector<Case> cases = {
+        {tests + "mirrors/scene.obj", CameraOptions(640, 480, M_PI / 2, {2, 1.5, -0.2}, {1, 1, -2}),
+         9},
+        {tests + "classic_box/CornellBox-Original.obj",
+         CameraOptions(640, 480, 1.0471975512, {0, 0.7, 1.75}, {0, 0.7, 0}), 4},
+    };
+    for (const auto& test : cases) {
+        Run(test);
+    }
+}
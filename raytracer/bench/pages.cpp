@@ -0,0 +1,120 @@
+// Renders a generated mesh larger than the geometry budget, once with all of it in memory and
+// once from its page file at several budgets, and reports the time and peak resident memory of
+// each run. The paged images must equal the in-memory one; the page counters of every run are
+// printed by the raytracer itself. Usage: bench-pages [grid side] [image side] (defaults to a
+// bumpy sphere of 2 * 1000^2 triangles, 256 pixels wide).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern char** environ;
+
+namespace {
+
+// Writes a sphere of side x side cells with two triangles per cell and a bumpy surface, lit by a
+// point light.
+std::string WriteSphere(const std::filesystem::path& dir, int side) {
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "sphere.mtl") << "newmtl white\nKd 0.8 0.8 0.8\n";
+    std::string path = (dir / "sphere.obj").string();
+    std::ofstream out(path);
+    out << "mtllib sphere.mtl\nusemtl white\n";
+    char line[128];
+    for (int i = 0; i <= side; ++i) {
+        double theta = M_PI * i / side;
+        for (int j = 0; j != side; ++j) {
+            double phi = 2 * M_PI * j / side;
+            double r = 1 + 0.05 * std::sin(7 * theta) * std::cos(11 * phi);
+            std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n",
+                          r * std::sin(theta) * std::cos(phi), r * std::cos(theta),
+                          r * std::sin(theta) * std::sin(phi));
+            out << line;
+        }
+    }
+    for (int i = 0; i != side; ++i) {
+        for (int j = 0; j != side; ++j) {
+            int a = i * side + j + 1;
+            int b = i * side + (j + 1) % side + 1;
+            int c = a + side;
+            int d = b + side;
+            out << "f " << a << " " << b << " " << d << "\nf " << a << " " << d << " " << c
+                << "\n";
+        }
+    }
+    out << "P 3 3 3 1 1 1\n";
+    return path;
+}
+
+// Runs the raytracer and returns its peak resident memory in MB.
+double Run(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int status;
+    rusage usage;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0 ||
+        wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        std::fprintf(stderr, "failed: %s\n", args[1].c_str());
+        std::exit(1);
+    }
+    return usage.ru_maxrss / 1024.0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const int side = argc > 1 ? std::stoi(argv[1]) : 1000;
+    const int image = argc > 2 ? std::stoi(argv[2]) : 256;
+    auto dir = std::filesystem::temp_directory_path() / "bench-pages";
+    std::filesystem::remove_all(dir);
+    const std::string obj = WriteSphere(dir, side);
+    std::printf("%s: %d triangles, %dx%d\n", obj.c_str(), 2 * side * side, image, image);
+
+    auto write_config = [&](const std::string& name, const std::string& extra) {
+        std::string path = (dir / (name + ".cfg")).string();
+        std::ofstream(path) << "camera w " << image << "\ncamera h " << image
+                            << "\ncamera from 0 0 3\ncamera to 0 0 0\nrender depth 2\n"
+                            << extra;
+        return path;
+    };
+    const std::string binary = RAYTRACER_BINARY;
+    const std::string reference = (dir / "memory.png").string();
+    auto start = Clock::now();
+    double rss = Run({binary, obj, reference, write_config("memory", "render scene_cache off\n")});
+    std::printf("  in memory, parsing:      %6.2f s, %7.1f MB peak\n", Seconds(start), rss);
+
+    start = Clock::now();
+    const std::string build = write_config("build", "render geometry_budget_mb 1\n");
+    rss = Run({binary, "--build-cache", obj, build});
+    std::printf("  writing the page file:   %6.2f s, %7.1f MB peak, %.1f MB file\n", Seconds(start),
+                rss, std::filesystem::file_size(GetPageFilePath(obj)) / 1e6);
+
+    for (int budget : {64, 16, 4, 1}) {
+        std::string name = "budget" + std::to_string(budget);
+        std::string output = (dir / (name + ".png")).string();
+        std::string config =
+            write_config(name, "render geometry_budget_mb " + std::to_string(budget) + "\n");
+        start = Clock::now();
+        rss = Run({binary, obj, output, config});
+        bool same = MappedFile(output).GetText() == MappedFile(reference).GetText();
+        std::printf("  paged, %2d MB budget:     %6.2f s, %7.1f MB peak%s\n", budget,
+                    Seconds(start), rss, same ? "" : ", IMAGE DIFFERS");
+    }
+}
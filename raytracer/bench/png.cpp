@@ -0,0 +1,108 @@
+// Compares writing an 8K frame with libpng's defaults, as Image::Write did before, against
+// PngWriter at several levels and thread counts and against PPM. Every PNG is read back with
+// libpng and checked against the frame. Usage: bench-png [threads] (defaults to every CPU).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace {
+
+void WriteWithLibpng(const Image& image, const std::string& filename) {
+    FILE* fp = fopen(filename.c_str(), "wb");
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    if (setjmp(png_jmpbuf(png))) {
+        abort();
+    }
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, image.Width(), image.Height(), 8, PNG_COLOR_TYPE_RGBA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    std::vector<png_byte> row(image.Width() * 4);
+    for (int y = 0; y != image.Height(); ++y) {
+        for (int x = 0; x != image.Width(); ++x) {
+            RGB pixel = image.GetPixel(y, x);
+            row[x * 4] = pixel.r;
+            row[x * 4 + 1] = pixel.g;
+            row[x * 4 + 2] = pixel.b;
+            row[x * 4 + 3] = 255;
+        }
+        png_write_row(png, row.data());
+    }
+    png_write_end(png, nullptr);
+    fclose(fp);
+    png_destroy_write_struct(&png, &info);
+}
+
+bool Matches(const Image& image, const std::string& filename) {
+    Image read(filename);
+    for (int y = 0; y != image.Height(); ++y) {
+        for (int x = 0; x != image.Width(); ++x) {
+            if (!(read.GetPixel(y, x) == image.GetPixel(y, x))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <class Write>
+void Run(const char* name, const std::string& filename, const Image& image, Write&& write) {
+    const int repeats = 3;
+    double best = 0;
+    for (int r = 0; r != repeats; ++r) {
+        auto start = Clock::now();
+        write();
+        double time = Seconds(start);
+        best = r == 0 ? time : std::min(best, time);
+    }
+    bool png = GetImageFormat(filename) == ImageFormat::kPng;
+    std::printf("  %-28s %.3f s, %6.1f MB%s\n", name, best,
+                std::filesystem::file_size(filename) / 1e6,
+                !png ? "" : Matches(image, filename) ? ", reads back" : ", DIFFERS");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const int threads = argc > 1 ? std::stoi(argv[1]) : GetDefaultThreadCount();
+    // The Cornell box rendered at a quarter of 8K in each direction and repeated 4x4 times.
+    CameraOptions camera(1920, 1080, 1.0471975512, {0, 0.7, 1.75}, {0, 0.7, 0});
+    Scene scene = ReadScene(std::string(RAYTRACER_SOURCE_DIR) +
+                            "/raytracer/tests/classic_box/CornellBox-Original.obj");
+    Accelerator accelerator(scene);
+    Image tile = Render(scene, accelerator, camera, RenderOptions{4});
+    Image image(4 * tile.Width(), 4 * tile.Height());
+    for (int y = 0; y != image.Height(); ++y) {
+        for (int x = 0; x != image.Width(); ++x) {
+            image.SetPixel(tile.GetPixel(y % tile.Height(), x % tile.Width()), y, x);
+        }
+    }
+    std::printf("%dx%d frame, %d threads\n", image.Width(), image.Height(), threads);
+
+    auto dir = std::filesystem::temp_directory_path() / "bench-png";
+    std::filesystem::create_directories(dir);
+    const std::string png = (dir / "frame.png").string();
+    Run("libpng defaults", png, image, [&] { WriteWithLibpng(image, png); });
+    for (int level : {6, 1}) {
+        for (int t : {1, threads}) {
+            OutputOptions options;
+            options.png_level = level;
+            std::string name =
+                "level " + std::to_string(level) + ", " + std::to_string(t) + " threads";
+            Run(name.c_str(), png, image, [&] { image.Write(png, options, t); });
+        }
+    }
+    OutputOptions fast;
+    fast.png_level = 1;
+    fast.png_filter = PngFilter::kUp;
+    Run("level 1, up filter", png, image, [&] { image.Write(png, fast, threads); });
+    const std::string ppm = (dir / "frame.ppm").string();
+    Run("ppm", ppm, image, [&] { image.WritePpm(ppm); });
+}
@@ -0,0 +1,110 @@
+// Renders at several depths with every bounce followed, with bounces of low throughput cut and
+// with Russian roulette, and reports the rays cast, the time and the RMS error of the 8-bit image
+// against the one with every bounce. Rays are counted by walking the same ray tree Recursive
+// does, with ForEachBounce. Usage: bench-pruning [threads] (defaults to every CPU; renders the
+// mirrors test and the box test, whose glass sphere splits rays).
+
+#include "../raytracer.h"
+#include "../../tools/util/bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Rays that hit or miss something and shadow rays towards the lights.
+struct RayCount {
+    uint64_t traced = 0;
+    uint64_t shadow = 0;
+};
+
+void CountRays(int depth, const Scene& scene, const Accelerator& accelerator, const Ray& ray,
+               bool in, Scalar throughput, const PathPruning& pruning, RayCount& count) {
+    ++count.traced;
+    auto hit = accelerator.Intersect(ray);
+    if (!hit.has_value()) {
+        return;
+    }
+    count.shadow += scene.GetLights().size();
+    if (depth != 0) {
+        Vector normal = Normalized(hit->GetShadingNormal());
+        ForEachBounce(ray, *hit, normal, in, throughput, pruning,
+                      [&](const Ray& next, Scalar, bool next_in, Scalar next_throughput) {
+                          CountRays(depth - 1, scene, accelerator, next, next_in,
+                                    next_throughput, pruning, count);
+                      });
+    }
+}
+
+RayCount CountRays(const Scene& scene, const Accelerator& accelerator,
+                   const CameraOptions& camera, const RenderOptions& render_options) {
+    RayTransformer rt(camera);
+    RayCount count;
+    for (int i = 0; i != camera.screen_height; ++i) {
+        for (int j = 0; j != camera.screen_width; ++j) {
+            CountRays(render_options.depth, scene, accelerator, rt(j, i), false, 1,
+                      render_options.pruning, count);
+        }
+    }
+    return count;
+}
+
+void Run(const std::string& path, const CameraOptions& camera, int threads) {
+    Scene scene = ReadScene(path);
+    Accelerator accelerator(scene);
+    std::printf("%s: %dx%d\n", path.c_str(), camera.screen_width, camera.screen_height);
+
+    struct Variant {
+        const char* name;
+        PathPruning pruning;
+    };
+    const std::vector<Variant> variants = {
+        {"cut below 0.01", {0.01, false}},
+        {"cut below 0.001", {0.001, false}},
+        {"roulette below 0.01", {0.01, true}},
+        {"roulette below 0.1", {0.1, true}},
+    };
+    for (int depth : {3, 6, 9, 12}) {
+        std::printf(" depth %d\n", depth);
+        RenderOptions full{depth};
+        full.threads = threads;
+        auto start = Clock::now();
+        Frame reference_frame = RenderFrame(scene, accelerator, camera, full);
+        double time = Seconds(start);
+        // Every image gets the white point of the one with every bounce.
+        const float* values = reference_frame.pixels.GetPixel(0, 0);
+        const double white_point =
+            *std::max_element(values, values + reference_frame.pixels.GetSize());
+        Image reference = MakeImage(reference_frame, threads, white_point);
+        auto print = [&](const char* name, const RenderOptions& render_options, double time,
+                         const Image& image) {
+            RayCount count = CountRays(scene, accelerator, camera, render_options);
+            std::printf("  %-20s %7.3f s, %6.2f M rays + %6.2f M shadow rays, RMS error %.2f\n",
+                        name, time, count.traced / 1e6, count.shadow / 1e6,
+                        GetError(image, reference));
+        };
+        print("every bounce", full, time, reference);
+        for (const auto& variant : variants) {
+            RenderOptions render_options = full;
+            render_options.pruning = variant.pruning;
+            start = Clock::now();
+            Frame frame = RenderFrame(scene, accelerator, camera, render_options);
+            time = Seconds(start);
+            print(variant.name, render_options, time, MakeImage(frame, threads, white_point));
+        }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const int threads = argc > 1 ? std::stoi(argv[1]) : GetDefaultThreadCount();
+    std::string tests = std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/";
+    Run(tests + "mirrors/scene.obj", CameraOptions(320, 240, M_PI / 2, {2, 1.5, -0.2}, {1, 1, -2}),
+        threads);
+    Run(tests + "box/cube.obj", CameraOptions(320, 240, 1.0471975512, {0, 0.7, 1.75}, {0, 0.7, 0}),
+        threads);
+}
@@ -0,0 +1,150 @@
+// Compares reading the numbers of OBJ files with the shared tokenizer against the line reader it
+// replaced (std::getline, one std::string per token, std::stod and std::stoi), and times
+// ReadScene as a whole. Usage: bench-reader [obj files...] (defaults to a generated grid of
+// 2M triangles and the deer test).
+
+#include "../../raytracer-reader/scene.h"
+#include "../../tools/util/bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Writes a height field of side x side vertices with two triangles per cell.
+std::string WriteGrid(const std::filesystem::path& dir, int side) {
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "grid.mtl") << "newmtl white\nKd 0.8 0.8 0.8\n";
+    std::string path = (dir / "grid.obj").string();
+    std::ofstream out(path);
+    out << "mtllib grid.mtl\nusemtl white\n";
+    char line[128];
+    for (int i = 0; i != side; ++i) {
+        for (int j = 0; j != side; ++j) {
+            std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", i * 0.01,
+                          std::sin(i * 0.1) * std::cos(j * 0.1), j * 0.01);
+            out << line;
+        }
+    }
+    for (int i = 0; i + 1 != side; ++i) {
+        for (int j = 0; j + 1 != side; ++j) {
+            int v = i * side + j + 1;
+            out << "f " << v << ' ' << v + 1 << ' ' << v + side << "\nf " << v + 1 << ' '
+                << v + side + 1 << ' ' << v + side << '\n';
+        }
+    }
+    return path;
+}
+
+// Sum of the coordinates of the vertices and the indices of the faces, read line by line.
+double SumLegacy(const std::string& path) {
+    std::ifstream f(path);
+    double sum = 0;
+    for (std::string line; std::getline(f, line);) {
+        std::vector<std::string> tokens;
+        std::string token;
+        for (char c : line) {
+            if (!isspace(c)) {
+                token.push_back(c);
+            } else if (!token.empty()) {
+                tokens.push_back(token);
+                token = "";
+            }
+        }
+        if (!token.empty()) {
+            tokens.push_back(token);
+        }
+        if (tokens.empty()) {
+            continue;
+        }
+        if (tokens[0] == "v" || tokens[0] == "vn") {
+            for (size_t i = 1; i != tokens.size(); ++i) {
+                sum += std::stod(tokens[i]);
+            }
+        } else if (tokens[0] == "f") {
+            for (size_t i = 1; i != tokens.size(); ++i) {
+                sum += std::stoi(tokens[i]);
+            }
+        }
+    }
+    return sum;
+}
+
+double SumShared(const std::string& path) {
+    MappedFile file(path);
+    std::string_view text = file.GetText();
+    std::vector<std::string_view> tokens;
+    double sum = 0;
+    for (std::string_view line; NextLine(text, line);) {
+        SplitTokens(line, tokens);
+        if (tokens.empty()) {
+            continue;
+        }
+        if (tokens[0] == "v" || tokens[0] == "vn") {
+            for (size_t i = 1; i != tokens.size(); ++i) {
+                sum += ParseNumber<double>(tokens[i]);
+            }
+        } else if (tokens[0] == "f") {
+            for (size_t i = 1; i != tokens.size(); ++i) {
+                sum += GetTokenInfo(tokens[i])[0];
+            }
+        }
+    }
+    return sum;
+}
+
+void Run(const std::string& path) {
+    double megabytes = std::filesystem::file_size(path) / 1e6;
+    std::printf("%s: %.1f MB\n", path.c_str(), megabytes);
+
+    const int repeats = 3;
+    double legacy_time = 0;
+    double shared_time = 0;
+    double scene_time = 0;
+    double legacy_sum = 0;
+    double shared_sum = 0;
+    size_t triangles = 0;
+    for (int r = 0; r != repeats; ++r) {
+        auto start = Clock::now();
+        legacy_sum = SumLegacy(path);
+        double time = Seconds(start);
+        legacy_time = r == 0 ? time : std::min(legacy_time, time);
+
+        start = Clock::now();
+        shared_sum = SumShared(path);
+        time = Seconds(start);
+        shared_time = r == 0 ? time : std::min(shared_time, time);
+
+        start = Clock::now();
+        triangles = ReadScene(path).GetTriangles().GetSize();
+        time = Seconds(start);
+        scene_time = r == 0 ? time : std::min(scene_time, time);
+    }
+    std::printf("  tokens and numbers: legacy %.3f s (%.0f MB/s), shared %.3f s (%.0f MB/s), "
+                "%.1fx, sums %s\n",
+                legacy_time, megabytes / legacy_time, shared_time, megabytes / shared_time,
+                legacy_time / shared_time, legacy_sum == shared_sum ? "agree" : "DIFFER");
+    std::printf("  ReadScene: %.3f s (%.0f MB/s), %zu triangles\n", scene_time,
+                megabytes / scene_time, triangles);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        paths.emplace_back(argv[i]);
+    }
+    if (paths.empty()) {
+        paths = {WriteGrid(std::filesystem::temp_directory_path() / "bench-reader", 1001),
+                 std::string(RAYTRACER_SOURCE_DIR) + "/raytracer/tests/deer/CERF_Free.obj"};
+    }
+    for (const auto& path : paths) {
+        Run(path);
+    }
+}
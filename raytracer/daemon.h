@@ -0,0 +1,348 @@
+#pragma once
+
+#include "raytracer.h"
+#include "distributed.h"
+#include "../raytracer-reader/config_reader.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Scenes kept loaded between renders, keyed by the OBJ file, the BVH width and the geometry
+// budget, with the least recently used ones dropped to stay within a number of bytes as
+// LoadedScene::GetSize counts them.
+// A scene is loaded again when the modification time of any of its files changes.
+class SceneCache {
+public:
+    explicit SceneCache(size_t capacity) : capacity_(capacity) {
+    }
+
+    // The scene stays valid until the next call. It is never dropped by the call that returns it,
+    // even when it alone is larger than the capacity.
+    LoadedScene& Get(const std::string& filename, const RenderOptions& render_options,
+                     bool* was_loaded = nullptr) {
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->filename != filename || it->bvh_width != render_options.bvh_width ||
+                it->geometry_budget_mb != render_options.geometry_budget_mb) {
+                continue;
+            }
+            if (IsFresh(*it)) {
+                entries_.splice(entries_.begin(), entries_, it);
+                if (was_loaded) {
+                    *was_loaded = false;
+                }
+                return *entries_.front().scene;
+            }
+            size_ -= it->size;
+            entries_.erase(it);
+            break;
+        }
+
+        Entry entry{filename, render_options.bvh_width, render_options.geometry_budget_mb, {},
+                    nullptr, 0};
+        entry.scene = std::make_unique<LoadedScene>(filename, render_options);
+        for (const auto& path : entry.scene->GetScene().GetSources()) {
+            entry.sources.emplace_back(path, GetTime(path));
+        }
+        entry.size = entry.scene->GetSize();
+        size_ += entry.size;
+        entries_.push_front(std::move(entry));
+        while (size_ > capacity_ && entries_.size() > 1) {
+            size_ -= entries_.back().size;
+            entries_.pop_back();
+        }
+        if (was_loaded) {
+            *was_loaded = true;
+        }
+        return *entries_.front().scene;
+    }
+
+    size_t GetCount() const {
+        return entries_.size();
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    using Time = std::filesystem::file_time_type;
+
+    struct Entry {
+        std::string filename;
+        int bvh_width;
+        int geometry_budget_mb;
+        std::vector<std::pair<std::string, Time>> sources;
+        std::unique_ptr<LoadedScene> scene;
+        size_t size;
+    };
+
+    // Files that can't be read get the minimum time.
+    static Time GetTime(const std::string& path) {
+        std::error_code error;
+        Time time = std::filesystem::last_write_time(path, error);
+        return error ? Time::min() : time;
+    }
+
+    static bool IsFresh(const Entry& entry) {
+        return std::all_of(entry.sources.begin(), entry.sources.end(), [](const auto& source) {
+            return GetTime(source.first) == source.second;
+        });
+    }
+
+    size_t capacity_;
+    size_t size_ = 0;
+    // Most recently used first.
+    std::list<Entry> entries_;
+};
+
+// A render daemon takes jobs on a Unix socket, one connection per job: the absolute path of the
+// OBJ file, the text of a config and the output path, each as a uint64_t length followed by the
+// bytes. With an empty output path, the image is sent back as PNG bytes instead of being written.
+// The answer is a status byte, 0 on success, and a string in the same form: the bytes of an image
+// sent back, or the error message.
+namespace render_daemon {
+
+struct Job {
+    std::string obj;
+    std::string config;
+    std::string output;
+};
+
+inline constexpr uint64_t kMaxJobString = uint64_t(1) << 26;
+
+// A client that sends nothing for this long, or hasn't read the whole answer this long after it
+// is ready, is dropped, so it can't hold up the others.
+inline constexpr int kJobTimeoutSeconds = 10;
+
+inline bool WriteString(int fd, const std::string& value) {
+    uint64_t size = value.size();
+    return distributed::WriteAll(fd, &size, sizeof(size)) &&
+           distributed::WriteAll(fd, value.data(), value.size());
+}
+
+// Like distributed::WriteAll, but fails once the deadline passes.
+inline bool WriteAllBefore(int fd, const void* data, size_t size,
+                           std::chrono::steady_clock::time_point deadline) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size != 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now())
+                        .count();
+        pollfd client{fd, POLLOUT, 0};
+        int ready = left > 0 ? poll(&client, 1, left) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+        ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Sends the answer to a job within kJobTimeoutSeconds.
+inline bool WriteAnswer(int fd, uint8_t status, const std::string& reply) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(kJobTimeoutSeconds);
+    uint64_t size = reply.size();
+    return WriteAllBefore(fd, &status, sizeof(status), deadline) &&
+           WriteAllBefore(fd, &size, sizeof(size), deadline) &&
+           WriteAllBefore(fd, reply.data(), reply.size(), deadline);
+}
+
+inline bool ReadString(int fd, std::string& value, uint64_t max_size) {
+    uint64_t size;
+    if (!distributed::ReadAll(fd, &size, sizeof(size)) || size > max_size) {
+        return false;
+    }
+    value.resize(size);
+    return distributed::ReadAll(fd, value.data(), size);
+}
+
+class Socket {
+public:
+    Socket() : fd_(socket(AF_UNIX, SOCK_STREAM, 0)) {
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("Can't create socket: ") + std::strerror(errno));
+        }
+    }
+
+    explicit Socket(int fd) : fd_(fd) {
+    }
+
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    ~Socket() {
+        close(fd_);
+    }
+
+    int Get() const {
+        return fd_;
+    }
+
+    bool Connect(const std::string& path) {
+        sockaddr_un address = GetAddress(path);
+        return connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    }
+
+    bool Listen(const std::string& path) {
+        sockaddr_un address = GetAddress(path);
+        return bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0 &&
+               listen(fd_, SOMAXCONN) == 0;
+    }
+
+private:
+    static sockaddr_un GetAddress(const std::string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long: " + path);
+        }
+        std::copy(path.begin(), path.end(), address.sun_path);
+        return address;
+    }
+
+    int fd_;
+};
+
+// Renders the job and returns the image bytes when they are sent back.
+inline std::string RunJob(SceneCache& scenes, const Job& job, bool* was_loaded) {
+    if (!std::filesystem::is_regular_file(job.obj)) {
+        throw std::runtime_error("Can't open obj file " + job.obj);
+    }
+    auto [render_options, camera_options] = ParseConfig(job.config);
+    LoadedScene& loaded = scenes.Get(job.obj, render_options, was_loaded);
+    if (!job.output.empty()) {
+        RenderToFile(loaded.GetScene(), loaded.GetAccelerator(), camera_options, render_options,
+                     job.output);
+        return {};
+    }
+    // Only the image is sent back.
+    render_options.output.sample_map = false;
+    const std::string temporary = (std::filesystem::temp_directory_path() /
+                                   ("raytracer-daemon-" + std::to_string(getpid()) + ".png"))
+                                      .string();
+    std::string image;
+    try {
+        RenderToFile(loaded.GetScene(), loaded.GetAccelerator(), camera_options, render_options,
+                     temporary);
+        image = MappedFile(temporary).GetText();
+    } catch (...) {
+        std::filesystem::remove(temporary);
+        throw;
+    }
+    std::filesystem::remove(temporary);
+    return image;
+}
+
+}  // namespace render_daemon
+
+// Serves render jobs on the socket until the process is stopped, one at a time in the order
+// clients connect, each with all render threads unless its config sets `render threads`. Scenes
+// stay in a SceneCache of `cache_capacity` bytes; jobs on a loaded scene skip parsing and BVH
+// building altogether. Frames and workers of the configs are ignored. A line per job goes to
+// stdout.
+[[noreturn]] inline void ServeRenders(const std::string& socket_path, size_t cache_capacity) {
+    using namespace render_daemon;
+    if (Socket().Connect(socket_path)) {
+        throw std::runtime_error("A daemon already listens on " + socket_path);
+    }
+    // Left behind by a daemon that was stopped.
+    unlink(socket_path.c_str());
+    Socket listener;
+    if (!listener.Listen(socket_path)) {
+        throw std::runtime_error("Can't listen on " + socket_path + ": " + std::strerror(errno));
+    }
+
+    SceneCache scenes(cache_capacity);
+    while (true) {
+        int fd = accept(listener.Get(), nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Can't accept jobs: ") + std::strerror(errno));
+        }
+        Socket client(fd);
+        timeval timeout{kJobTimeoutSeconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        Job job;
+        if (!ReadString(fd, job.obj, kMaxJobString) || !ReadString(fd, job.config, kMaxJobString) ||
+            !ReadString(fd, job.output, kMaxJobString)) {
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint8_t status = 0;
+        std::string reply;
+        bool was_loaded = false;
+        try {
+            reply = RunJob(scenes, job, &was_loaded);
+        } catch (const std::exception& e) {
+            status = 1;
+            reply = e.what();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                              start)
+                        .count();
+        std::cout << job.obj << " -> " << (job.output.empty() ? "reply" : job.output) << ": ";
+        if (status) {
+            std::cout << reply;
+        } else {
+            std::cout << std::fixed << std::setprecision(1) << ms << " ms";
+        }
+        std::cout << (was_loaded ? ", scene loaded" : "") << ", " << scenes.GetCount()
+                  << " scenes of " << scenes.GetSize() / (1 << 20) << " MB" << std::endl;
+        WriteAnswer(fd, status, reply);
+    }
+}
+
+// Sends a job to the daemon listening on the socket and waits for it. Returns the image bytes
+// when the job has no output path; throws with the message of the daemon when the job fails.
+inline std::string SubmitRender(const std::string& socket_path, const render_daemon::Job& job) {
+    using namespace render_daemon;
+    Socket daemon;
+    if (!daemon.Connect(socket_path)) {
+        throw std::runtime_error("No render daemon on " + socket_path + ": " +
+                                 std::strerror(errno));
+    }
+    uint8_t status;
+    std::string reply;
+    if (!WriteString(daemon.Get(), job.obj) || !WriteString(daemon.Get(), job.config) ||
+        !WriteString(daemon.Get(), job.output) ||
+        !distributed::ReadAll(daemon.Get(), &status, sizeof(status)) ||
+        !ReadString(daemon.Get(), reply, UINT64_MAX)) {
+        throw std::runtime_error("Render daemon on " + socket_path + " dropped the job");
+    }
+    if (status != 0) {
+        throw std::runtime_error(reply);
+    }
+    return reply;
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Rendering split across local worker processes. The coordinator forks the workers, each
+// connected to it by a Unix socket pair, and hands them ranges of tiles [begin, end) as two
+// uint32_t. A worker answers with the same two numbers followed by a RenderedPixel for every
+// pixel of those tiles, tile by tile and row by row. Workers load the scene themselves and exit
+// when the coordinator closes their socket. Tiles of a worker that dies are given to the others.
+namespace distributed {
+
+inline bool WriteAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size != 0) {
+        ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+inline bool ReadAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size != 0) {
+        ssize_t got = read(fd, bytes, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Frame value of a pixel and the camera rays it took.
+struct RenderedPixel {
+    Vector value;
+    uint32_t samples;
+};
+
+inline size_t GetPixelCount(int width, int height, uint32_t begin, uint32_t end) {
+    size_t count = 0;
+    for (uint32_t index = begin; index != end; ++index) {
+        Tile tile = GetTile(width, height, index);
+        count += static_cast<size_t>(tile.end_i - tile.begin_i) * (tile.end_j - tile.begin_j);
+    }
+    return count;
+}
+
+[[noreturn]] inline void RunWorker(int fd, const std::string& filename,
+                                   const CameraOptions& camera_options,
+                                   const RenderOptions& render_options) {
+    try {
+        LoadedScene loaded(filename, render_options);
+        const Scene& scene = loaded.GetScene();
+        const Accelerator& accelerator = loaded.GetAccelerator();
+        RayTransformer rt(camera_options);
+        const int width = camera_options.screen_width;
+        const int height = camera_options.screen_height;
+        const int threads = GetThreadCount(render_options);
+        for (std::array<uint32_t, 2> range; ReadAll(fd, range.data(), sizeof(range));) {
+            std::vector<RenderedPixel> values;
+            std::vector<size_t> offsets;
+            for (uint32_t index = range[0]; index != range[1]; ++index) {
+                offsets.push_back(values.size());
+                Tile tile = GetTile(width, height, index);
+                values.resize(values.size() + static_cast<size_t>(tile.end_i - tile.begin_i) *
+                                                  (tile.end_j - tile.begin_j));
+            }
+            ParallelFor(range[1] - range[0], threads, [&](size_t k) {
+                Tile tile = GetTile(width, height, range[0] + k);
+                RenderedPixel* out = values.data() + offsets[k];
+                RenderTile(scene, accelerator, rt, render_options, tile, 1, true,
+                           [&](int i, int j, const Vector& value, int samples) {
+                               size_t row = i - tile.begin_i;
+                               out[row * (tile.end_j - tile.begin_j) + (j - tile.begin_j)] = {
+                                   value, static_cast<uint32_t>(samples)};
+                           });
+            });
+            if (!WriteAll(fd, range.data(), sizeof(range)) ||
+                !WriteAll(fd, values.data(), values.size() * sizeof(RenderedPixel))) {
+                break;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "render worker: " << e.what() << "\n";
+        _exit(1);
+    }
+    _exit(0);
+}
+
+}  // namespace distributed
+
+// Renders the scene in `workers` forked processes into a frame here, so the result is the one
+// RenderFrame gives. The frame is rendered in a single pass; deadlines and snapshots only apply
+// to RenderFrame.
+inline Frame RenderDistributedFrame(const std::string& filename,
+                                    const CameraOptions& camera_options,
+                                    const RenderOptions& render_options, int workers) {
+    using namespace distributed;
+    const int width = camera_options.screen_width;
+    const int height = camera_options.screen_height;
+    const uint32_t tiles = GetTileCount(width, height);
+
+    struct Worker {
+        pid_t pid;
+        int fd;
+        // Range being rendered, begin == end when idle.
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        std::vector<char> reply;
+        size_t received = 0;
+
+        void Stop() {
+            close(fd);
+            fd = -1;
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    };
+    std::vector<Worker> pool;
+    // Workers still running are stopped however this returns, also when it throws with ranges
+    // in flight or before every worker has started.
+    struct StopWorkers {
+        std::vector<Worker>& pool;
+
+        ~StopWorkers() {
+            for (auto& worker : pool) {
+                if (worker.fd >= 0) {
+                    worker.Stop();
+                }
+            }
+        }
+    } stop_workers{pool};
+    pool.reserve(workers);
+    for (int w = 0; w != workers; ++w) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            throw std::runtime_error("Can't create a socket for a render worker");
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            throw std::runtime_error("Can't start a render worker");
+        }
+        if (pid == 0) {
+            // Only this worker may hold its socket, or the coordinator would not notice when
+            // another worker dies.
+            for (const auto& other : pool) {
+                close(other.fd);
+            }
+            close(fds[0]);
+            RunWorker(fds[1], filename, camera_options, render_options);
+        }
+        close(fds[1]);
+        pool.push_back({pid, fds[0]});
+    }
+
+    // Ranges are small enough to keep every worker busy until the end.
+    const uint32_t range_size = std::max<uint32_t>(1, tiles / (workers * 8));
+    std::deque<std::pair<uint32_t, uint32_t>> pending;
+    for (uint32_t begin = 0; begin < tiles; begin += range_size) {
+        pending.emplace_back(begin, std::min(tiles, begin + range_size));
+    }
+
+    Frame frame(render_options.mode, width, height);
+    auto store = [&](const Worker& worker) {
+        const char* data = worker.reply.data() + 2 * sizeof(uint32_t);
+        for (uint32_t index = worker.begin; index != worker.end; ++index) {
+            Tile tile = GetTile(width, height, index);
+            for (int i = tile.begin_i; i != tile.end_i; ++i) {
+                for (int j = tile.begin_j; j != tile.end_j; ++j) {
+                    RenderedPixel pixel;
+                    std::memcpy(&pixel, data, sizeof(RenderedPixel));
+                    frame.Set(i, j, pixel.value, pixel.samples);
+                    data += sizeof(RenderedPixel);
+                }
+            }
+        }
+    };
+    auto retire = [&](Worker& worker) {
+        if (worker.begin != worker.end) {
+            pending.emplace_front(worker.begin, worker.end);
+        }
+        worker.Stop();
+    };
+
+    size_t rendered = 0;
+    while (rendered != tiles) {
+        std::vector<pollfd> fds;
+        std::vector<Worker*> polled;
+        for (auto& worker : pool) {
+            if (worker.fd < 0) {
+                continue;
+            }
+            if (worker.begin == worker.end && !pending.empty()) {
+                std::tie(worker.begin, worker.end) = pending.front();
+                pending.pop_front();
+                uint32_t range[2] = {worker.begin, worker.end};
+                size_t pixels = GetPixelCount(width, height, worker.begin, worker.end);
+                worker.reply.resize(sizeof(range) + sizeof(RenderedPixel) * pixels);
+                worker.received = 0;
+                if (!WriteAll(worker.fd, range, sizeof(range))) {
+                    retire(worker);
+                    continue;
+                }
+            }
+            if (worker.begin != worker.end) {
+                fds.push_back({worker.fd, POLLIN, 0});
+                polled.push_back(&worker);
+            }
+        }
+        if (fds.empty()) {
+            throw std::runtime_error("All render workers died");
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Can't wait for render workers");
+        }
+        for (size_t k = 0; k != fds.size(); ++k) {
+            if (fds[k].revents == 0) {
+                continue;
+            }
+            Worker& worker = *polled[k];
+            ssize_t got = read(worker.fd, worker.reply.data() + worker.received,
+                               worker.reply.size() - worker.received);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                retire(worker);
+                continue;
+            }
+            worker.received += got;
+            if (worker.received == worker.reply.size()) {
+                uint32_t range[2] = {worker.begin, worker.end};
+                if (std::memcmp(worker.reply.data(), range, sizeof(range)) != 0) {
+                    retire(worker);
+                    continue;
+                }
+                store(worker);
+                rendered += worker.end - worker.begin;
+                worker.begin = worker.end = 0;
+            }
+        }
+    }
+    return frame;
+}
+
+inline Image RenderDistributed(const std::string& filename, const CameraOptions& camera_options,
+                               const RenderOptions& render_options, int workers) {
+    return MakeImage(RenderDistributedFrame(filename, camera_options, render_options, workers),
+                     GetThreadCount(render_options), render_options.white_point);
+}
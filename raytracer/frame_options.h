@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../raytracer-geom/transform.h"
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Changes applied before rendering one frame of a sequence. Anything not set keeps its value
+// from the previous frame.
+struct FrameOptions {
+    std::optional<double> fov;
+    std::optional<std::array<double, 3>> look_from;
+    std::optional<std::array<double, 3>> look_to;
+    // New to-world transforms of instances, by instance index in declaration order.
+    std::vector<std::pair<size_t, Transform>> transforms;
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "../raytracer-geom/vector.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Pixels as 32-bit floats in one allocation aligned to a cache line: the channels of a pixel
+// follow each other, pixels follow each other within a row and rows go top to bottom. Channels
+// have names, as in OpenEXR. Values are rounded to float when they are set, so a value that tone
+// mapping puts right at the edge of an 8-bit level may land one level lower or higher than it
+// would from the Scalar.
+class Framebuffer {
+public:
+    static constexpr size_t kAlignment = 64;
+
+    Framebuffer(int width, int height, std::vector<std::string> channels)
+        : width_(width), height_(height), channels_(std::move(channels)) {
+        if (channels_.empty() || channels_.size() > 3) {
+            throw std::runtime_error("Framebuffers have one to three channels");
+        }
+        size_t bytes = GetSize() * sizeof(float);
+        bytes = (bytes + kAlignment - 1) / kAlignment * kAlignment;
+        bytes = std::max(bytes, kAlignment);
+        data_.reset(static_cast<float*>(std::aligned_alloc(kAlignment, bytes)));
+        if (!data_) {
+            throw std::bad_alloc();
+        }
+        std::fill(data_.get(), data_.get() + GetSize(), 0.0f);
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    const std::vector<std::string>& GetChannels() const {
+        return channels_;
+    }
+
+    // Number of floats.
+    size_t GetSize() const {
+        return static_cast<size_t>(width_) * height_ * channels_.size();
+    }
+
+    float* GetPixel(int i, int j) {
+        return data_.get() + (static_cast<size_t>(i) * width_ + j) * channels_.size();
+    }
+
+    const float* GetPixel(int i, int j) const {
+        return data_.get() + (static_cast<size_t>(i) * width_ + j) * channels_.size();
+    }
+
+    // The first channels of the pixel; missing ones are zero.
+    void Set(int i, int j, const Vector& value) {
+        float* pixel = GetPixel(i, j);
+        for (size_t c = 0; c != channels_.size(); ++c) {
+            pixel[c] = value[c];
+        }
+    }
+
+    Vector Get(int i, int j) const {
+        const float* pixel = GetPixel(i, j);
+        Vector value;
+        for (size_t c = 0; c != channels_.size(); ++c) {
+            value[c] = pixel[c];
+        }
+        return value;
+    }
+
+    // Portable float map of one (Pf) or three (PF) channels: little-endian floats, rows bottom
+    // to top.
+    void WritePfm(const std::string& filename) const {
+        if (channels_.size() == 2) {
+            throw std::runtime_error("PFM files have one or three channels");
+        }
+        std::ofstream out(filename, std::ios::binary);
+        out << (channels_.size() == 1 ? "Pf" : "PF") << "\n"
+            << width_ << " " << height_ << "\n-1.0\n";
+        const size_t row = static_cast<size_t>(width_) * channels_.size();
+        for (int i = height_ - 1; i >= 0; --i) {
+            WriteFloats(out, GetPixel(i, 0), row);
+        }
+        if (!out) {
+            throw std::runtime_error("Can't write file " + filename);
+        }
+    }
+
+    // Single-part scanline OpenEXR file without compression, one FLOAT line per block and the
+    // channels in the alphabetical order the format requires.
+    void WriteExr(const std::string& filename) const {
+        std::vector<size_t> order(channels_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(),
+                  [this](size_t a, size_t b) { return channels_[a] < channels_[b]; });
+
+        std::string header = {'\x76', '\x2f', '\x31', '\x01', 2, 0, 0, 0};
+        auto attribute = [&header](const std::string& name, const std::string& type,
+                                   const std::string& value) {
+            header += name + '\0' + type + '\0';
+            AppendInt32(header, value.size());
+            header += value;
+        };
+        std::string channels;
+        for (size_t c : order) {
+            channels += channels_[c] + '\0';
+            AppendInt32(channels, 2);  // FLOAT
+            channels += std::string(4, '\0');  // pLinear and reserved
+            AppendInt32(channels, 1);
+            AppendInt32(channels, 1);
+        }
+        channels += '\0';
+        std::string window;
+        for (int32_t value : {0, 0, width_ - 1, height_ - 1}) {
+            AppendInt32(window, value);
+        }
+        std::string one;
+        AppendFloat(one, 1);
+        attribute("channels", "chlist", channels);
+        attribute("compression", "compression", std::string(1, '\0'));
+        attribute("dataWindow", "box2i", window);
+        attribute("displayWindow", "box2i", window);
+        attribute("lineOrder", "lineOrder", std::string(1, '\0'));
+        attribute("pixelAspectRatio", "float", one);
+        attribute("screenWindowCenter", "v2f", std::string(8, '\0'));
+        attribute("screenWindowWidth", "float", one);
+        header += '\0';
+
+        const size_t line = static_cast<size_t>(width_) * channels_.size() * sizeof(float);
+        const uint64_t first = header.size() + sizeof(uint64_t) * height_;
+        for (int i = 0; i != height_; ++i) {
+            AppendInt64(header, first + i * (2 * sizeof(int32_t) + line));
+        }
+        std::ofstream out(filename, std::ios::binary);
+        out.write(header.data(), header.size());
+        std::vector<float> values(static_cast<size_t>(width_) * channels_.size());
+        for (int i = 0; i != height_; ++i) {
+            std::string prefix;
+            AppendInt32(prefix, i);
+            AppendInt32(prefix, line);
+            out.write(prefix.data(), prefix.size());
+            size_t k = 0;
+            for (size_t c : order) {
+                for (int j = 0; j != width_; ++j) {
+                    values[k++] = GetPixel(i, j)[c];
+                }
+            }
+            WriteFloats(out, values.data(), values.size());
+        }
+        if (!out) {
+            throw std::runtime_error("Can't write file " + filename);
+        }
+    }
+
+private:
+    struct Free {
+        void operator()(float* data) const {
+            std::free(data);
+        }
+    };
+
+    static_assert(std::endian::native == std::endian::little,
+                  "PFM and EXR files are written in little-endian byte order");
+
+    static void WriteFloats(std::ofstream& out, const float* data, size_t count) {
+        out.write(reinterpret_cast<const char*>(data), count * sizeof(float));
+    }
+
+    static void AppendInt32(std::string& out, int32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void AppendInt64(std::string& out, uint64_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void AppendFloat(std::string& out, float value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    int width_;
+    int height_;
+    std::vector<std::string> channels_;
+    std::unique_ptr<float[], Free> data_;
+};
@@ -1,8 +1,21 @@
 #pragma once
 
+#include "output_options.h"
+#include "thread_pool.h"
+
 #include <png.h>
 #include <jpeglib.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 struct RGB {
     int r, g, b;
@@ -11,6 +24,223 @@ struct RGB {
     }
 };
 
+// Writes an 8-bit RGBA PNG file a band of rows at a time, top to bottom, so the rows need not be
+// in memory all at once. A band is split into pieces that are filtered and deflated on separate
+// threads; every piece ends on a full flush, so the pieces join into one zlib stream. The file is
+// complete after Finish.
+class PngWriter {
+public:
+    PngWriter(const std::string& filename, int width, int height,
+              const OutputOptions& options = {}, int threads = 1)
+        : out_(filename, std::ios::binary),
+          filename_(filename),
+          row_size_(static_cast<size_t>(width) * 4),
+          options_(options),
+          threads_(threads),
+          previous_(row_size_) {
+        if (!out_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        if (options.png_level < 0 || options.png_level > 9) {
+            throw std::runtime_error("PNG compression levels go from 0 to 9");
+        }
+        out_.write("\x89PNG\r\n\x1a\n", 8);
+        std::string header;
+        AppendUint32(header, width);
+        AppendUint32(header, height);
+        // 8 bits per sample, RGBA, deflate, adaptive filtering, no interlacing.
+        header += {8, 6, 0, 0, 0};
+        WriteChunk("IHDR", header);
+
+        // zlib header for a 32K window, with the level hint and check bits.
+        static constexpr unsigned kLevelHints[] = {0, 0, 1, 1, 1, 1, 2, 3, 3, 3};
+        unsigned flags = kLevelHints[options.png_level] << 6;
+        flags += 31 - (0x78 * 256 + flags) % 31;
+        WriteChunk("IDAT", {'\x78', static_cast<char>(flags)});
+    }
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    // The next `count` rows, one after the other.
+    void WriteRows(const png_byte* rows, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        const size_t pieces = std::clamp<size_t>(threads_, 1, count);
+        const size_t piece_rows = (count + pieces - 1) / pieces;
+        std::vector<std::string> deflated(pieces);
+        std::vector<uLong> checksums(pieces);
+        ParallelFor(pieces, threads_, [&](size_t k) {
+            size_t begin = k * piece_rows;
+            size_t end = std::min(count, begin + piece_rows);
+            std::vector<png_byte> filtered((end - begin) * (row_size_ + 1));
+            std::vector<png_byte> scratch;
+            for (size_t i = begin; i < end; ++i) {
+                const png_byte* row = rows + i * row_size_;
+                const png_byte* above = i == 0 ? previous_.data() : row - row_size_;
+                Filter(row, above, filtered.data() + (i - begin) * (row_size_ + 1), scratch);
+            }
+            checksums[k] = adler32(1, filtered.data(), filtered.size());
+            deflated[k] = Deflate(filtered, Z_FULL_FLUSH);
+        });
+        for (size_t k = 0; k != pieces; ++k) {
+            size_t size = (std::min(count, (k + 1) * piece_rows) - k * piece_rows) *
+                          (row_size_ + 1);
+            checksum_ = adler32_combine(checksum_, checksums[k], size);
+            WriteChunk("IDAT", deflated[k]);
+        }
+        std::copy(rows + (count - 1) * row_size_, rows + count * row_size_, previous_.begin());
+    }
+
+    void Finish() {
+        std::string end = Deflate({}, Z_FINISH);
+        AppendUint32(end, checksum_);
+        WriteChunk("IDAT", end);
+        WriteChunk("IEND", "");
+        out_.close();
+        if (!out_) {
+            throw std::runtime_error("Can't write file " + filename_);
+        }
+    }
+
+private:
+    static void AppendUint32(std::string& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out += static_cast<char>(value >> shift);
+        }
+    }
+
+    void WriteChunk(const std::string& type, const std::string& data) {
+        std::string prefix;
+        AppendUint32(prefix, data.size());
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type.data()), type.size());
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(data.data()), data.size());
+        std::string suffix;
+        AppendUint32(suffix, crc);
+        out_ << prefix << type << data << suffix;
+    }
+
+    // Filter type byte followed by the filtered row. `above` is the previous row, zeros for the
+    // first one. `scratch` holds the candidates of the adaptive filter.
+    void Filter(const png_byte* row, const png_byte* above, png_byte* out,
+                std::vector<png_byte>& scratch) const {
+        if (options_.png_filter != PngFilter::kAdaptive) {
+            Apply(options_.png_filter, row, above, out, std::numeric_limits<uint64_t>::max());
+            return;
+        }
+        const size_t size = row_size_ + 1;
+        scratch.resize(5 * size);
+        uint64_t best = std::numeric_limits<uint64_t>::max();
+        const png_byte* chosen = nullptr;
+        for (int type = 0; type != 5; ++type) {
+            png_byte* candidate = scratch.data() + type * size;
+            uint64_t sum = Apply(static_cast<PngFilter>(type), row, above, candidate, best);
+            if (sum < best) {
+                best = sum;
+                chosen = candidate;
+            }
+        }
+        std::copy(chosen, chosen + size, out);
+    }
+
+    uint64_t Apply(PngFilter filter, const png_byte* row, const png_byte* above, png_byte* out,
+                   uint64_t limit) const {
+        switch (filter) {
+            case PngFilter::kNone:
+                return Apply<PngFilter::kNone>(row, above, out, limit);
+            case PngFilter::kSub:
+                return Apply<PngFilter::kSub>(row, above, out, limit);
+            case PngFilter::kUp:
+                return Apply<PngFilter::kUp>(row, above, out, limit);
+            case PngFilter::kAverage:
+                return Apply<PngFilter::kAverage>(row, above, out, limit);
+            default:
+                return Apply<PngFilter::kPaeth>(row, above, out, limit);
+        }
+    }
+
+    // Filters the row into `out` and returns the sum of the absolute values of the filtered
+    // bytes as signed numbers. Gives up once the sum reaches `limit`, returning at least
+    // `limit`.
+    template <PngFilter kFilter>
+    uint64_t Apply(const png_byte* row, const png_byte* above, png_byte* out,
+                   uint64_t limit) const {
+        out[0] = static_cast<png_byte>(kFilter);
+        ++out;
+        auto predict = [](int a, int b, int c) {
+            if constexpr (kFilter == PngFilter::kNone) {
+                return 0;
+            } else if constexpr (kFilter == PngFilter::kSub) {
+                return a;
+            } else if constexpr (kFilter == PngFilter::kUp) {
+                return b;
+            } else if constexpr (kFilter == PngFilter::kAverage) {
+                return (a + b) / 2;
+            } else {
+                int pa = std::abs(b - c);
+                int pb = std::abs(a - c);
+                int pc = std::abs(a + b - 2 * c);
+                return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            }
+        };
+        // The pixel to the left of the first one is zero; rows are checked against the limit a
+        // block at a time.
+        const size_t bpp = 4;
+        const size_t block = 256;
+        uint64_t sum = 0;
+        for (size_t x = 0; x < bpp; ++x) {
+            out[x] = row[x] - predict(0, above[x], 0);
+            sum += std::abs(static_cast<int8_t>(out[x]));
+        }
+        for (size_t begin = bpp; begin < row_size_ && sum < limit; begin += block) {
+            const size_t end = std::min(row_size_, begin + block);
+            for (size_t x = begin; x < end; ++x) {
+                out[x] = row[x] - predict(row[x - bpp], above[x], above[x - bpp]);
+                sum += std::abs(static_cast<int8_t>(out[x]));
+            }
+        }
+        return sum;
+    }
+
+    // Raw deflate data, without the zlib header and checksum.
+    std::string Deflate(const std::vector<png_byte>& data, int flush) const {
+        z_stream stream{};
+        if (deflateInit2(&stream, options_.png_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+            Z_OK) {
+            throw std::runtime_error("Can't initialize deflate");
+        }
+        std::string out(deflateBound(&stream, data.size()) + 16, '\0');
+        size_t size = 0;
+        stream.next_in = const_cast<Bytef*>(data.data());
+        stream.avail_in = data.size();
+        int status;
+        do {
+            if (size == out.size()) {
+                out.resize(2 * out.size());
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(out.data() + size);
+            stream.avail_out = out.size() - size;
+            status = deflate(&stream, flush);
+            size = out.size() - stream.avail_out;
+        } while (status != Z_STREAM_ERROR && stream.avail_out == 0);
+        deflateEnd(&stream);
+        if (status == Z_STREAM_ERROR) {
+            throw std::runtime_error("Can't deflate PNG data");
+        }
+        out.resize(size);
+        return out;
+    }
+
+    std::ofstream out_;
+    std::string filename_;
+    size_t row_size_;
+    OutputOptions options_;
+    int threads_;
+    std::vector<png_byte> previous_;
+    uLong checksum_ = adler32(0, nullptr, 0);
+};
+
 class Image {
 public:
     Image(int width, int height) {
@@ -152,42 +382,36 @@ public:
         fclose(infile);
     }
 
-    void Write(const std::string& filename) {
-        FILE* fp = fopen(filename.c_str(), "wb");
-        if (!fp) {
-            throw std::runtime_error("Can't open file " + filename);
-        }
-
-        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-        if (!png) {
-            throw std::runtime_error("Can't create png write struct");
+    // PNG, with the rows encoded on up to `threads` threads.
+    void Write(const std::string& filename, const OutputOptions& options = {},
+               int threads = 1) const {
+        PngWriter writer(filename, width_, height_, options, threads);
+        std::vector<png_byte> rows;
+        for (int begin = 0; begin < height_; begin += kWriteBand) {
+            int end = std::min(height_, begin + kWriteBand);
+            rows.clear();
+            for (int y = begin; y != end; ++y) {
+                rows.insert(rows.end(), bytes_[y], bytes_[y] + width_ * 4);
+            }
+            writer.WriteRows(rows.data(), end - begin);
         }
+        writer.Finish();
+    }
 
-        png_infop info = png_create_info_struct(png);
-        if (!info) {
-            throw std::runtime_error("Can't create png info struct");
+    // Binary PPM without the alpha channel.
+    void WritePpm(const std::string& filename) const {
+        std::ofstream out(filename, std::ios::binary);
+        out << "P6\n" << width_ << " " << height_ << "\n255\n";
+        std::vector<char> row(static_cast<size_t>(width_) * 3);
+        for (int y = 0; y < height_; ++y) {
+            for (int x = 0; x < width_; ++x) {
+                std::copy(bytes_[y] + x * 4, bytes_[y] + x * 4 + 3, row.begin() + x * 3);
+            }
+            out.write(row.data(), row.size());
         }
-
-        if (setjmp(png_jmpbuf(png))) {
-            abort();
+        if (!out) {
+            throw std::runtime_error("Can't write file " + filename);
         }
-
-        png_init_io(png, fp);
-
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-        png_write_info(png, info);
-
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
-
-        png_write_image(png, bytes_);
-        png_write_end(png, nullptr);
-
-        fclose(fp);
-        png_destroy_write_struct(&png, &info);
     }
 
     RGB GetPixel(int y, int x) const {
@@ -220,6 +444,9 @@ public:
     }
 
 private:
+    // Rows copied out for the encoder at a time.
+    static constexpr int kWriteBand = 256;
+
     int width_, height_;
     png_bytep* bytes_;
 };
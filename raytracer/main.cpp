@@ -1,21 +1,47 @@
 #include "raytracer.h"
+#include "sequence.h"
+#include "distributed.h"
+#include "batch.h"
+#include "daemon.h"
 #include "../tools/util/util.h"
 #include "../raytracer-reader/config_reader.h"
 
+#include <charconv>
 #include <iostream>
 #include <filesystem>
+#include <limits>
+#include <string_view>
 
 void QuitIncorrectArguments(char** argv) {
     std::cerr << "Incorrect arguments\n"
                  "Usage: " << argv[0] << " [path/to/obj/file] [path/to/png/file] (optional)[path/to/config]\n"
+                 "       " << argv[0] << " --build-cache [path/to/obj/file] (optional)[path/to/config]\n"
+                 "       " << argv[0] << " --batch [path/to/obj/file] [path/to/manifest]\n"
+                 "       " << argv[0] << " --daemon [path/to/socket] (optional)[cache size in MB]\n"
+                 "       " << argv[0] << " --client [path/to/socket] [path/to/obj/file] [path/to/png/file or -] (optional)[path/to/config]\n"
                  "\n"
-                 "obj file: standart .obj file (supported options are: v, vn, f, P, S, usemtl, mtllib)\n"
+                 "obj file: standart .obj file (supported options are: v, vn, f, P, S, I, usemtl, mtllib)\n"
                  ".mtl supported options are newmtl, Ka, Kd, Ks, Ke, Ns, Ni, al\n"
                  "\n"
                  "png file: path to the future .png image of the scene\n"
+                 "(.ppm files are written as binary PPM; .pfm and .exr files get the unnormalized\n"
+                 "32-bit float values instead)\n"
                  "\n"
                  "config: file containing render options & camera options\n"
+                 "(with 'frame N ...' lines, frames are written to numbered png files)\n"
                  "(default config is provided in example/box/config)\n"
+                 "\n"
+                 "--build-cache: parse the scene and build its acceleration structure for the\n"
+                 "bvh width of the config, and store both in <obj file>.rtcache for later renders;\n"
+                 "with 'render geometry_budget_mb N' in the config, write the out-of-core pages\n"
+                 "of <obj file>.rtpages instead; a fresh and undamaged cache is kept\n"
+                 "\n"
+                 "--batch: load the scene once and render every '<config> <output>' line of the\n"
+                 "manifest, several views at a time when there are CPUs to spare\n"
+                 "\n"
+                 "--daemon: listen on a Unix socket and render the jobs of --client, keeping the\n"
+                 "scenes loaded between jobs (1024 MB of them by default); with '-' as the png\n"
+                 "file, the client writes the image to stdout\n"
                  "\n";
     exit(1);
 }
@@ -24,17 +50,133 @@ int main(int argc, char** argv) {
     if (argc < 3) {
         QuitIncorrectArguments(argv);
     }
+    if (std::string(argv[1]) == "--build-cache") {
+        std::string obj = weakly_canonical(std::filesystem::current_path() / std::string(argv[2]));
+        if (!std::filesystem::is_regular_file(obj)) {
+            std::cerr << "Can't open obj file " << obj << "\n";
+            return 1;
+        }
+        RenderOptions ro{1};
+        if (argc >= 4) {
+            std::string config = weakly_canonical(std::filesystem::current_path() / std::string(argv[3]));
+            ro = ReadConfig(config).first;
+        }
+        if (ro.geometry_budget_mb > 0) {
+            WritePageFile(obj);
+            std::cout << GetPageFilePath(obj) << "\n";
+            return 0;
+        }
+        // Renders trust the cache once its sources are fresh; this is where all of it is checked.
+        if (!IsSceneCacheIntact(obj, ro.bvh_width)) {
+            Scene scene = ReadScene(obj);
+            WriteSceneCache(obj, scene, Accelerator(scene, ro.bvh_width));
+        }
+        std::cout << GetSceneCachePath(obj) << "\n";
+        return 0;
+    }
+    if (std::string(argv[1]) == "--batch") {
+        if (argc < 4) {
+            QuitIncorrectArguments(argv);
+        }
+        std::string obj = weakly_canonical(std::filesystem::current_path() / std::string(argv[2]));
+        std::string manifest = weakly_canonical(std::filesystem::current_path() / std::string(argv[3]));
+        try {
+            return RenderBatch(obj, ReadManifest(manifest)) == 0 ? 0 : 1;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    if (std::string(argv[1]) == "--daemon") {
+        try {
+            size_t megabytes = 1024;
+            if (argc >= 4) {
+                std::string_view size = argv[3];
+                auto [end, error] =
+                    std::from_chars(size.data(), size.data() + size.size(), megabytes);
+                if (error != std::errc() || end != size.data() + size.size() ||
+                    megabytes > (std::numeric_limits<size_t>::max() >> 20)) {
+                    throw std::runtime_error("Invalid cache size in MB: " + std::string(size));
+                }
+            }
+            ServeRenders(argv[2], megabytes << 20);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (std::string(argv[1]) == "--client") {
+        if (argc < 5) {
+            QuitIncorrectArguments(argv);
+        }
+        render_daemon::Job job;
+        job.obj = weakly_canonical(std::filesystem::current_path() / std::string(argv[3]));
+        if (std::string(argv[4]) != "-") {
+            job.output = weakly_canonical(std::filesystem::current_path() / std::string(argv[4]));
+        }
+        if (argc >= 6) {
+            std::string config = weakly_canonical(std::filesystem::current_path() / std::string(argv[5]));
+            if (!std::filesystem::is_regular_file(config)) {
+                std::cerr << "Can't open config " << config << "\n";
+                return 1;
+            }
+            job.config = MappedFile(config).GetText();
+        }
+        try {
+            std::string image = SubmitRender(argv[2], job);
+            std::cout.write(image.data(), image.size());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
 
     std::string obj = weakly_canonical(std::filesystem::current_path() / std::string(argv[1]));
+    if (!std::filesystem::is_regular_file(obj)) {
+        std::cerr << "Can't open obj file " << obj << "\n";
+        return 1;
+    }
     std::string img_path = weakly_canonical(std::filesystem::current_path() / std::string(argv[2]));
     CameraOptions co(640, 480);
     RenderOptions ro{1};
+    std::vector<FrameOptions> frames;
     if (argc >= 4) {
         std::string config = weakly_canonical(std::filesystem::current_path() / std::string(argv[3]));
-        auto [ro_, co_] = ReadConfig(config);
+        auto [ro_, co_] = ReadConfig(config, &frames);
         ro = ro_;
         co = co_;
     }
-    auto img = Render(obj, co, ro);
-    img.Write(img_path);
+    if (!frames.empty()) {
+        RenderSequence(obj, img_path, co, ro, frames);
+        return 0;
+    }
+    if (ro.workers > 0) {
+        WriteFrame(RenderDistributedFrame(obj, co, ro, ro.workers), ro, img_path);
+        return 0;
+    }
+    LoadedScene loaded(obj, ro);
+    if (CanStream(ro) && GetImageFormat(img_path) == ImageFormat::kPng) {
+        RenderToPng(loaded.GetScene(), loaded.GetAccelerator(), co, ro, img_path);
+    } else {
+        // Snapshots replace the output file as a whole, so readers never see a partial one. The
+        // temporary file keeps the extension, which selects the format.
+        // The sample map is only written with the final image.
+        std::string tmp_path = img_path + ".tmp" + std::filesystem::path(img_path).extension().string();
+        RenderOptions snapshot_options = ro;
+        snapshot_options.output.sample_map = false;
+        auto frame = RenderFrame(loaded.GetScene(), loaded.GetAccelerator(), co, ro, [&](const Frame& snapshot) {
+            WriteFrame(snapshot, snapshot_options, tmp_path);
+            std::filesystem::rename(tmp_path, img_path);
+        });
+        WriteFrame(frame, ro, img_path);
+    }
+    if (const PagedGeometry* paged = loaded.GetScene().GetPagedGeometry()) {
+        auto stats = paged->GetStats();
+        std::cerr << paged->GetTriangleCount() << " triangles in " << paged->GetPageCount()
+                  << " pages: " << stats.page_ins << " page-ins, " << stats.evictions
+                  << " evictions, " << (stats.peak_resident_bytes >> 20) << " MB peak of "
+                  << (paged->GetBudget() >> 20) << " MB budget\n";
+    }
 }
\ No newline at end of file
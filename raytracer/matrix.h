@@ -2,9 +2,12 @@
 
 #include "../raytracer-geom/vector.h"
 #include "../raytracer-geom/ray.h"
+#include "../raytracer-geom/ray_packet.h"
 #include "camera_options.h"
 
 #include <array>
+#include <span>
+#include <utility>
 
 class Matrix {
 public:
@@ -65,18 +68,65 @@ inline Matrix CreateTransitionMatrix(const CameraOptions& co) {
     return rotate * vertical_transform;
 }
 
+// A point of the image plane: pixel (i, j), column first as RayTransformer takes it, and the
+// offset of the point from the centre of that pixel, in pixels.
+struct ImagePoint {
+    size_t i;
+    size_t j;
+    double dx = 0;
+    double dy = 0;
+};
+
 class RayTransformer {
 public:
+    // Primary rays are traced in packets of this many pixels squared.
+    static constexpr size_t kPacketSide = 4;
+    static_assert(kPacketSide * kPacketSide <= RayPacket::kSize);
+
     RayTransformer(const CameraOptions& co)
         : co_(co), m_(CreateTransitionMatrix(co)), def_(co_.screen_height / 2) {
     }
 
     Ray operator()(size_t i, size_t j) const {
-        double x = i - static_cast<double>(co_.screen_width - 1) / 2;
-        double y = j - static_cast<double>(co_.screen_height - 1) / 2;
+        return (*this)({i, j});
+    }
+
+    Ray operator()(const ImagePoint& point) const {
+        double x = point.i + point.dx - static_cast<double>(co_.screen_width - 1) / 2;
+        double y = point.j + point.dy - static_cast<double>(co_.screen_height - 1) / 2;
         x *= std::tan(co_.fov / 2) / def_;
         y *= std::tan(co_.fov / 2) / def_;
-        return Ray(co_.look_from, Normalized(m_ * Vector({x, -y, -1})));
+        return Ray(Vector(co_.look_from), Normalized(m_ * Vector(x, -y, -1)));
+    }
+
+    // Rays through the pixels of a block of at most kPacketSide x kPacketSide pixels with its
+    // upper left corner at (i, j), row by row. Lanes match operator() exactly.
+    RayPacket GetPacket(size_t i, size_t j, size_t width, size_t height) const {
+        RayPacket packet((Vector(co_.look_from)));
+        for (size_t y = j; y != j + height; ++y) {
+            for (size_t x = i; x != i + width; ++x) {
+                packet.Add((*this)(x, y).GetDirection());
+            }
+        }
+        return packet;
+    }
+
+    // Rays through up to RayPacket::kSize pixels given as (i, j) pairs, in that order.
+    RayPacket GetPacket(std::span<const std::pair<size_t, size_t>> pixels) const {
+        RayPacket packet((Vector(co_.look_from)));
+        for (auto [i, j] : pixels) {
+            packet.Add((*this)(i, j).GetDirection());
+        }
+        return packet;
+    }
+
+    // Rays through up to RayPacket::kSize points, in that order.
+    RayPacket GetPacket(std::span<const ImagePoint> points) const {
+        RayPacket packet((Vector(co_.look_from)));
+        for (const auto& point : points) {
+            packet.Add((*this)(point).GetDirection());
+        }
+        return packet;
     }
 
 private:
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+// PNG row filters by their type byte; kAdaptive picks the one with the smallest sum of absolute
+// differences for every row, like libpng does by default.
+enum class PngFilter { kNone, kSub, kUp, kAverage, kPaeth, kAdaptive };
+
+// How images are written.
+struct OutputOptions {
+    // zlib level from 0 (stored) to 9.
+    int png_level = 6;
+    PngFilter png_filter = PngFilter::kAdaptive;
+    // Also write the number of camera rays of every pixel as a heatmap PNG next to the image,
+    // with `.spp.png` in place of its extension.
+    bool sample_map = false;
+};
+
+// Output files are chosen by extension: .ppm files are binary PPM, .pfm and .exr files get the
+// float values of the frame and everything else is PNG.
+enum class ImageFormat { kPng, kPpm, kPfm, kExr };
+
+inline ImageFormat GetImageFormat(const std::string& filename) {
+    if (filename.ends_with(".ppm")) {
+        return ImageFormat::kPpm;
+    }
+    if (filename.ends_with(".pfm")) {
+        return ImageFormat::kPfm;
+    }
+    if (filename.ends_with(".exr")) {
+        return ImageFormat::kExr;
+    }
+    return ImageFormat::kPng;
+}
@@ -1,268 +1,896 @@
 #pragma once
 
 #include "image.h"
+#include "framebuffer.h"
 #include "camera_options.h"
 #include "render_options.h"
 #include "../raytracer-reader/scene.h"
 #include "matrix.h"
 #include "../raytracer-geom/geometry.h"
+#include "accelerator.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
-#include <variant>
 
-Vector Recursive(int depth, const Scene& scene, const Ray& ray, bool in) {
+// Emitted and ambient light at a hit plus the light reaching it directly from the lights.
+// `normal` is the normalized shading normal.
+Vector ShadeDirect(const Scene& scene, const Accelerator& accelerator, const Ray& ray,
+                   const Hit& hit, const Vector& normal) {
+    const Intersection* closest = &hit.intersection;
+    const Material& material = hit.GetMaterial();
 
-    std::optional<Intersection> closest;
-    std::optional<std::variant<Object, SphereObject>> obj;
+    Vector color = material.ambient_color + material.intensity;
+    Vector base;
 
-    for (const auto& obj_iter : scene.GetObjects()) {
-        auto intersection = GetIntersection(ray, obj_iter.polygon);
-        if (!intersection.has_value()) {
-            continue;
+    for (const auto& l : scene.GetLights()) {
+        Ray r(l.position, closest->GetPosition() + normal * 1e-4 - l.position);
+        if (!accelerator.IsOccluded(r, Length(closest->GetPosition() - l.position) - 1e-3)) {
+            Vector v_l = Normalized(l.position - closest->GetPosition());
+            base += material.diffuse_color * l.intensity *
+                    std::max<Scalar>(0, DotProduct(v_l, normal));
+            Vector v_r = Reflect(-v_l, normal);
+            Vector v_e = Normalized(ray.GetOrigin() - closest->GetPosition());
+            base += material.specular_color * l.intensity *
+                    std::pow(std::max<Scalar>(0, DotProduct(v_r, v_e)), material.specular_exponent);
         }
-        if (!closest.has_value()) {
-            closest = intersection;
-            obj = obj_iter;
-        } else if (intersection->GetDistance() < closest->GetDistance()) {
-            closest = intersection;
-            obj = obj_iter;
+    }
+
+    color += base * material.albedo[0];
+    return color;
+}
+
+// The bits of z mixed so that every bit of the result depends on every bit of z (SplitMix64).
+inline uint64_t MixBits(uint64_t z) {
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9;
+    z = (z ^ z >> 27) * 0x94d049bb133111eb;
+    return z ^ z >> 31;
+}
+
+// Number in [0, 1) drawn for Russian roulette on the ray. It is a hash of the ray, so the
+// integrators, threads and workers all decide the same.
+inline double GetRouletteNumber(const Ray& ray) {
+    uint64_t hash = 0;
+    for (const Vector* vector : {&ray.GetOrigin(), &ray.GetDirection()}) {
+        for (int c = 0; c != 3; ++c) {
+            uint64_t bits = 0;
+            Scalar value = (*vector)[c];
+            std::memcpy(&bits, &value, sizeof(value));
+            hash = MixBits(hash + bits + 0x9e3779b97f4a7c15);
         }
     }
+    return (hash >> 11) * 0x1p-53;
+}
 
-    for (const auto& obj_iter : scene.GetSphereObjects()) {
-        auto intersection = GetIntersection(ray, obj_iter.sphere);
-        if (!intersection.has_value()) {
-            continue;
+// Passes the reflected and refracted rays leaving a hit to emit(ray, weight, in, throughput), in
+// the order their colors are added to it, except those that `pruning` cuts. `in` tells whether the
+// ray travels inside a sphere; `throughput` is the one of the ray that made the hit.
+template <class Emit>
+void ForEachBounce(const Ray& ray, const Hit& hit, const Vector& normal, bool in,
+                   Scalar throughput, const PathPruning& pruning, Emit&& emit) {
+    const Intersection* closest = &hit.intersection;
+    const Material& material = hit.GetMaterial();
+    auto follow = [&](const Ray& next, Scalar weight, bool next_in) {
+        Scalar next_throughput = throughput * weight;
+        if (next_throughput < pruning.min_throughput) {
+            Scalar survival = next_throughput / pruning.min_throughput;
+            if (!pruning.russian_roulette || GetRouletteNumber(next) >= survival) {
+                return;
+            }
+            weight /= survival;
+            next_throughput = pruning.min_throughput;
         }
-        if (!closest.has_value()) {
-            closest = intersection;
-            obj = obj_iter;
-        } else if (intersection->GetDistance() < closest->GetDistance()) {
-            closest = intersection;
-            obj = obj_iter;
+        emit(next, weight, next_in, next_throughput);
+    };
+
+    if (in) {
+        std::optional<Vector> refrac_vec =
+            Refract(ray.GetDirection(), normal, material.refraction_index);
+        if (refrac_vec.has_value()) {
+            Ray refr(closest->GetPosition() - normal * 1e-4, *refrac_vec);
+            follow(refr, 1, in ^ (hit.sphere != nullptr));
         }
     }
 
-    if (!obj.has_value()) {
-        return {0, 0, 0};
+    if (material.albedo[1] != 0 && !in) {
+        Ray refl(closest->GetPosition() + normal * 1e-4, Reflect(ray.GetDirection(), normal));
+        follow(refl, material.albedo[1], in);
     }
 
-    Vector normal;
-    Material material;
+    if (material.albedo[2] != 0 && !in) {
+        std::optional<Vector> refrac_vec =
+            Refract(ray.GetDirection(), normal, 1 / material.refraction_index);
+        if (refrac_vec.has_value()) {
+            Ray refr(closest->GetPosition() - normal * 1e-4, refrac_vec.value());
+            follow(refr, material.albedo[2], in ^ (hit.sphere != nullptr));
+        }
+    }
+}
 
-    if (auto sphere = std::get_if<SphereObject>(&obj.value())) {
-        normal = Normalized(closest->GetNormal());
-        material = *sphere->material;
-    } else {
-        auto triangle = std::get_if<Object>(&obj.value());
-        material = *triangle->material;
+// Color seen along `ray`, given its closest hit. `throughput` is the factor of that color in the
+// color of the pixel, as ForEachBounce passes it.
+Vector Shade(int depth, const Scene& scene, const Accelerator& accelerator, const Ray& ray,
+             const std::optional<Hit>& hit, bool in, Scalar throughput,
+             const PathPruning& pruning);
 
-        if (*triangle->GetNormal(0) == Vector{0, 0, 0}) {
-            normal = Normalized(closest->GetNormal());
-        } else {
-            auto c = GetBarycentricCoords(triangle->polygon, closest->GetPosition());
-            normal = Normalized(*triangle->GetNormal(0) * c[0] + *triangle->GetNormal(1) * c[1] +
-                                *triangle->GetNormal(2) * c[2]);
-        }
+Vector Recursive(int depth, const Scene& scene, const Accelerator& accelerator, const Ray& ray,
+                 bool in, Scalar throughput, const PathPruning& pruning) {
+    return Shade(depth, scene, accelerator, ray, accelerator.Intersect(ray), in, throughput,
+                 pruning);
+}
+
+Vector Shade(int depth, const Scene& scene, const Accelerator& accelerator, const Ray& ray,
+             const std::optional<Hit>& hit, bool in, Scalar throughput,
+             const PathPruning& pruning) {
+    if (!hit.has_value()) {
+        return {0, 0, 0};
+    }
+    Vector normal = Normalized(hit->GetShadingNormal());
+    Vector color = ShadeDirect(scene, accelerator, ray, *hit, normal);
+    if (depth != 0) {
+        ForEachBounce(ray, *hit, normal, in, throughput, pruning,
+                      [&](const Ray& next, Scalar weight, bool next_in, Scalar next_throughput) {
+                          color += weight * Recursive(depth - 1, scene, accelerator, next,
+                                                      next_in, next_throughput, pruning);
+                      });
     }
+    return color;
+}
 
-    Vector color = material.ambient_color + material.intensity;
-    Vector base;
+// Follows the paths of a batch of camera rays breadth-first instead of the depth-first walk of
+// Recursive: every bounce is a batch of rays that are intersected together, ordered by direction
+// octant, and whose hits are shaded grouped by material and octant, emitting the next batch. The
+// colors are summed from the last bounce back in the order Shade sums them, so they are exactly
+// those of Shade.
+class Wavefront {
+public:
+    // Adds a camera ray with its closest hit.
+    void Add(const Ray& ray, const std::optional<Hit>& hit) {
+        paths_.push_back({ray, false, 1, 1});
+        hits_.push_back(hit);
+    }
 
-    for (const auto& l : scene.GetLights()) {
-        Ray r(l.position, closest->GetPosition() + normal * 1e-4 - l.position);
-        std::optional<Intersection> closest_to_light;
+    // Calls output(index, color) for every ray in the order they were added, and clears the
+    // batch.
+    template <class Output>
+    void Trace(int depth, const PathPruning& pruning, const Scene& scene,
+               const Accelerator& accelerator, Output&& output) {
+        const size_t camera_rays = paths_.size();
+        std::vector<SortKey> order;
+        for (size_t begin = 0, end = paths_.size(); begin != end; --depth) {
+            if (begin != 0) {
+                order.clear();
+                for (size_t k = begin; k != end; ++k) {
+                    order.push_back({nullptr, GetOctant(paths_[k].ray), static_cast<uint32_t>(k)});
+                }
+                std::sort(order.begin(), order.end());
+                hits_.resize(end - begin);
+                for (const auto& key : order) {
+                    hits_[key.path - begin] = accelerator.Intersect(paths_[key.path].ray);
+                }
+            }
 
-        for (const auto& obj_iter : scene.GetObjects()) {
-            auto intersection = GetIntersection(r, obj_iter.polygon);
-            if (!intersection.has_value()) {
-                continue;
+            order.clear();
+            for (size_t k = begin; k != end; ++k) {
+                if (const auto& hit = hits_[k - begin]) {
+                    order.push_back({hit->material, GetOctant(paths_[k].ray),
+                                     static_cast<uint32_t>(k)});
+                }
             }
-            if (!closest_to_light.has_value()) {
-                closest_to_light = intersection;
-            } else if (intersection->GetDistance() < closest_to_light->GetDistance()) {
-                closest_to_light = intersection;
+            std::sort(order.begin(), order.end());
+            for (const auto& key : order) {
+                const Hit& hit = *hits_[key.path - begin];
+                const Ray ray = paths_[key.path].ray;
+                const bool in = paths_[key.path].in;
+                Vector normal = Normalized(hit.GetShadingNormal());
+                paths_[key.path].color = ShadeDirect(scene, accelerator, ray, hit, normal);
+                if (depth != 0) {
+                    paths_[key.path].first_child = paths_.size();
+                    ForEachBounce(ray, hit, normal, in, paths_[key.path].throughput, pruning,
+                                  [&](const Ray& next, Scalar weight, bool next_in,
+                                      Scalar next_throughput) {
+                                      paths_.push_back({next, next_in, weight, next_throughput});
+                                      ++paths_[key.path].child_count;
+                                  });
+                }
             }
+            begin = end;
+            end = paths_.size();
         }
 
-        for (const auto& obj_iter : scene.GetSphereObjects()) {
-            auto intersection = GetIntersection(r, obj_iter.sphere);
-            if (!intersection.has_value()) {
-                continue;
-            }
-            if (!closest_to_light.has_value()) {
-                closest_to_light = intersection;
-            } else if (intersection->GetDistance() < closest_to_light->GetDistance()) {
-                closest_to_light = intersection;
+        // Bounces are appended after the path they leave, so going backwards sums every path
+        // after all of its children.
+        for (size_t k = paths_.size(); k-- != 0;) {
+            Path& path = paths_[k];
+            for (uint32_t child = path.first_child; child != path.first_child + path.child_count;
+                 ++child) {
+                path.color += paths_[child].weight * paths_[child].color;
             }
         }
+        for (size_t k = 0; k != camera_rays; ++k) {
+            output(k, paths_[k].color);
+        }
+        paths_.clear();
+        hits_.clear();
+    }
 
-        if (!closest_to_light.has_value() ||
-            closest_to_light->GetDistance() > Length(closest->GetPosition() - l.position) - 1e-3) {
-            Vector v_l = Normalized(l.position - closest->GetPosition());
-            base += material.diffuse_color * l.intensity * std::max(.0, DotProduct(v_l, normal));
-            Vector v_r = Reflect(-v_l, normal);
-            Vector v_e = Normalized(ray.GetOrigin() - closest->GetPosition());
-            base += material.specular_color * l.intensity *
-                    std::pow(std::max(.0, DotProduct(v_r, v_e)), material.specular_exponent);
+private:
+    struct Path {
+        Ray ray;
+        bool in;
+        // Factor of the color of this path in the color of the one it bounced off, and in the
+        // color of the pixel.
+        Scalar weight;
+        Scalar throughput;
+        // Black for rays that hit nothing.
+        Vector color;
+        uint32_t first_child = 0;
+        uint32_t child_count = 0;
+    };
+
+    struct SortKey {
+        const Material* material;
+        int octant;
+        uint32_t path;
+
+        bool operator<(const SortKey& other) const {
+            if (material != other.material) {
+                return std::less<const Material*>()(material, other.material);
+            }
+            return std::tie(octant, path) < std::tie(other.octant, other.path);
         }
+    };
+
+    static int GetOctant(const Ray& ray) {
+        const Vector& d = ray.GetDirection();
+        return (d[0] < 0) | (d[1] < 0) << 1 | (d[2] < 0) << 2;
     }
 
-    color += base * material.albedo[0];
+    std::vector<Path> paths_;
+    // Closest hits of the paths of the current bounce.
+    std::vector<std::optional<Hit>> hits_;
+};
 
-    if (in && depth != 0) {
-        std::optional<Vector> refrac_vec =
-            Refract(ray.GetDirection(), normal, material.refraction_index);
-        if (refrac_vec.has_value()) {
-            Ray refr(closest->GetPosition() - normal * 1e-4, *refrac_vec);
-            bool new_in = in ^ (std::get_if<SphereObject>(&obj.value()) != nullptr);
-            color += Recursive(depth - 1, scene, refr, new_in);
+// Side of the square tiles the frame is split into for the render threads, in pixels.
+constexpr int kTileSize = 32;
+// Progressive rendering starts with every kCoarsestStride-th pixel of every kCoarsestStride-th row
+// and halves the stride with every pass.
+constexpr int kCoarsestStride = 16;
+static_assert(kTileSize % RayTransformer::kPacketSide == 0 && kTileSize % kCoarsestStride == 0);
+
+// Pixel rows [begin_i, end_i) and columns [begin_j, end_j) of a tile. Tiles are numbered row by
+// row.
+struct Tile {
+    int begin_i, begin_j, end_i, end_j;
+};
+
+inline size_t GetTileCount(int width, int height) {
+    return static_cast<size_t>((height + kTileSize - 1) / kTileSize) *
+           ((width + kTileSize - 1) / kTileSize);
+}
+
+inline Tile GetTile(int width, int height, size_t index) {
+    const int columns = (width + kTileSize - 1) / kTileSize;
+    int i = index / columns * kTileSize;
+    int j = index % columns * kTileSize;
+    return {i, j, std::min(i + kTileSize, height), std::min(j + kTileSize, width)};
+}
+
+// A frame before it is normalized into an image. Pixels hold the distance to the hit (-1 for
+// none) in a Z channel in depth mode, the 0..255 color in normal mode and the radiance in full
+// mode.
+struct Frame {
+    Frame(RenderMode mode, int width, int height)
+        : mode(mode),
+          width(width),
+          height(height),
+          pixels(width, height,
+                 mode == RenderMode::kDepth ? std::vector<std::string>{"Z"}
+                                            : std::vector<std::string>{"R", "G", "B"}),
+          done(static_cast<size_t>(width) * height),
+          samples(static_cast<size_t>(width) * height) {
+    }
+
+    void Set(int i, int j, const Vector& value, int sample_count = 1) {
+        pixels.Set(i, j, value);
+        done[static_cast<size_t>(i) * width + j] = 1;
+        samples[static_cast<size_t>(i) * width + j] = sample_count;
+    }
+
+    // Pixels that are not rendered yet repeat one on a coarser grid.
+    Vector Get(int i, int j) const {
+        for (int stride = 2; !done[static_cast<size_t>(i) * width + j]; stride *= 2) {
+            i -= i % stride;
+            j -= j % stride;
         }
+        return pixels.Get(i, j);
     }
 
-    if (material.albedo[1] != 0 && depth != 0 && !in) {
-        Ray refl(closest->GetPosition() + normal * 1e-4, Reflect(ray.GetDirection(), normal));
-        auto temp = Recursive(depth - 1, scene, refl, in);
-        color += material.albedo[1] * temp;
+    // Writes the values of the pixels as a .pfm or .exr file.
+    void WriteHdr(const std::string& filename) const {
+        const Framebuffer* out = &pixels;
+        std::optional<Framebuffer> filled;
+        if (std::find(done.begin(), done.end(), 0) != done.end()) {
+            out = &filled.emplace(width, height, pixels.GetChannels());
+            for (int i = 0; i != height; ++i) {
+                for (int j = 0; j != width; ++j) {
+                    filled->Set(i, j, Get(i, j));
+                }
+            }
+        }
+        if (GetImageFormat(filename) == ImageFormat::kPfm) {
+            out->WritePfm(filename);
+        } else {
+            out->WriteExr(filename);
+        }
     }
 
-    if (material.albedo[2] != 0 && depth != 0 && !in) {
-        std::optional<Vector> refrac_vec =
-            Refract(ray.GetDirection(), normal, 1 / material.refraction_index);
-        if (refrac_vec.has_value()) {
-            Ray refr(closest->GetPosition() - normal * 1e-4, refrac_vec.value());
-            bool new_in = in ^ (std::get_if<SphereObject>(&obj.value()) != nullptr);
-            auto temp = Recursive(depth - 1, scene, refr, new_in);
-            color += material.albedo[2] * temp;
+    RenderMode mode;
+    int width;
+    int height;
+    Framebuffer pixels;
+    // Which pixels are rendered already.
+    std::vector<uint8_t> done;
+    // Camera rays traced through every pixel, 0 for pixels not rendered yet.
+    std::vector<uint16_t> samples;
+};
+
+// Value of a camera ray as a Frame holds it, given its closest hit, for every mode but full mode
+// with the wavefront integrator.
+inline Vector GetRayValue(const Scene& scene, const Accelerator& accelerator,
+                          const RenderOptions& render_options, const Ray& ray,
+                          const std::optional<Hit>& hit) {
+    if (render_options.mode == RenderMode::kDepth) {
+        return Vector(hit ? hit->intersection.GetDistance() : -1, 0, 0);
+    }
+    if (render_options.mode == RenderMode::kNormal) {
+        if (!hit.has_value()) {
+            return Vector(0, 0, 0);
         }
+        auto normal = hit->GetShadingNormal();
+        return Vector(static_cast<int>((normal[0] + 1) / 2 * 255),
+                      static_cast<int>((normal[1] + 1) / 2 * 255),
+                      static_cast<int>((normal[2] + 1) / 2 * 255));
     }
+    return Shade(render_options.depth, scene, accelerator, ray, hit, false, 1,
+                 render_options.pruning);
+}
 
-    return color;
+// Adaptive anti-aliasing starts every pixel with this many camera rays, or max_spp when that is
+// fewer, and then doubles the rays of the pixels that are still uncertain, up to max_spp.
+constexpr int kInitialSamples = 4;
+// Difference of mean brightness between neighbouring pixels that marks an edge.
+constexpr Scalar kMinContrast = 0.05;
+// Frames count the rays of a pixel in 16 bits.
+constexpr int kMaxSamples = std::numeric_limits<uint16_t>::max();
+
+inline bool IsAdaptive(const RenderOptions& render_options) {
+    return render_options.max_spp > 1 && render_options.mode != RenderMode::kDepth;
 }
 
-Image Render(const std::string& filename, const CameraOptions& camera_options,
-             const RenderOptions& render_options) {
+// Offset of sample k from the centre of a pixel: point k of the first two dimensions of Sobol's
+// sequence, with the bits of both coordinates flipped by `scramble`. Any 4^m consecutive samples
+// starting at a multiple of 4^m put one sample in each of 2^m x 2^m equal cells of the pixel, and
+// the flipped bits, which differ from pixel to pixel, keep neighbouring pixels from sampling the
+// same points.
+inline std::pair<double, double> GetSubpixelOffset(uint32_t k, uint64_t scramble) {
+    uint32_t x = 0;
+    uint32_t y = 0;
+    for (uint32_t bit = 1u << 31, v = 1u << 31; k != 0; k >>= 1, bit >>= 1, v ^= v >> 1) {
+        if (k & 1) {
+            x |= bit;
+            y ^= v;
+        }
+    }
+    x ^= static_cast<uint32_t>(scramble);
+    y ^= static_cast<uint32_t>(scramble >> 32);
+    return {x * 0x1p-32 - 0.5, y * 0x1p-32 - 0.5};
+}
 
-    std::vector<std::vector<double>> depths;
-    std::vector<std::vector<Vector>> colors;
-    double max_depth;
-    double max_intensity;
-    Image img(camera_options.screen_width, camera_options.screen_height);
-    Scene scene = ReadScene(filename);
+// Bits that differ from pixel to pixel, the same in every render of the pixel.
+inline uint64_t GetPixelScramble(int i, int j) {
+    return MixBits((static_cast<uint64_t>(i) << 32 | static_cast<uint32_t>(j)) +
+                   0x9e3779b97f4a7c15);
+}
 
-    auto mode = render_options.mode;
-    RayTransformer rt(camera_options);
+// Brightness of a ray value as the image shows it, from 0 to 1: the luminance of the color in
+// normal mode, and of the radiance after the tone curve of ToneMap without a white point in full
+// mode.
+inline Scalar GetSampleBrightness(RenderMode mode, const Vector& value) {
+    Vector color = value;
+    if (mode == RenderMode::kNormal) {
+        color = color / 255;
+    } else {
+        for (int c = 0; c != 3; ++c) {
+            color[c] = std::pow(std::max<Scalar>(0, color[c]) / (1 + color[c]), 1 / 2.2);
+        }
+    }
+    return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+}
 
-    if (mode == RenderMode::kDepth) {
-        max_depth = 0;
-        depths = std::vector<std::vector<double>>(camera_options.screen_height,
-                                                  std::vector<double>(camera_options.screen_width));
-    } else if (mode == RenderMode::kFull) {
-        max_intensity = 0;
-        colors = std::vector<std::vector<Vector>>(camera_options.screen_height,
-                                                  std::vector<Vector>(camera_options.screen_width));
-    }
-
-    for (int i = 0; i != camera_options.screen_height; ++i) {
-        for (int j = 0; j != camera_options.screen_width; ++j) {
-            Ray ray = rt(j, i);
-            std::optional<Intersection> closest;
-            std::optional<std::variant<Object, SphereObject>> obj;
-            for (auto obj_iter : scene.GetObjects()) {
-                auto intersection = GetIntersection(ray, obj_iter.polygon);
-                if (!intersection.has_value()) {
-                    continue;
-                }
-                if (!closest.has_value()) {
-                    closest = intersection;
-                    obj = obj_iter;
-                } else if (intersection->GetDistance() < closest->GetDistance()) {
-                    closest = intersection;
-                    obj = obj_iter;
+// Renders the pixels of a tile like RenderTile, with adaptive anti-aliasing: every pixel is the
+// mean of its samples. Rounds of samples are traced for all pixels that need them at once, in
+// packets of consecutive samples.
+template <class Store>
+void RenderTileAdaptively(const Scene& scene, const Accelerator& accelerator,
+                          const RayTransformer& rt, const RenderOptions& render_options,
+                          const Tile& tile, int stride, bool first, Store&& store) {
+    struct Pixel {
+        int i, j;
+        uint64_t scramble;
+        Vector sum;
+        Scalar brightness = 0;
+        Scalar brightness_squares = 0;
+        int count = 0;
+
+        Scalar GetStandardError() const {
+            Scalar variance =
+                (brightness_squares - brightness * brightness / count) / std::max(1, count - 1);
+            return std::sqrt(std::max<Scalar>(0, variance) / count);
+        }
+    };
+    const int block = RayTransformer::kPacketSide * stride;
+    std::vector<Pixel> pixels;
+    for (int block_i = tile.begin_i; block_i < tile.end_i; block_i += block) {
+        for (int block_j = tile.begin_j; block_j < tile.end_j; block_j += block) {
+            for (int i = block_i; i < std::min(block_i + block, tile.end_i); i += stride) {
+                for (int j = block_j; j < std::min(block_j + block, tile.end_j); j += stride) {
+                    if (first || i % (2 * stride) != 0 || j % (2 * stride) != 0) {
+                        pixels.push_back({i, j, GetPixelScramble(i, j)});
+                    }
                 }
             }
-            for (auto obj_iter : scene.GetSphereObjects()) {
-                auto intersection = GetIntersection(ray, obj_iter.sphere);
-                if (!intersection.has_value()) {
+        }
+    }
+
+    // Pixels whose mean differs from that of a neighbour by at least kMinContrast get another
+    // round of samples even when theirs agree, for edges that their first samples missed.
+    // Neighbours rendered by earlier passes or in other tiles are not compared.
+    auto flag_contrast = [](const std::vector<Pixel>& pixels, const Tile& tile, int stride,
+                           std::vector<uint8_t>& contrast) {
+        const int width = tile.end_j - tile.begin_j;
+        std::vector<int32_t> grid(static_cast<size_t>(tile.end_i - tile.begin_i) * width, -1);
+        for (size_t k = 0; k != pixels.size(); ++k) {
+            grid[(pixels[k].i - tile.begin_i) * width + (pixels[k].j - tile.begin_j)] = k;
+        }
+        contrast.assign(pixels.size(), 0);
+        for (size_t k = 0; k != pixels.size(); ++k) {
+            const Pixel& pixel = pixels[k];
+            for (auto [di, dj] : {std::pair{stride, 0}, std::pair{0, stride}}) {
+                int i = pixel.i + di - tile.begin_i;
+                int j = pixel.j + dj - tile.begin_j;
+                if (i >= tile.end_i - tile.begin_i || j >= width || grid[i * width + j] < 0) {
                     continue;
                 }
-                if (!closest.has_value()) {
-                    closest = intersection;
-                    obj = obj_iter;
-                } else if (intersection->GetDistance() < closest->GetDistance()) {
-                    closest = intersection;
-                    obj = obj_iter;
+                const Pixel& other = pixels[grid[i * width + j]];
+                if (std::abs(pixel.brightness / pixel.count - other.brightness / other.count) >=
+                    kMinContrast) {
+                    contrast[k] = 1;
+                    contrast[grid[i * width + j]] = 1;
                 }
             }
-            if (mode == RenderMode::kDepth) {
-                if (!closest.has_value()) {
-                    depths[i][j] = -1;
-                } else {
-                    depths[i][j] = closest->GetDistance();
-                    max_depth = std::max(max_depth, depths[i][j]);
-                }
-            } else if (mode == RenderMode::kNormal) {
-                if (!obj.has_value()) {
-                    img.SetPixel({0, 0, 0}, i, j);
-                } else if (std::get_if<SphereObject>(&obj.value())) {
-                    img.SetPixel({static_cast<int>((closest->GetNormal()[0] + 1) / 2 * 255),
-                                  static_cast<int>((closest->GetNormal()[1] + 1) / 2 * 255),
-                                  static_cast<int>((closest->GetNormal()[2] + 1) / 2 * 255)},
-                                 i, j);
+        }
+    };
+
+    const int max_samples = std::min(render_options.max_spp, kMaxSamples);
+    const bool wavefront = render_options.mode == RenderMode::kFull &&
+                           render_options.integrator == Integrator::kWavefront;
+    Wavefront batch;
+    std::vector<uint32_t> active(pixels.size());
+    std::iota(active.begin(), active.end(), 0);
+    std::vector<ImagePoint> points;
+    std::vector<uint32_t> owners;
+    std::vector<uint8_t> contrast;
+    auto add = [&](size_t index, const Vector& value) {
+        Pixel& pixel = pixels[owners[index]];
+        Scalar brightness = GetSampleBrightness(render_options.mode, value);
+        pixel.sum += value;
+        pixel.brightness += brightness;
+        pixel.brightness_squares += brightness * brightness;
+        ++pixel.count;
+    };
+    for (int target = std::min(kInitialSamples, max_samples); !active.empty();
+         target = std::min(2 * target, max_samples)) {
+        points.clear();
+        owners.clear();
+        for (uint32_t index : active) {
+            const Pixel& pixel = pixels[index];
+            for (int k = pixel.count; k != target; ++k) {
+                auto [dx, dy] = GetSubpixelOffset(k, pixel.scramble);
+                points.push_back({static_cast<size_t>(pixel.j), static_cast<size_t>(pixel.i),
+                                  dx, dy});
+                owners.push_back(index);
+            }
+        }
+        for (size_t begin = 0; begin < points.size(); begin += RayPacket::kSize) {
+            auto packet_points =
+                std::span(points).subspan(begin, std::min(RayPacket::kSize, points.size() - begin));
+            RayPacket packet = rt.GetPacket(packet_points);
+            auto hits = accelerator.Intersect(packet);
+            for (size_t lane = 0; lane != packet_points.size(); ++lane) {
+                if (wavefront) {
+                    batch.Add(packet.GetRay(lane), hits[lane]);
                 } else {
-                    auto p = std::get_if<Object>(&obj.value());
-                    if (*p->GetNormal(0) == Vector{0, 0, 0}) {
-                        img.SetPixel({static_cast<int>((closest->GetNormal()[0] + 1) / 2 * 255),
-                                      static_cast<int>((closest->GetNormal()[1] + 1) / 2 * 255),
-                                      static_cast<int>((closest->GetNormal()[2] + 1) / 2 * 255)},
-                                     i, j);
-                    } else {
-                        auto c = GetBarycentricCoords(p->polygon, closest->GetPosition());
-                        auto normal = c[0] * *p->GetNormal(0) + c[1] * *p->GetNormal(1) +
-                                      c[2] * *p->GetNormal(2);
-                        img.SetPixel({static_cast<int>((normal[0] + 1) / 2 * 255),
-                                      static_cast<int>((normal[1] + 1) / 2 * 255),
-                                      static_cast<int>((normal[2] + 1) / 2 * 255)},
-                                     i, j);
-                    }
+                    add(begin + lane, GetRayValue(scene, accelerator, render_options,
+                                                  packet.GetRay(lane), hits[lane]));
                 }
-            } else {
-                auto color = Recursive(render_options.depth, scene, ray, false);
-                max_intensity = std::max(max_intensity, color[0]);
-                max_intensity = std::max(max_intensity, color[1]);
-                max_intensity = std::max(max_intensity, color[2]);
-                colors[i][j] = color;
             }
         }
+        if (wavefront) {
+            batch.Trace(render_options.depth, render_options.pruning, scene, accelerator, add);
+        }
+        if (target == std::min(kInitialSamples, max_samples)) {
+            flag_contrast(pixels, tile, stride, contrast);
+        }
+        std::erase_if(active, [&](uint32_t index) {
+            const Pixel& pixel = pixels[index];
+            if (pixel.count == max_samples) {
+                return true;
+            }
+            if (contrast[index]) {
+                contrast[index] = 0;
+                return false;
+            }
+            return pixel.GetStandardError() < render_options.aa_threshold;
+        });
     }
+    for (const Pixel& pixel : pixels) {
+        store(pixel.i, pixel.j, pixel.sum / pixel.count, pixel.count);
+    }
+}
 
-    if (mode == RenderMode::kDepth) {
-        for (int i = 0; i != img.Height(); ++i) {
-            for (int j = 0; j != img.Width(); ++j) {
-                if (depths[i][j] == -1) {
-                    img.SetPixel({255, 255, 255}, i, j);
+// Renders the pixels of a tile on the grid of the given stride and passes each to
+// store(i, j, value, samples), with the value as a Frame holds it and the number of camera rays
+// it took. Unless it is the first pass, pixels on the grid of twice the stride were rendered by
+// the previous one and are skipped. Primary rays are traced a block of
+// kPacketSide x kPacketSide grid points at a time. The wavefront integrator shades the whole tile
+// at once after its camera rays are traced.
+template <class Store>
+void RenderTile(const Scene& scene, const Accelerator& accelerator, const RayTransformer& rt,
+                const RenderOptions& render_options, const Tile& tile, int stride, bool first,
+                Store&& store) {
+    if (IsAdaptive(render_options)) {
+        RenderTileAdaptively(scene, accelerator, rt, render_options, tile, stride, first, store);
+        return;
+    }
+    const int block = RayTransformer::kPacketSide * stride;
+    std::array<std::pair<size_t, size_t>, RayPacket::kSize> pixels;
+    const bool wavefront = render_options.mode == RenderMode::kFull &&
+                           render_options.integrator == Integrator::kWavefront;
+    Wavefront batch;
+    std::vector<std::pair<int, int>> batch_pixels;
+    for (int block_i = tile.begin_i; block_i < tile.end_i; block_i += block) {
+        for (int block_j = tile.begin_j; block_j < tile.end_j; block_j += block) {
+            size_t count = 0;
+            for (int i = block_i; i < std::min(block_i + block, tile.end_i); i += stride) {
+                for (int j = block_j; j < std::min(block_j + block, tile.end_j); j += stride) {
+                    if (first || i % (2 * stride) != 0 || j % (2 * stride) != 0) {
+                        pixels[count++] = {j, i};
+                    }
+                }
+            }
+            RayPacket packet = rt.GetPacket(std::span(pixels.data(), count));
+            auto hits = accelerator.Intersect(packet);
+            for (size_t lane = 0; lane != count; ++lane) {
+                int i = pixels[lane].second;
+                int j = pixels[lane].first;
+                if (wavefront) {
+                    batch.Add(packet.GetRay(lane), hits[lane]);
+                    batch_pixels.emplace_back(i, j);
                 } else {
-                    int d = depths[i][j] / max_depth * 255;
-                    img.SetPixel({d, d, d}, i, j);
+                    store(i, j,
+                          GetRayValue(scene, accelerator, render_options, packet.GetRay(lane),
+                                      hits[lane]),
+                          1);
                 }
             }
         }
-    } else if (mode == RenderMode::kFull) {
-        for (int i = 0; i != img.Height(); ++i) {
-            for (int j = 0; j != img.Width(); ++j) {
-                auto color = colors[i][j];
-                color[0] *= (1 + color[0] / max_intensity / max_intensity) / (1 + color[0]);
-                color[1] *= (1 + color[1] / max_intensity / max_intensity) / (1 + color[1]);
-                color[2] *= (1 + color[2] / max_intensity / max_intensity) / (1 + color[2]);
-                color[0] = std::pow(color[0], 1 / 2.2);
-                color[1] = std::pow(color[1], 1 / 2.2);
-                color[2] = std::pow(color[2], 1 / 2.2);
-                img.SetPixel({static_cast<int>(color[0] * 255), static_cast<int>(color[1] * 255),
-                              static_cast<int>(color[2] * 255)},
-                             i, j);
+    }
+    if (wavefront) {
+        batch.Trace(render_options.depth, render_options.pruning, scene, accelerator,
+                    [&](size_t index, const Vector& color) {
+                        store(batch_pixels[index].first, batch_pixels[index].second, color, 1);
+                    });
+    }
+}
+
+// Pixel of the image for a Frame value. `max_value` is the value that becomes white in depth and
+// full mode; larger ones are clipped.
+inline RGB ToneMap(RenderMode mode, Vector color, Scalar max_value) {
+    if (mode == RenderMode::kDepth) {
+        if (color[0] == -1) {
+            return {255, 255, 255};
+        }
+        int d = std::min<Scalar>(color[0] / max_value * 255, 255);
+        return {d, d, d};
+    }
+    if (mode == RenderMode::kNormal) {
+        return {static_cast<int>(color[0]), static_cast<int>(color[1]),
+                static_cast<int>(color[2])};
+    }
+    Scalar max_intensity = max_value;
+    color[0] *= (1 + color[0] / max_intensity / max_intensity) / (1 + color[0]);
+    color[1] *= (1 + color[1] / max_intensity / max_intensity) / (1 + color[1]);
+    color[2] *= (1 + color[2] / max_intensity / max_intensity) / (1 + color[2]);
+    color[0] = std::pow(color[0], 1 / 2.2);
+    color[1] = std::pow(color[1], 1 / 2.2);
+    color[2] = std::pow(color[2], 1 / 2.2);
+    return {static_cast<int>(std::min<Scalar>(color[0] * 255, 255)),
+            static_cast<int>(std::min<Scalar>(color[1] * 255, 255)),
+            static_cast<int>(std::min<Scalar>(color[2] * 255, 255))};
+}
+
+// Without a white point, normalization needs the maximum over the whole frame, which is exact in
+// any order. Pixels that are not rendered yet hold zeros, which do not change it, and repeat one
+// on a coarser grid.
+inline Image MakeImage(const Frame& frame, int threads, double white_point = 0) {
+    Image img(frame.width, frame.height);
+    Scalar max_value = white_point;
+    if (white_point <= 0) {
+        const float* values = frame.pixels.GetPixel(0, 0);
+        max_value = std::max<Scalar>(0, *std::max_element(values, values + frame.pixels.GetSize()));
+    }
+    ParallelFor(img.Height(), threads, [&](size_t i) {
+        for (int j = 0; j != img.Width(); ++j) {
+            img.SetPixel(ToneMap(frame.mode, frame.Get(i, j), max_value), i, j);
+        }
+    });
+    return img;
+}
+
+inline int GetThreadCount(const RenderOptions& render_options) {
+    return render_options.threads > 0 ? render_options.threads : GetDefaultThreadCount();
+}
+
+// With a deadline or snapshot interval set, the image is rendered progressively: the coarsest
+// pass is always completed, and refinement stops at the deadline, counted from the start of
+// rendering. Pixels not rendered by then repeat the closest rendered pixel above and to the left
+// of them. `snapshot` receives the frame after every pass that ends at least snapshot_ms after
+// the previous snapshot.
+inline Frame RenderFrame(const Scene& scene, const Accelerator& accelerator,
+                         const CameraOptions& camera_options, const RenderOptions& render_options,
+                         const std::function<void(const Frame&)>& snapshot = {}) {
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    const int width = camera_options.screen_width;
+    const int height = camera_options.screen_height;
+    RayTransformer rt(camera_options);
+    const int threads = GetThreadCount(render_options);
+    Frame frame(render_options.mode, width, height);
+
+    // Every pixel is computed on its own, so the tiles can be rendered in any order and on any
+    // thread.
+    const bool progressive = render_options.deadline_ms > 0 || render_options.snapshot_ms > 0;
+    const auto deadline = start + std::chrono::milliseconds(render_options.deadline_ms);
+    auto past_deadline = [&] {
+        return render_options.deadline_ms > 0 && Clock::now() >= deadline;
+    };
+    auto last_snapshot = start;
+    for (int stride = progressive ? kCoarsestStride : 1; stride != 0; stride /= 2) {
+        bool first = !progressive || stride == kCoarsestStride;
+        ParallelFor(GetTileCount(width, height), threads, [&](size_t tile) {
+            if (first || !past_deadline()) {
+                RenderTile(scene, accelerator, rt, render_options, GetTile(width, height, tile),
+                           stride, first,
+                           [&frame](int i, int j, const Vector& value, int samples) {
+                               frame.Set(i, j, value, samples);
+                           });
             }
+        });
+        if (stride == 1 || past_deadline()) {
+            break;
+        }
+        if (snapshot && render_options.snapshot_ms > 0 &&
+            Clock::now() - last_snapshot >= std::chrono::milliseconds(render_options.snapshot_ms)) {
+            snapshot(frame);
+            last_snapshot = Clock::now();
+        }
+    }
+    return frame;
+}
+
+inline Frame RenderFrame(const std::string& filename, const CameraOptions& camera_options,
+                         const RenderOptions& render_options,
+                         const std::function<void(const Frame&)>& snapshot = {}) {
+    LoadedScene loaded(filename, render_options);
+    return RenderFrame(loaded.GetScene(), loaded.GetAccelerator(), camera_options, render_options,
+                       snapshot);
+}
+
+// Heatmap of the camera rays of every pixel on a log scale, from black for one ray through red
+// and yellow to white for `max_samples`. Pixels not rendered yet are black too.
+inline Image MakeSampleMap(const Frame& frame, int max_samples) {
+    Image img(frame.width, frame.height);
+    const double scale = max_samples > 1 ? 1 / std::log2(max_samples) : 0;
+    for (int i = 0; i != frame.height; ++i) {
+        for (int j = 0; j != frame.width; ++j) {
+            int samples = frame.samples[static_cast<size_t>(i) * frame.width + j];
+            double t = samples > 1 ? 3 * std::log2(samples) * scale : 0;
+            img.SetPixel({static_cast<int>(std::clamp(t, 0.0, 1.0) * 255),
+                          static_cast<int>(std::clamp(t - 1, 0.0, 1.0) * 255),
+                          static_cast<int>(std::clamp(t - 2, 0.0, 1.0) * 255)},
+                         i, j);
         }
     }
     return img;
-}
\ No newline at end of file
+}
+
+// `image.spp.png` for `image.png`.
+inline std::string GetSampleMapPath(const std::string& filename) {
+    std::filesystem::path path(filename);
+    return (path.parent_path() / (path.stem().string() + ".spp.png")).string();
+}
+
+// Writes the frame in the format of the file: normalized into an 8-bit PNG or PPM image, or with
+// its values for .pfm and .exr files. The sample map, when the options ask for it, goes next to
+// it.
+inline void WriteFrame(const Frame& frame, const RenderOptions& render_options,
+                       const std::string& filename) {
+    const ImageFormat format = GetImageFormat(filename);
+    const int threads = GetThreadCount(render_options);
+    if (render_options.output.sample_map) {
+        MakeSampleMap(frame, IsAdaptive(render_options) ? render_options.max_spp : 1)
+            .Write(GetSampleMapPath(filename), render_options.output, threads);
+    }
+    if (format == ImageFormat::kPfm || format == ImageFormat::kExr) {
+        frame.WriteHdr(filename);
+        return;
+    }
+    Image image = MakeImage(frame, threads, render_options.white_point);
+    if (format == ImageFormat::kPpm) {
+        image.WritePpm(filename);
+    } else {
+        image.Write(filename, render_options.output, threads);
+    }
+}
+
+Image Render(const Scene& scene, const Accelerator& accelerator,
+             const CameraOptions& camera_options, const RenderOptions& render_options,
+             const std::function<void(const Image&)>& snapshot = {}) {
+    const int threads = GetThreadCount(render_options);
+    std::function<void(const Frame&)> frame_snapshot;
+    if (snapshot) {
+        frame_snapshot = [&](const Frame& frame) {
+            snapshot(MakeImage(frame, threads, render_options.white_point));
+        };
+    }
+    auto frame = RenderFrame(scene, accelerator, camera_options, render_options, frame_snapshot);
+    return MakeImage(frame, threads, render_options.white_point);
+}
+
+Image Render(const std::string& filename, const CameraOptions& camera_options,
+             const RenderOptions& render_options,
+             const std::function<void(const Image&)>& snapshot = {}) {
+    LoadedScene loaded(filename, render_options);
+    return Render(loaded.GetScene(), loaded.GetAccelerator(), camera_options, render_options,
+                  snapshot);
+}
+
+// Whether RenderToPng can write pixel rows before the rest of the frame is rendered. Depth and full
+// mode need a white point for that, progressive rendering refines the whole frame pass by pass,
+// and a sample map is made from the whole frame.
+inline bool CanStream(const RenderOptions& render_options) {
+    return render_options.deadline_ms == 0 && render_options.snapshot_ms == 0 &&
+           !render_options.output.sample_map &&
+           (render_options.mode == RenderMode::kNormal || render_options.white_point > 0);
+}
+
+// Renders the frame in bands of whole tile rows and writes every band to the PNG file while the
+// next one renders, so memory holds two bands instead of the frame. The file is the one Render
+// and Image::Write give.
+inline void RenderToPng(const Scene& scene, const Accelerator& accelerator,
+                        const CameraOptions& camera_options, const RenderOptions& render_options,
+                        const std::string& output) {
+    if (!CanStream(render_options)) {
+        throw std::runtime_error("Only frames with a white point can be written while rendering");
+    }
+    const int width = camera_options.screen_width;
+    const int height = camera_options.screen_height;
+    RayTransformer rt(camera_options);
+    const int threads = GetThreadCount(render_options);
+
+    // Bands have a few tiles per thread, so threads do not wait long for the last tile of one.
+    const size_t columns = (width + kTileSize - 1) / kTileSize;
+    const int band_height = kTileSize * std::max<size_t>(1, (4 * threads + columns - 1) / columns);
+    const size_t row_size = static_cast<size_t>(width) * 4;
+
+    PngWriter writer(output, width, height, render_options.output, threads);
+    std::vector<Vector> values;
+    std::vector<png_byte> rows;
+    std::vector<png_byte> written_rows;
+    // Rows are encoded on their own thread while the next band renders. An error there is kept
+    // for the next join, and a file that fails is removed rather than left incomplete.
+    std::exception_ptr encode_error;
+    std::jthread encoder;
+    auto join_encoder = [&] {
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+        if (encode_error) {
+            std::rethrow_exception(encode_error);
+        }
+    };
+    try {
+        for (int begin = 0; begin < height; begin += band_height) {
+            const int end = std::min(height, begin + band_height);
+            values.resize(static_cast<size_t>(end - begin) * width);
+            const size_t first_tile = begin / kTileSize * columns;
+            const size_t end_tile = (end + kTileSize - 1) / kTileSize * columns;
+            ParallelFor(end_tile - first_tile, threads, [&](size_t k) {
+                Tile tile = GetTile(width, height, first_tile + k);
+                RenderTile(scene, accelerator, rt, render_options, tile, 1, true,
+                           [&](int i, int j, const Vector& value, int) {
+                               values[static_cast<size_t>(i - begin) * width + j] = value;
+                           });
+            });
+            rows.resize(static_cast<size_t>(end - begin) * row_size);
+            ParallelFor(end - begin, threads, [&](size_t i) {
+                for (int j = 0; j != width; ++j) {
+                    RGB pixel = ToneMap(render_options.mode, values[i * width + j],
+                                        render_options.white_point);
+                    png_byte* out = rows.data() + i * row_size + j * 4;
+                    out[0] = pixel.r;
+                    out[1] = pixel.g;
+                    out[2] = pixel.b;
+                    out[3] = 255;
+                }
+            });
+            join_encoder();
+            std::swap(rows, written_rows);
+            encoder = std::jthread([&writer, &written_rows, &encode_error, row_size] {
+                try {
+                    writer.WriteRows(written_rows.data(), written_rows.size() / row_size);
+                } catch (...) {
+                    encode_error = std::current_exception();
+                }
+            });
+        }
+        join_encoder();
+        writer.Finish();
+    } catch (...) {
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+        std::error_code error;
+        std::filesystem::remove(output, error);
+        throw;
+    }
+}
+
+inline void RenderToPng(const std::string& filename, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const std::string& output) {
+    LoadedScene loaded(filename, render_options);
+    RenderToPng(loaded.GetScene(), loaded.GetAccelerator(), camera_options, render_options,
+                output);
+}
+
+// Renders one image into `output` in the format of its extension, streaming it when it is a PNG
+// file and the options allow it.
+inline void RenderToFile(const Scene& scene, const Accelerator& accelerator,
+                         const CameraOptions& camera_options, const RenderOptions& render_options,
+                         const std::string& output) {
+    if (CanStream(render_options) && GetImageFormat(output) == ImageFormat::kPng) {
+        RenderToPng(scene, accelerator, camera_options, render_options, output);
+    } else {
+        WriteFrame(RenderFrame(scene, accelerator, camera_options, render_options),
+                   render_options, output);
+    }
+}
@@ -1,8 +1,51 @@
 #pragma once
 
+#include "output_options.h"
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
+// How full mode follows reflected and refracted rays: depth-first one ray at a time, or bounce by
+// bounce for all camera rays of a tile.
+enum class Integrator { kRecursive, kWavefront };
+
+// Bounces of full mode whose throughput, the factor their color has in the color of the pixel,
+// is below min_throughput are not followed. With russian_roulette, such a bounce is followed with
+// probability throughput / min_throughput instead, and its color divided by that probability,
+// which keeps the expected color of the pixel. 0 follows every bounce up to the depth.
+struct PathPruning {
+    double min_throughput = 0;
+    bool russian_roulette = false;
+};
+
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // Adaptive anti-aliasing: up to max_spp camera rays per pixel, spent where the pixel is
+    // uncertain. A pixel gets more rays while the standard error of its mean brightness, from 0
+    // to 1 as the image shows it, is at least aa_threshold; 0 gives every pixel max_spp rays.
+    // With 1, every pixel gets one ray through its centre. Depth mode always does that.
+    int max_spp = 1;
+    double aa_threshold = 0.01;
+    Integrator integrator = Integrator::kRecursive;
+    PathPruning pruning;
+    int bvh_width = 4;
+    // Value shown as white: the radiance in full mode, the distance in depth mode. 0 takes the
+    // largest one of the frame, which is only known once the whole frame is rendered.
+    double white_point = 0;
+    // Render threads; 0 uses as many as the CPU quota of the process allows.
+    int threads = 0;
+    // Progressive rendering: stop refining after this many milliseconds, and hand out the image
+    // so far every snapshot_ms milliseconds. 0 turns either off.
+    int deadline_ms = 0;
+    int snapshot_ms = 0;
+    // Render in this many local worker processes instead of this one; 0 renders here.
+    int workers = 0;
+    // Load the scene from its cache file next to the OBJ file when the cache is fresh, and write
+    // the cache when it is not.
+    bool scene_cache = true;
+    // Out-of-core geometry: with a budget, the triangles of the OBJ file are read from
+    // `<file>.obj.rtpages`, written next to it when missing or stale, and at most this many
+    // megabytes of them are kept in memory. 0 keeps all geometry in memory.
+    int geometry_budget_mb = 0;
+    OutputOptions output;
 };
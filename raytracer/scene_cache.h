@@ -0,0 +1,745 @@
+#pragma once
+
+#include "accelerator.h"
+#include "render_options.h"
+#include "thread_pool.h"
+#include "../raytracer-reader/scene.h"
+#include "../raytracer-reader/tokenizer.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Parsed scenes with their acceleration structure, stored next to the OBJ file as
+// `<file>.obj.rtcache`. The file starts with a header describing the build that wrote it and the
+// size and hash of every file the scene was read from; a cache whose header or sources don't
+// match is stale. Then come the members of the scene and its hierarchies, arrays of plain values
+// written as their bytes, and last the hash of everything before it.
+namespace scene_cache {
+
+inline constexpr uint32_t kVersion = 2;
+
+struct Header {
+    std::array<char, 8> magic = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+    uint32_t version = kVersion;
+    // Layout of the build: arrays are only readable by a build with the same sizes and byte
+    // order.
+    uint32_t scalar_size = sizeof(Scalar);
+    uint32_t triangle_size = sizeof(PackedTriangle);
+    uint32_t node_size = sizeof(Bvh::Node);
+    uint32_t wide_node_size = sizeof(WideBvh<8>::Node);
+    uint32_t byte_order = 0x01020304;
+    int32_t bvh_width = 0;
+
+    bool operator==(const Header&) const = default;
+};
+
+// 64-bit hash of a file's contents, read eight bytes at a time.
+// Continues `hash` over the data; the data hashed before must have been a multiple of 8 bytes.
+inline uint64_t HashBytes(uint64_t hash, std::string_view data) {
+    constexpr uint64_t kPrime = 0x100000001b3;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash = (hash ^ word) * kPrime;
+        hash ^= hash >> 29;
+    }
+    for (; i != data.size(); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * kPrime;
+    }
+    return hash;
+}
+
+inline constexpr uint64_t kHashSeed = 0xcbf29ce484222325;
+
+inline uint64_t Hash(std::string_view data) {
+    return HashBytes(kHashSeed ^ data.size(), data);
+}
+
+struct Source {
+    std::string path;
+    // Max for files that don't exist.
+    uint64_t size = 0;
+    uint64_t hash = 0;
+    // Modification time in the ticks of the file clock.
+    int64_t time = 0;
+
+    static Source Read(const std::string& path) {
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(path, error)) {
+            return {path, std::numeric_limits<uint64_t>::max(), 0, 0};
+        }
+        int64_t time = GetTime(path);
+        // Hashed a piece at a time, each dropped from memory after it, so that checking a large
+        // OBJ file doesn't make all of it resident.
+        constexpr size_t kPiece = 1 << 20;
+        MappedFile file(path);
+        std::string_view text = file.GetText();
+        uint64_t hash = kHashSeed ^ text.size();
+        for (size_t offset = 0; offset < text.size(); offset += kPiece) {
+            std::string_view piece = text.substr(offset, kPiece);
+            hash = HashBytes(hash, piece);
+            madvise(const_cast<char*>(piece.data()), piece.size(), MADV_DONTNEED);
+        }
+        return {path, text.size(), hash, time};
+    }
+
+    // Whether the file still has the contents it had. Only a file whose size or modification
+    // time changed is hashed again, which sets `rehashed`.
+    bool IsFresh(bool* rehashed = nullptr) const {
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(path, error)) {
+            return size == std::numeric_limits<uint64_t>::max();
+        }
+        uint64_t current_size = std::filesystem::file_size(path, error);
+        if (!error && current_size == size && GetTime(path) == time) {
+            return true;
+        }
+        if (rehashed) {
+            *rehashed = true;
+        }
+        Source current = Read(path);
+        return current.size == size && current.hash == hash;
+    }
+
+    static int64_t GetTime(const std::string& path) {
+        std::error_code error;
+        auto time = std::filesystem::last_write_time(path, error);
+        return error ? 0 : time.time_since_epoch().count();
+    }
+
+    template <class Self, class Visitor>
+    static void VisitFields(Self& self, Visitor&& visit) {
+        visit(self.path);
+        visit(self.size);
+        visit(self.hash);
+        visit(self.time);
+    }
+};
+
+// The sources of a scene about to be cached. A file that is missing makes the scene whatever
+// parsing made of nothing, which is not worth keeping, so that throws.
+inline std::vector<Source> ReadSources(const Scene& scene) {
+    std::vector<Source> sources;
+    for (const auto& path : scene.GetSources()) {
+        sources.push_back(Source::Read(path));
+        if (sources.back().size == std::numeric_limits<uint64_t>::max()) {
+            throw std::runtime_error("Not caching a scene with a missing file: " + path);
+        }
+    }
+    return sources;
+}
+
+template <class T>
+concept HasFields = requires(T& value) { T::VisitFields(value, [](auto&) {}); };
+
+template <class T>
+struct IsVector : std::false_type {};
+
+template <class T, class A>
+struct IsVector<std::vector<T, A>> : std::true_type {};
+
+template <class T>
+struct IsMap : std::false_type {};
+
+template <class K, class V, class C, class A>
+struct IsMap<std::map<K, V, C, A>> : std::true_type {};
+
+class Writer {
+public:
+    // Without `keep_data`, the writer only counts the bytes it is given.
+    explicit Writer(bool keep_data = true) : keep_data_(keep_data) {
+    }
+
+    template <class T>
+    void Write(const T& value) {
+        if constexpr (HasFields<T>) {
+            T::VisitFields(value, [this](const auto& field) { Write(field); });
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            WriteBytes(value.size(), value.data(), value.size());
+        } else if constexpr (IsVector<T>::value) {
+            if constexpr (std::is_trivially_copyable_v<typename T::value_type>) {
+                WriteBytes(value.size(), value.data(), value.size() * sizeof(value[0]));
+            } else {
+                Write(static_cast<uint64_t>(value.size()));
+                for (const auto& item : value) {
+                    Write(item);
+                }
+            }
+        } else if constexpr (IsMap<T>::value) {
+            Write(static_cast<uint64_t>(value.size()));
+            for (const auto& [key, item] : value) {
+                Write(key);
+                Write(item);
+            }
+        } else {
+            static_assert(std::is_trivially_copyable_v<T>);
+            Append(&value, sizeof(T));
+        }
+    }
+
+    const std::string& GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    void WriteBytes(uint64_t count, const void* data, size_t size) {
+        Write(count);
+        Append(data, size);
+    }
+
+    void Append(const void* data, size_t size) {
+        if (keep_data_) {
+            data_.append(static_cast<const char*>(data), size);
+        }
+        size_ += size;
+    }
+
+    bool keep_data_;
+    std::string data_;
+    size_t size_ = 0;
+};
+
+// Reads what Writer wrote from a buffer, which need not be aligned. Throws on data that runs past
+// the end of the buffer.
+class Reader {
+public:
+    explicit Reader(std::string_view data) : data_(data) {
+    }
+
+    template <class T>
+    void Read(T& value) {
+        if constexpr (HasFields<T>) {
+            T::VisitFields(value, [this](auto& field) { Read(field); });
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            size_t size = ReadCount(1);
+            value.assign(Take(size), size);
+        } else if constexpr (IsVector<T>::value) {
+            using Item = typename T::value_type;
+            if constexpr (std::is_trivially_copyable_v<Item>) {
+                size_t count = ReadCount(sizeof(Item));
+                const char* data = Take(count * sizeof(Item));
+                value.clear();
+                if constexpr (std::is_default_constructible_v<Item>) {
+                    value.resize(count);
+                    std::memcpy(value.data(), data, count * sizeof(Item));
+                } else {
+                    value.reserve(count);
+                    for (size_t i = 0; i != count; ++i) {
+                        std::array<char, sizeof(Item)> bytes;
+                        std::memcpy(bytes.data(), data + i * sizeof(Item), sizeof(Item));
+                        value.push_back(std::bit_cast<Item>(bytes));
+                    }
+                }
+            } else {
+                value.clear();
+                value.resize(ReadCount(1));
+                for (auto& item : value) {
+                    Read(item);
+                }
+            }
+        } else if constexpr (IsMap<T>::value) {
+            value.clear();
+            for (size_t count = ReadCount(1); count != 0; --count) {
+                typename T::key_type key;
+                typename T::mapped_type item;
+                Read(key);
+                Read(item);
+                value.emplace_hint(value.end(), std::move(key), std::move(item));
+            }
+        } else {
+            static_assert(std::is_trivially_copyable_v<T>);
+            std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        }
+    }
+
+    bool IsAtEnd() const {
+        return data_.empty();
+    }
+
+private:
+    const char* Take(size_t size) {
+        if (size > data_.size()) {
+            throw std::runtime_error("Corrupt scene cache");
+        }
+        const char* data = data_.data();
+        data_.remove_prefix(size);
+        return data;
+    }
+
+    // Number of items that follows, each taking at least `item_size` bytes.
+    size_t ReadCount(size_t item_size) {
+        uint64_t count;
+        Read(count);
+        if (count > data_.size() / item_size) {
+            throw std::runtime_error("Corrupt scene cache");
+        }
+        return count;
+    }
+
+    std::string_view data_;
+};
+
+}  // namespace scene_cache
+
+inline std::string GetSceneCachePath(const std::string& filename) {
+    return filename + ".rtcache";
+}
+
+// Writes the scene and the hierarchies built for it to the cache file of `filename`. The file is
+// replaced as a whole, so concurrent readers and writers see either cache completely.
+inline void WriteSceneCache(const std::string& filename, const Scene& scene,
+                            const Accelerator& accelerator) {
+    using namespace scene_cache;
+    Header header;
+    header.bvh_width = accelerator.GetBvhWidth();
+    std::vector<Source> sources = ReadSources(scene);
+    Writer writer;
+    writer.Write(header);
+    writer.Write(sources);
+    writer.Write(scene);
+    writer.Write(accelerator.GetMeshHierarchies());
+    writer.Write(accelerator.GetTopHierarchy());
+    writer.Write(Hash(writer.GetData()));
+
+    std::string path = GetSceneCachePath(filename);
+    std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    out.write(writer.GetData().data(), writer.GetData().size());
+    out.close();
+    std::error_code error;
+    if (!out || (std::filesystem::rename(temporary, path, error), error)) {
+        std::filesystem::remove(temporary, error);
+        throw std::runtime_error("Can't write scene cache " + path);
+    }
+}
+
+// Reads the header and the sources of a scene cache of `filename`, leaving `reader` at the scene.
+// False when the cache is for another build, BVH width or OBJ file, or a source changed.
+// `rehashed` is set when a source had to be hashed again to tell.
+inline bool ReadSceneCacheHeader(scene_cache::Reader& reader, const std::string& filename,
+                                 int bvh_width, bool* rehashed = nullptr) {
+    using namespace scene_cache;
+    Header header;
+    Header expected;
+    expected.bvh_width = bvh_width;
+    reader.Read(header);
+    if (header != expected) {
+        return false;
+    }
+    std::vector<Source> sources;
+    reader.Read(sources);
+    if (sources.empty() || sources[0].path != filename) {
+        return false;
+    }
+    return std::all_of(sources.begin(), sources.end(),
+                       [rehashed](const Source& source) { return source.IsFresh(rehashed); });
+}
+
+// Whether the scene cache of `filename` is fresh and all its bytes match the hash it ends with.
+// Loading a cache skips that hash, which would read all of it: caches are replaced by rename,
+// so only damage to the file afterwards makes it differ.
+inline bool IsSceneCacheIntact(const std::string& filename, int bvh_width) {
+    MappedFile file(GetSceneCachePath(filename));
+    std::string_view text = file.GetText();
+    uint64_t hash;
+    if (text.size() < sizeof(hash)) {
+        return false;
+    }
+    try {
+        scene_cache::Reader reader(text);
+        if (!ReadSceneCacheHeader(reader, filename, bvh_width)) {
+            return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    std::memcpy(&hash, text.data() + text.size() - sizeof(hash), sizeof(hash));
+    return scene_cache::Hash(text.substr(0, text.size() - sizeof(hash))) == hash;
+}
+
+// Triangles of an OBJ file kept out of core, in `<file>.obj.rtpages` next to it. The header
+// takes the first PagedGeometry::kAlignment bytes and the pages follow, each padded to that
+// alignment. After them come the sources, the scene without its own triangles and the page
+// table, written like the scene cache, then the hash of those and last their offset. Pages are
+// not hashed, since they are only read as rays reach them.
+namespace page_file {
+
+inline constexpr uint32_t kVersion = 2;
+
+// A page of this many triangles with its hierarchy takes about 1 MB in double precision.
+inline constexpr size_t kPageTriangles = 4096;
+
+// The OBJ file is converted this many bytes at a time.
+inline constexpr size_t kChunkSize = 16 << 20;
+
+struct Header {
+    std::array<char, 8> magic = {'R', 'T', 'P', 'A', 'G', 'E', 'S', '\0'};
+    uint32_t version = kVersion;
+    uint32_t scalar_size = sizeof(Scalar);
+    uint32_t triangle_size = sizeof(PackedTriangle);
+    uint32_t node_size = sizeof(Bvh::Node);
+    uint32_t byte_order = 0x01020304;
+
+    bool operator==(const Header&) const = default;
+};
+
+// A triangle on its way from the parser to its page.
+struct Record {
+    PackedTriangle triangle;
+    std::array<Vector, 3> normals;
+    MaterialId material;
+    uint32_t has_normals;
+};
+
+// The bits of a 10-bit value spread out to every third bit.
+inline uint32_t SpreadBits(uint32_t x) {
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+// Position of the point on a Morton curve through a 1024^3 grid over `bounds`.
+inline uint32_t GetMortonCode(const Vector& point, const BoundingBox& bounds) {
+    uint32_t code = 0;
+    for (int i = 0; i != 3; ++i) {
+        double extent = bounds.GetMax()[i] - bounds.GetMin()[i];
+        double t = extent > 0 ? (point[i] - bounds.GetMin()[i]) / extent : 0;
+        code |= SpreadBits(std::clamp(static_cast<int>(t * 1024), 0, 1023)) << i;
+    }
+    return code;
+}
+
+// Builds the page of the records in `keys`, whose low 32 bits are record indices. Triangles are
+// stored in the order the leaves of the page's hierarchy list them.
+inline std::string BuildPage(const Record* records, std::span<const uint64_t> keys,
+                             PagedGeometry::PageInfo& info) {
+    std::vector<BoundingBox> boxes;
+    boxes.reserve(keys.size());
+    for (uint64_t key : keys) {
+        boxes.push_back(GetBoundingBox(records[static_cast<uint32_t>(key)].triangle));
+    }
+    Bvh bvh(boxes);
+    std::vector<uint32_t> indices(keys.size());
+    std::vector<PackedTriangle> triangles;
+    std::vector<std::array<Vector, 3>> normals;
+    std::vector<uint32_t> normal_ids;
+    std::vector<MaterialId> materials;
+    for (size_t i = 0; i != keys.size(); ++i) {
+        const Record& record = records[static_cast<uint32_t>(keys[bvh.GetIndices()[i]])];
+        indices[i] = i;
+        triangles.push_back(record.triangle);
+        normal_ids.push_back(record.has_normals ? normals.size() : PagedGeometry::kNoNormals);
+        if (record.has_normals) {
+            normals.push_back(record.normals);
+        }
+        materials.push_back(record.material);
+    }
+
+    info.bounds = bvh.GetNodes()[0].box;
+    info.node_count = bvh.GetNodes().size();
+    info.triangle_count = triangles.size();
+    info.normal_count = normals.size();
+    auto layout = PagedGeometry::GetLayout(info.node_count, info.triangle_count,
+                                           info.normal_count);
+    info.size = layout.size;
+    constexpr size_t kAlignment = PagedGeometry::kAlignment;
+    std::string page((layout.size + kAlignment - 1) / kAlignment * kAlignment, '\0');
+    auto copy = [&page](size_t offset, const auto& items) {
+        std::memcpy(page.data() + offset, items.data(), items.size() * sizeof(items[0]));
+    };
+    copy(0, bvh.GetNodes());
+    copy(layout.triangles, triangles);
+    copy(layout.normals, normals);
+    copy(layout.indices, indices);
+    copy(layout.normal_ids, normal_ids);
+    copy(layout.materials, materials);
+    return page;
+}
+
+}  // namespace page_file
+
+inline std::string GetPageFilePath(const std::string& filename) {
+    return filename + ".rtpages";
+}
+
+// Converts the OBJ file into its page file. The file is parsed a part at a time and its triangles
+// go through a temporary file, so memory holds little more than the vertices and normals of the
+// OBJ file and a key per triangle. Pages are runs of triangles along a Morton curve through their
+// centers; instanced meshes, spheres and lights stay in the scene part.
+inline void WritePageFile(const std::string& filename) {
+    using namespace page_file;
+    using scene_cache::Source;
+    const std::string path = GetPageFilePath(filename);
+    const std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    const std::string records_path = temporary + ".triangles";
+
+    BoundingBox centers;
+    size_t count = 0;
+    std::ofstream records_out(records_path, std::ios::binary);
+    Scene scene = ReadScene(filename, kChunkSize, [&](TriangleStore&& part) {
+        for (size_t i = 0; i != part.GetSize(); ++i) {
+            Record record{part.GetTriangle(i), {}, part.GetMaterial(i), 0};
+            if (const auto* normals = part.GetNormals(i)) {
+                record.normals = *normals;
+                record.has_normals = 1;
+            }
+            centers.Extend(GetBoundingBox(record.triangle).GetCenter());
+            records_out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+        count += part.GetSize();
+    });
+    records_out.close();
+    MappedFile records_file(records_path);
+    std::filesystem::remove(records_path);
+    const std::vector<Source> sources = scene_cache::ReadSources(scene);
+    if (!records_out || records_file.GetText().size() != count * sizeof(Record)) {
+        throw std::runtime_error("Can't write triangles to " + records_path);
+    }
+    if (count > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Too many triangles for a page file: " + filename);
+    }
+    const auto* records = reinterpret_cast<const Record*>(records_file.GetText().data());
+
+    // Morton code in the high half, record index in the low one.
+    std::vector<uint64_t> keys(count);
+    const int threads = GetDefaultThreadCount();
+    ParallelFor((count + kPageTriangles - 1) / kPageTriangles, threads, [&](size_t block) {
+        for (size_t i = block * kPageTriangles; i != std::min(count, (block + 1) * kPageTriangles);
+             ++i) {
+            Vector center = GetBoundingBox(records[i].triangle).GetCenter();
+            keys[i] = static_cast<uint64_t>(GetMortonCode(center, centers)) << 32 | i;
+        }
+    });
+    std::sort(keys.begin(), keys.end());
+
+    std::ofstream out(temporary, std::ios::binary);
+    std::string header(PagedGeometry::kAlignment, '\0');
+    Header fields;
+    std::memcpy(header.data(), &fields, sizeof(fields));
+    out.write(header.data(), header.size());
+    uint64_t offset = header.size();
+    std::vector<PagedGeometry::PageInfo> pages((count + kPageTriangles - 1) / kPageTriangles);
+    std::vector<std::string> batch(static_cast<size_t>(threads) * 4);
+    for (size_t first = 0; first < pages.size(); first += batch.size()) {
+        const size_t size = std::min(batch.size(), pages.size() - first);
+        ParallelFor(size, threads, [&](size_t k) {
+            size_t begin = (first + k) * kPageTriangles;
+            size_t end = std::min(count, begin + kPageTriangles);
+            batch[k] = BuildPage(records, std::span(keys).subspan(begin, end - begin),
+                                 pages[first + k]);
+        });
+        for (size_t k = 0; k != size; ++k) {
+            pages[first + k].offset = offset;
+            out.write(batch[k].data(), batch[k].size());
+            offset += batch[k].size();
+        }
+    }
+
+    scene_cache::Writer writer;
+    writer.Write(sources);
+    writer.Write(scene);
+    writer.Write(pages);
+    uint64_t hash = scene_cache::Hash(writer.GetData());
+    out.write(writer.GetData().data(), writer.GetData().size());
+    out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    out.close();
+    std::error_code error;
+    if (!out || (std::filesystem::rename(temporary, path, error), error)) {
+        std::filesystem::remove(temporary, error);
+        throw std::runtime_error("Can't write page file " + path);
+    }
+}
+
+// The scene of the OBJ file with its own triangles in the page file, of which at most `budget`
+// bytes are resident at a time. Nothing when the page file is missing or stale.
+inline std::optional<Scene> ReadPageFile(const std::string& filename, size_t budget) {
+    using namespace page_file;
+    using scene_cache::Source;
+    MappedFile file(GetPageFilePath(filename));
+    std::string_view text = file.GetText();
+    constexpr size_t kTail = 2 * sizeof(uint64_t);
+    Header header;
+    if (text.size() < PagedGeometry::kAlignment + kTail ||
+        std::memcmp(text.data(), &header, sizeof(header)) != 0) {
+        return {};
+    }
+    uint64_t hash;
+    uint64_t offset;
+    std::memcpy(&hash, text.data() + text.size() - kTail, sizeof(hash));
+    std::memcpy(&offset, text.data() + text.size() - sizeof(offset), sizeof(offset));
+    if (offset < PagedGeometry::kAlignment || offset > text.size() - kTail) {
+        throw std::runtime_error("Corrupt page file " + GetPageFilePath(filename));
+    }
+    std::string_view trailer = text.substr(offset, text.size() - kTail - offset);
+    scene_cache::Reader reader(trailer);
+    std::vector<Source> sources;
+    reader.Read(sources);
+    if (sources.empty() || sources[0].path != filename) {
+        return {};
+    }
+    for (const auto& source : sources) {
+        if (!source.IsFresh()) {
+            return {};
+        }
+    }
+    if (scene_cache::Hash(trailer) != hash) {
+        throw std::runtime_error("Corrupt page file " + GetPageFilePath(filename));
+    }
+    Scene scene;
+    std::vector<PagedGeometry::PageInfo> pages;
+    reader.Read(scene);
+    reader.Read(pages);
+    if (!reader.IsAtEnd()) {
+        throw std::runtime_error("Corrupt page file " + GetPageFilePath(filename));
+    }
+    scene.SetPagedGeometry(
+        std::make_shared<const PagedGeometry>(std::move(file), std::move(pages), budget));
+    return scene;
+}
+
+// A scene with its acceleration structure, taken from the scene cache when it is fresh and parsed
+// and built otherwise. A cache that can't be used is rewritten.
+class LoadedScene {
+public:
+    // With a geometry budget, the triangles of the OBJ file are read from its page file instead,
+    // which is written first when it is missing or stale; the scene cache is not used then.
+    LoadedScene(const std::string& filename, int bvh_width, bool use_cache = true,
+                size_t geometry_budget = 0) {
+        if (!std::filesystem::is_regular_file(filename)) {
+            throw std::runtime_error("Can't open obj file " + filename);
+        }
+        if (geometry_budget > 0) {
+            LoadPages(filename, geometry_budget);
+            accelerator_.emplace(scene_, bvh_width);
+            return;
+        }
+        if (use_cache && Load(filename, bvh_width)) {
+            return;
+        }
+        scene_ = ReadScene(filename);
+        accelerator_.emplace(scene_, bvh_width);
+        if (use_cache) {
+            try {
+                WriteSceneCache(filename, scene_, *accelerator_);
+            } catch (const std::exception& e) {
+                std::cerr << "warning: " << e.what() << "\n";
+            }
+        }
+    }
+
+    LoadedScene(const std::string& filename, const RenderOptions& render_options)
+        : LoadedScene(filename, render_options.bvh_width, render_options.scene_cache,
+                      static_cast<size_t>(render_options.geometry_budget_mb) << 20) {
+    }
+
+    LoadedScene(const LoadedScene&) = delete;
+    LoadedScene& operator=(const LoadedScene&) = delete;
+
+    Scene& GetScene() {
+        return scene_;
+    }
+
+    Accelerator& GetAccelerator() {
+        return *accelerator_;
+    }
+
+    // Bytes of the scene and its acceleration structure as the cache stores them, which is close
+    // to the memory they take, plus the budget of paged geometry.
+    size_t GetSize() const {
+        scene_cache::Writer counter(false);
+        counter.Write(scene_);
+        counter.Write(accelerator_->GetMeshHierarchies());
+        counter.Write(accelerator_->GetTopHierarchy());
+        const PagedGeometry* paged = scene_.GetPagedGeometry();
+        return counter.GetSize() + (paged ? paged->GetBudget() : 0);
+    }
+
+private:
+    void LoadPages(const std::string& filename, size_t budget) {
+        std::optional<Scene> scene;
+        try {
+            scene = ReadPageFile(filename, budget);
+        } catch (const std::exception& e) {
+            std::cerr << "warning: " << e.what() << "\n";
+        }
+        if (!scene) {
+            WritePageFile(filename);
+            scene = ReadPageFile(filename, budget);
+        }
+        if (!scene) {
+            throw std::runtime_error("Can't read page file " + GetPageFilePath(filename));
+        }
+        scene_ = std::move(*scene);
+    }
+
+    bool Load(const std::string& filename, int bvh_width) {
+        using namespace scene_cache;
+        MappedFile file(GetSceneCachePath(filename));
+        if (file.GetText().empty()) {
+            return false;
+        }
+        try {
+            Reader reader(file.GetText());
+            bool rehashed = false;
+            if (!ReadSceneCacheHeader(reader, filename, bvh_width, &rehashed)) {
+                return false;
+            }
+            // The arrays must fill the file exactly; the hash at its end is not checked here.
+            std::vector<Hierarchy> meshes;
+            Hierarchy top;
+            reader.Read(scene_);
+            reader.Read(meshes);
+            reader.Read(top);
+            uint64_t hash;
+            reader.Read(hash);
+            if (!reader.IsAtEnd()) {
+                throw std::runtime_error("Corrupt scene cache");
+            }
+            accelerator_.emplace(scene_, std::move(meshes), std::move(top));
+            // A source that was touched without changing would be hashed again by every load.
+            if (rehashed) {
+                try {
+                    WriteSceneCache(filename, scene_, *accelerator_);
+                } catch (const std::exception& e) {
+                    std::cerr << "warning: " << e.what() << "\n";
+                }
+            }
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "warning: " << e.what() << " " << GetSceneCachePath(filename) << "\n";
+            scene_ = Scene();
+            return false;
+        }
+    }
+
+    Scene scene_;
+    std::optional<Accelerator> accelerator_;
+};
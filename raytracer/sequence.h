@@ -0,0 +1,51 @@
+#pragma once
+
+#include "raytracer.h"
+#include "frame_options.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// `out.png` becomes `out_0000.png`, `out_0001.png`, ...
+inline std::string GetFramePath(const std::string& output, size_t frame) {
+    std::filesystem::path path(output);
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04zu", frame);
+    std::string name = path.stem().string() + number + path.extension().string();
+    return (path.parent_path() / name).string();
+}
+
+// Renders an animation from a scene loaded once. Moved instances only refit the top level of the
+// acceleration structure; it is rebuilt when the refit tree becomes too slow to traverse.
+inline void RenderSequence(const std::string& filename, const std::string& output,
+                           const CameraOptions& camera_options,
+                           const RenderOptions& render_options,
+                           const std::vector<FrameOptions>& frames) {
+    LoadedScene loaded(filename, render_options);
+    Scene& scene = loaded.GetScene();
+    Accelerator& accelerator = loaded.GetAccelerator();
+    CameraOptions camera = camera_options;
+
+    for (size_t i = 0; i != frames.size(); ++i) {
+        const auto& frame = frames[i];
+        if (frame.fov.has_value()) {
+            camera.fov = *frame.fov;
+        }
+        if (frame.look_from.has_value()) {
+            camera.look_from = *frame.look_from;
+        }
+        if (frame.look_to.has_value()) {
+            camera.look_to = *frame.look_to;
+        }
+        for (const auto& [instance, to_world] : frame.transforms) {
+            scene.SetInstanceTransform(instance, to_world);
+        }
+        if (!frame.transforms.empty()) {
+            accelerator.Refit();
+        }
+        WriteFrame(RenderFrame(scene, accelerator, camera, render_options), render_options,
+                   GetFramePath(output, i));
+    }
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// CPUs the process may run on, further limited by the CPU quota of its cgroup: containers are
+// usually given a quota rather than fewer CPUs.
+inline int GetDefaultThreadCount() {
+    int cpus = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = std::max(1, CPU_COUNT(&set));
+    }
+
+    auto limit_by = [&cpus](double quota, double period) {
+        if (quota > 0 && period > 0) {
+            cpus = std::clamp(static_cast<int>(std::ceil(quota / period)), 1, cpus);
+        }
+    };
+
+    // cgroup v2 keeps "<quota|max> <period>" in cpu.max of the process's own group.
+    std::string group;
+    std::ifstream cgroups("/proc/self/cgroup");
+    for (std::string line; std::getline(cgroups, line);) {
+        if (line.starts_with("0::")) {
+            group = line.substr(3);
+        }
+    }
+    for (const std::string& path :
+         {"/sys/fs/cgroup" + group + "/cpu.max", std::string("/sys/fs/cgroup/cpu.max")}) {
+        std::ifstream file(path);
+        std::string quota;
+        double period = 0;
+        if (file >> quota >> period) {
+            if (quota != "max") {
+                limit_by(std::stod(quota), period);
+            }
+            return cpus;
+        }
+    }
+
+    // cgroup v1 has a quota of -1 when unlimited.
+    std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    double quota = 0;
+    double period = 0;
+    if (quota_file >> quota && period_file >> period) {
+        limit_by(quota, period);
+    }
+    return cpus;
+}
+
+// Threads that help ParallelFor, kept for the life of the process. A thread is started when a
+// helper is posted and no thread is idle, so calls made from inside tasks get helpers of their
+// own. A forked child starts without threads: the ones of the parent don't exist in it.
+class ThreadPool {
+public:
+    static ThreadPool& Get() {
+        // Never destroyed: its threads may still wait for work when the process exits.
+        static ThreadPool* pool = new ThreadPool();
+        return *pool;
+    }
+
+    void Post(std::function<void()> helper) {
+        std::lock_guard lock(state_->mutex);
+        state_->helpers.push_back(std::move(helper));
+        if (state_->idle < state_->helpers.size()) {
+            std::thread([state = state_] { Run(*state); }).detach();
+        } else {
+            state_->ready.notify_one();
+        }
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> helpers;
+        size_t idle = 0;
+    };
+
+    ThreadPool() : state_(new State()) {
+        pthread_atfork([] { Get().state_->mutex.lock(); }, [] { Get().state_->mutex.unlock(); },
+                       [] {
+                           // The state may belong to threads that are gone; it is left as it is.
+                           Get().state_ = new State();
+                       });
+    }
+
+    static void Run(State& state) {
+        std::unique_lock lock(state.mutex);
+        while (true) {
+            ++state.idle;
+            state.ready.wait(lock, [&state] { return !state.helpers.empty(); });
+            --state.idle;
+            std::function<void()> helper = std::move(state.helpers.front());
+            state.helpers.pop_front();
+            lock.unlock();
+            helper();
+            helper = nullptr;
+            lock.lock();
+        }
+    }
+
+    State* state_;
+};
+
+namespace parallel_for {
+
+// One call of ParallelFor. Every thread starts with a contiguous share of the indices and works
+// through it from the back; once it runs dry it steals from the front of the other shares.
+class Job {
+public:
+    Job(size_t count, size_t workers, void (*run)(void*, size_t), void* task)
+        : queues_(std::make_unique<Queue[]>(workers)), workers_(workers), run_(run), task_(task) {
+        for (size_t w = 0; w != workers; ++w) {
+            queues_[w].begin = count * w / workers;
+            queues_[w].end = count * (w + 1) / workers;
+        }
+    }
+
+    // Runs tasks as thread `self` until none are left.
+    void Work(size_t self) {
+        try {
+            for (size_t victim = self, checked = 0; checked != workers_;) {
+                size_t index;
+                {
+                    Queue& queue = queues_[victim];
+                    std::lock_guard lock(queue.mutex);
+                    if (queue.begin == queue.end) {
+                        victim = (victim + 1) % workers_;
+                        ++checked;
+                        continue;
+                    }
+                    index = victim == self ? --queue.end : queue.begin++;
+                }
+                run_(task_, index);
+                checked = 0;
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            // Drop the remaining work.
+            for (size_t w = 0; w != workers_; ++w) {
+                std::lock_guard queue_lock(queues_[w].mutex);
+                queues_[w].begin = queues_[w].end;
+            }
+        }
+    }
+
+    // Work of a pool thread, which does nothing once the caller has finished.
+    void Help(size_t self) {
+        {
+            std::lock_guard lock(mutex_);
+            if (closed_) {
+                return;
+            }
+            ++active_;
+        }
+        Work(self);
+        std::lock_guard lock(mutex_);
+        if (--active_ == 0) {
+            finished_.notify_all();
+        }
+    }
+
+    // Called by the caller once its own Work returns, when no task is left to start. Waits for
+    // the helpers that are still running one; those that haven't started won't.
+    void Finish() {
+        std::unique_lock lock(mutex_);
+        closed_ = true;
+        finished_.wait(lock, [this] { return active_ == 0; });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    // Indices [begin, end) that are still to be run.
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+    };
+
+    std::unique_ptr<Queue[]> queues_;
+    size_t workers_;
+    void (*run_)(void*, size_t);
+    void* task_;
+
+    std::mutex mutex_;
+    std::condition_variable finished_;
+    size_t active_ = 0;
+    bool closed_ = false;
+    std::exception_ptr error_;
+};
+
+}  // namespace parallel_for
+
+// Calls task(index) for every index in [0, count) on up to `threads` threads: the calling one and
+// helpers from the ThreadPool. Every thread starts with a contiguous share of the indices and
+// works through it from the back; once it runs dry it steals from the front of the other shares,
+// so a few expensive tasks do not leave the remaining threads idle. The caller never waits for a
+// helper to start, so calls may nest. The first exception thrown by a task is rethrown after all
+// threads have stopped.
+template <class Task>
+void ParallelFor(size_t count, int threads, Task&& task) {
+    size_t workers = std::clamp<size_t>(threads, 1, std::max<size_t>(count, 1));
+    if (workers == 1) {
+        for (size_t i = 0; i != count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    using TaskType = std::remove_reference_t<Task>;
+    auto job = std::make_shared<parallel_for::Job>(
+        count, workers, [](void* task, size_t index) { (*static_cast<TaskType*>(task))(index); },
+        const_cast<void*>(static_cast<const void*>(std::addressof(task))));
+    for (size_t w = 1; w != workers; ++w) {
+        ThreadPool::Get().Post([job, w] { job->Help(w); });
+    }
+    job->Work(0);
+    job->Finish();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+
+// Helpers shared by the benchmarks.
+
+using Clock = std::chrono::steady_clock;
+
+inline double Seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// RMS difference of the 8-bit channels of two images of the same size, taken as an Image type
+// with Width, Height and GetPixel giving r, g and b.
+template <class Image>
+double GetError(const Image& image, const Image& reference) {
+    double sum = 0;
+    for (int y = 0; y != image.Height(); ++y) {
+        for (int x = 0; x != image.Width(); ++x) {
+            auto a = image.GetPixel(y, x);
+            auto b = reference.GetPixel(y, x);
+            sum += (a.r - b.r) * (a.r - b.r) + (a.g - b.g) * (a.g - b.g) +
+                   (a.b - b.b) * (a.b - b.b);
+        }
+    }
+    return std::sqrt(sum / (3.0 * image.Width() * image.Height()));
+}